@@ -0,0 +1,41 @@
+#!/bin/sh
+# Compare benchmark results against a baseline, both with one JSON record
+# per line as written by run.sh.
+#
+# Usage: compare.sh BASELINE RESULTS
+set -e
+
+awk '
+function field(line, name,    m) {
+    if (match(line, "\"" name "\":(\"[^\"]*\"|[^,}]*)") == 0)
+        return ""
+    m = substr(line, RSTART + length(name) + 3, RLENGTH - length(name) - 3)
+    gsub("\"", "", m)
+    return m
+}
+function change(new, old) {
+    if (old == "" || old == "null" || new == "null" || old == 0)
+        return "-"
+    return sprintf("%+.0f%%", (new - old) / old * 100)
+}
+FILENAME == ARGV[1] {
+    key = field($0, "graph") " " field($0, "flags")
+    wall[key] = field($0, "wall_ms")
+    rss[key] = field($0, "max_rss_kb")
+    calls[key] = field($0, "syscalls")
+    next
+}
+FNR == 1 {
+    printf "%-8s %-5s %12s %8s %10s %8s %10s %8s\n", "graph", "flags",
+        "wall (ms)", "change", "rss (KiB)", "change", "syscalls", "change"
+}
+{
+    key = field($0, "graph") " " field($0, "flags")
+    w = field($0, "wall_ms")
+    r = field($0, "max_rss_kb")
+    c = field($0, "syscalls")
+    printf "%-8s %-5s %12s %8s %10s %8s %10s %8s\n", field($0, "graph"),
+        field($0, "flags"), w, change(w, wall[key]), r, change(r, rss[key]),
+        c, change(c, calls[key])
+}
+' "$1" "$2"
@@ -0,0 +1,111 @@
+#!/bin/sh
+# Generate synthetic dependency graphs in directory $1. Every graph has a
+# root.so to run libtree on. Sizes can be tuned through the environment.
+set -e
+
+out=$1
+CC=${CC:-cc}
+FANOUT=${FANOUT:-256}
+CHAIN=${CHAIN:-31}
+LAYERS=${LAYERS:-8}
+WIDTH=${WIDTH:-8}
+RPATH_DEPTH=${RPATH_DEPTH:-16}
+RPATH_DECOYS=${RPATH_DECOYS:-8}
+DIRS=${DIRS:-200}
+DIR_LIBS=${DIR_LIBS:-32}
+
+# mklib PATH [LINKER ARGS]...: a library without symbols or libc, whose
+# soname is its file name.
+mklib() {
+    path=$1
+    shift
+    echo 'int x;' | $CC -shared -nostdlib -Wl,--no-as-needed \
+        "-Wl,-soname,$(basename "$path")" -o "$path" "$@" -x c -
+}
+
+rm -rf "$out"
+mkdir -p "$out"
+
+# Wide fan-out: a single library that needs many others.
+mkdir -p "$out/fanout/lib"
+deps=
+for i in $(seq 1 "$FANOUT"); do
+    mklib "$out/fanout/lib/libfan_$i.so"
+    deps="$deps lib/libfan_$i.so"
+done
+(cd "$out/fanout" && mklib root.so -Wl,--enable-new-dtags \
+    '-Wl,-rpath,$ORIGIN/lib' $deps)
+
+# Deep chain: root.so -> libchain_1.so -> ... -> libchain_$CHAIN.so
+mkdir -p "$out/chain"
+mklib "$out/chain/libchain_$CHAIN.so"
+for i in $(seq $((CHAIN - 1)) -1 1); do
+    (cd "$out/chain" && mklib "libchain_$i.so" '-Wl,-rpath,$ORIGIN' \
+        "libchain_$((i + 1)).so")
+done
+(cd "$out/chain" && mklib root.so '-Wl,-rpath,$ORIGIN' libchain_1.so)
+
+# Diamonds: $LAYERS layers of $WIDTH libraries, each needing three
+# libraries of the next layer, so that many paths lead to the same library.
+mkdir -p "$out/diamond"
+layer=$LAYERS
+for j in $(seq 1 "$WIDTH"); do
+    mklib "$out/diamond/libdiamond_${layer}_$j.so"
+done
+for layer in $(seq $((LAYERS - 1)) -1 1); do
+    for j in $(seq 1 "$WIDTH"); do
+        deps=
+        for k in 0 1 2; do
+            dep=$(((j + k - 1) % WIDTH + 1))
+            deps="$deps libdiamond_$((layer + 1))_$dep.so"
+        done
+        (cd "$out/diamond" && mklib "libdiamond_${layer}_$j.so" \
+            -Wl,--enable-new-dtags '-Wl,-rpath,$ORIGIN' $deps)
+    done
+done
+deps=
+for j in $(seq 1 "$WIDTH"); do
+    deps="$deps libdiamond_1_$j.so"
+done
+(cd "$out/diamond" && mklib root.so -Wl,--enable-new-dtags \
+    '-Wl,-rpath,$ORIGIN' $deps)
+
+# Long rpath stacks: every library lives in its own directory and only the
+# rpath of root.so, after many directories without libraries, locates them.
+# Every library adds its own decoy rpaths to the stack.
+mkdir -p "$out/rpath"
+decoys=
+for k in $(seq 1 "$RPATH_DECOYS"); do
+    mkdir -p "$out/rpath/empty_$k"
+    decoys="$decoys:\$ORIGIN/../empty_$k"
+done
+rpath=${decoys#:}
+dirs=
+for i in $(seq 1 "$RPATH_DEPTH"); do
+    mkdir -p "$out/rpath/d$i"
+    dirs="$dirs:\$ORIGIN/d$i"
+done
+mklib "$out/rpath/d$RPATH_DEPTH/librpath_$RPATH_DEPTH.so" \
+    -Wl,--disable-new-dtags "-Wl,-rpath,$rpath"
+for i in $(seq $((RPATH_DEPTH - 1)) -1 1); do
+    (cd "$out/rpath/d$i" && mklib "librpath_$i.so" -Wl,--disable-new-dtags \
+        "-Wl,-rpath,$rpath" "../d$((i + 1))/librpath_$((i + 1)).so")
+done
+(cd "$out/rpath" && mklib root.so -Wl,--disable-new-dtags \
+    "-Wl,-rpath,${decoys#:}$dirs" d1/librpath_1.so)
+
+# Many search directories: libraries live in the last of $DIRS directories,
+# which are passed through LD_LIBRARY_PATH by run.sh. This takes the same
+# code path as directories listed in ld.so.conf, which we can't change here.
+mkdir -p "$out/dirs"
+deps=
+for k in $(seq 1 "$DIRS"); do
+    mkdir -p "$out/dirs/d$k"
+done
+for i in $(seq 1 "$DIR_LIBS"); do
+    mklib "$out/dirs/d$DIRS/libdir_$i.so"
+    deps="$deps d$DIRS/libdir_$i.so"
+done
+(cd "$out/dirs" && mklib root.so $deps)
+
+touch "$out/.stamp"
@@ -0,0 +1,142 @@
+// Run a command a number of times with its output discarded, and print the
+// best wall time, the peak RSS and the number of system calls as JSON fields.
+// System calls are counted in one more run under ptrace, of all threads, and
+// are null when the command can't be traced.
+//
+// Usage: measure REPEAT COMMAND [ARGS]...
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_THREADS 1024
+
+static void exec_quietly(char **argv) {
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    dup2(fd, STDERR_FILENO);
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+// Run `argv` once under ptrace and return the number of system calls it and
+// its threads made, or -1.
+static long count_syscalls(char **argv) {
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+            _exit(126);
+        raise(SIGSTOP);
+        exec_quietly(argv);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                   PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                   PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)options) != 0 ||
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    // Every system call stops twice, on entry and on exit, so whether a
+    // thread is inside one is tracked to count entries only.
+    pid_t tids[MAX_THREADS];
+    char in_syscall[MAX_THREADS];
+    size_t n = 0;
+    long count = 0;
+    int code = -1;
+    pid_t tid;
+    while ((tid = waitpid(-1, &status, __WALL)) > 0) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (tid == pid)
+                code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            continue;
+        }
+        size_t i = 0;
+        while (i < n && tids[i] != tid)
+            ++i;
+        if (i == n && n < MAX_THREADS) {
+            tids[n] = tid;
+            in_syscall[n++] = 0;
+        }
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            if (i < n) {
+                count += !in_syscall[i];
+                in_syscall[i] = !in_syscall[i];
+            }
+            sig = 0;
+        } else if (sig == SIGTRAP || (status >> 16) != 0) {
+            // Events of the options, not signals for the tracee.
+            sig = 0;
+        } else if (sig == SIGSTOP && i < n && !in_syscall[i]) {
+            // New threads start with a SIGSTOP.
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, tid, NULL, (void *)(long)sig);
+    }
+    return code == 127 || code == 126 ? -1 : count;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fputs("Usage: measure REPEAT COMMAND [ARGS]...\n", stderr);
+        return 1;
+    }
+
+    int repeat = atoi(argv[1]);
+    double best = -1;
+    for (int i = 0; i < repeat; ++i) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pid_t pid = fork();
+        if (pid < 0)
+            return 1;
+        if (pid == 0)
+            exec_quietly(argv + 2);
+        int status;
+        if (waitpid(pid, &status, 0) < 0)
+            return 1;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+            fputs("measure: command failed\n", stderr);
+            return 1;
+        }
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+                    (end.tv_nsec - start.tv_nsec) / 1e6;
+        if (best < 0 || ms < best)
+            best = ms;
+    }
+
+    // The peak over all runs, which are the same command.
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    printf("\"wall_ms\":%.3f,\"max_rss_kb\":%ld", best, usage.ru_maxrss);
+
+    long syscalls = count_syscalls(argv + 2);
+    if (syscalls < 0)
+        printf(",\"syscalls\":null");
+    else
+        printf(",\"syscalls\":%ld", syscalls);
+    return 0;
+}
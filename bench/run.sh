@@ -0,0 +1,27 @@
+#!/bin/sh
+# Run LIBTREE over the graphs in OUT at every verbosity level, and print one
+# JSON record per run.
+#
+# Usage: run.sh LIBTREE OUT
+set -e
+
+libtree=$1
+out=$2
+REPEAT=${REPEAT:-5}
+
+dirs=$(ls -d "$out"/dirs/d* | tr '\n' ':')
+
+for graph in fanout chain diamond rpath dirs; do
+    for flags in '' -v -vv -vvv; do
+        if [ "$graph" = dirs ]; then
+            env="LD_LIBRARY_PATH=$dirs"
+        else
+            env="LD_LIBRARY_PATH="
+        fi
+        cmd="env $env $libtree $flags $out/$graph/root.so"
+
+        printf '{"graph":"%s","flags":"%s",' "$graph" "${flags:--}"
+        "$out/measure" "$REPEAT" $cmd
+        printf '}\n'
+    done
+done
@@ -1,15 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+// For copy_file_range.
+#define _GNU_SOURCE
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <glob.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef LIBTREE_LIBRARY
+#include "libtree.h"
+#endif
+
 #define VERSION "3.0.0-dev"
 
 #define ET_EXEC 2
@@ -21,10 +48,27 @@
 
 #define DT_NULL 0
 #define DT_NEEDED 1
+#define DT_PLTRELSZ 2
+#define DT_HASH 4
 #define DT_STRTAB 5
+#define DT_SYMTAB 6
+#define DT_RELA 7
+#define DT_RELASZ 8
+#define DT_RELAENT 9
+#define DT_STRSZ 10
 #define DT_SONAME 14
 #define DT_RPATH 15
+#define DT_RELSZ 18
+#define DT_RELENT 19
+#define DT_PLTREL 20
+#define DT_TEXTREL 22
+#define DT_BIND_NOW 24
 #define DT_RUNPATH 29
+#define DT_FLAGS 30
+#define DT_RELRSZ 35
+#define DT_RELR 36
+#define DF_TEXTREL 0x4
+#define DF_BIND_NOW 0x8
 
 #define ERR_INVALID_MAGIC 1
 #define ERR_INVALID_CLASS 2
@@ -47,11 +91,42 @@
 #define ERR_NO_PT_LOAD 19
 #define ERR_VADDRS_NOT_ORDERED 20
 
+#define LD_CACHE_MAGIC_OLD "ld.so-1.7.0"
+#define LD_CACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+
+#define FLAG_TYPE_MASK 0x00ff
+#define FLAG_ELF 0x0001
+#define FLAG_ELF_LIBC6 0x0003
+#define FLAG_REQUIRED_MASK 0xff00
+
+#define DT_RELACOUNT 0x6ffffff9
+#define DT_RELCOUNT 0x6ffffffa
 #define DT_FLAGS_1 0x6ffffffb
+#define DT_1_NOW 0x1
 #define DT_1_NODEFLIB 0x800
+#define DT_GNU_HASH 0x6ffffef5
+#define DT_VERSYM 0x6ffffff0
+#define DT_VERDEF 0x6ffffffc
+#define DT_VERDEFNUM 0x6ffffffd
+#define DT_VERNEED 0x6ffffffe
+#define DT_VERNEEDNUM 0x6fffffff
+
+#define VER_FLG_BASE 0x1
+#define VER_FLG_WEAK 0x2
+
+#define SHN_UNDEF 0
+#define STB_GLOBAL 1
+#define STB_WEAK 2
+#define STB_GNU_UNIQUE 10
+#define STV_DEFAULT 0
+#define STV_PROTECTED 3
+#define VERSYM_HIDDEN 0x8000
 
 #define MAX_OFFSET_T 0xFFFFFFFFFFFFFFFF
 
+#define TRACE_CAPACITY 65536
+#define TRACE_ARG_SIZE 112
+
 #define REGULAR_RED "\033[0;31m"
 #define BOLD_RED "\033[1;31m"
 #define CLEAR "\033[0m"
@@ -74,11 +149,15 @@
 #define LIGHT_VERTICAL_WITH_INDENT LIGHT_VERTICAL "   "
 
 #define SMALL_VEC_SIZE 16
-#define MAX_RECURSION_DEPTH 32
+#define MAX_THREADS 256
+
+// Value in the path maps of the caches while another thread is looking up the
+// path.
+#define CACHE_PENDING (SIZE_MAX - 1)
 
 // Libraries we do not show by default -- this reduces the verbosity quite a
 // bit.
-char const *exclude_list[] = {
+static char const *const exclude_list[] = {
     "libc.so",      "libpthread.so",      "libm.so",  "libgcc_s.so",
     "libstdc++.so", "ld-linux-x86-64.so", "libdl.so", "libc.musl-x86_64.so"};
 
@@ -146,6 +225,68 @@ struct dyn_32_t {
     uint32_t d_val;
 };
 
+struct sym_64_t {
+    uint32_t st_name;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+};
+
+struct sym_32_t {
+    uint32_t st_name;
+    uint32_t st_value;
+    uint32_t st_size;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+};
+
+// Version sections have the same layout in 32 and 64 bits files.
+struct verneed_t {
+    uint16_t vn_version;
+    uint16_t vn_cnt;
+    uint32_t vn_file;
+    uint32_t vn_aux;
+    uint32_t vn_next;
+};
+
+struct vernaux_t {
+    uint32_t vna_hash;
+    uint16_t vna_flags;
+    uint16_t vna_other;
+    uint32_t vna_name;
+    uint32_t vna_next;
+};
+
+struct verdef_t {
+    uint16_t vd_version;
+    uint16_t vd_flags;
+    uint16_t vd_ndx;
+    uint16_t vd_cnt;
+    uint32_t vd_hash;
+    uint32_t vd_aux;
+    uint32_t vd_next;
+};
+
+struct verdaux_t {
+    uint32_t vda_name;
+    uint32_t vda_next;
+};
+
+// A symbol version defined by a file, or one it requires from the library
+// `file`. Names are offsets into a string table, and `hash` is the ELF hash
+// of the name as stored by the linker, so names are only compared when the
+// hashes are equal.
+struct elf_version_t {
+    uint32_t hash;
+    uint32_t name;
+    // UINT32_MAX for definitions. In elf_node_t the offset of the needed
+    // library's name, which is where the required version is looked up.
+    uint32_t file;
+};
+
 typedef enum { EITHER, BITS32, BITS64 } elf_bits_t;
 
 typedef enum {
@@ -173,46 +314,688 @@ struct string_table_t {
     size_t capacity;
 };
 
-struct visited_file_t {
+// Chunks are never moved, so pointers into the arena stay valid until it is
+// freed.
+struct arena_chunk_t {
+    struct arena_chunk_t *prev;
+    char data[];
+};
+
+struct arena_t {
+    struct arena_chunk_t *chunk;
+    size_t n;
+    size_t capacity;
+    // Total bytes handed out.
+    size_t bytes;
+};
+
+struct intern_slot_t {
+    uint64_t hash;
+    // Id of the string, or SIZE_MAX for an empty slot.
+    size_t id;
+};
+
+// Strings stored once in an arena, with a precomputed hash, and identified by
+// the order in which they were first interned. Equal ids mean equal strings.
+struct intern_t {
+    struct arena_t arena;
+    // Open addressing hash table on the strings.
+    struct intern_slot_t *slots;
+    size_t capacity;
+    char const **strings;
+    size_t n;
+    size_t strings_capacity;
+    // Changes when the strings are reset, so that ids kept elsewhere can be
+    // recognized as stale.
+    uint64_t epoch;
+    // Space to build strings before they are interned.
+    struct string_table_t scratch;
+};
+
+struct str_map_slot_t {
+    uint64_t hash;
+    // Offset of the key in the string table, or SIZE_MAX for an empty slot.
+    size_t key;
+    size_t value;
+};
+
+// Open addressing hash map from strings to size_t.
+struct str_map_t {
+    struct string_table_t keys;
+    struct str_map_slot_t *slots;
+    size_t n;
+    size_t capacity;
+};
+
+// The entries of a search directory.
+struct dir_t {
+    dev_t st_dev;
+    ino_t st_ino;
+    // When the directory cannot be listed (e.g. no read permission) we fall
+    // back to probing every file in it.
+    int listed;
+    struct str_map_t entries;
+};
+
+// Search directories are listed at most once per run. They are keyed by
+// device and inode, so that different spellings of the same directory (think
+// /lib and /usr/lib) share their entries.
+struct dir_index_t {
+    // Maps search paths as they are spelled to an index in dirs, or to
+    // SIZE_MAX if the path is not a directory.
+    struct str_map_t paths;
+    struct dir_t **dirs;
+    size_t n;
+    size_t capacity;
+    // Directories are listed outside of the lock; threads that need a
+    // directory which is being listed wait for `listed`.
+    pthread_mutex_t lock;
+    pthread_cond_t listed;
+};
+
+#define COST_TEXTREL 0x1
+#define COST_BIND_NOW 0x2
+#define COST_GNU_HASH 0x4
+
+// The work the dynamic loader does for a file before it runs, from the
+// dynamic section, for --cost.
+struct elf_cost_t {
+    // Entries of DT_RELA and DT_REL, and relocations packed in DT_RELR, of
+    // which `relative` need no symbol lookup.
+    uint64_t relocs;
+    uint64_t relative;
+    // Entries and size of DT_JMPREL, which are resolved at startup with
+    // BIND_NOW and on first call otherwise.
+    uint64_t plt_relocs;
+    uint64_t plt_size;
+    // COST_* flags.
+    uint32_t flags;
+};
+
+// Everything we need to know about an ELF file to locate its dependencies.
+// Files are parsed only once per inode.
+struct elf_node_t {
     dev_t st_dev;
     ino_t st_ino;
+    // To notice when the file is changed in place.
+    off_t st_size;
+    struct timespec st_mtim;
+    struct timespec st_ctim;
+    // Position in node_cache_t::nodes.
+    size_t index;
+    // Non-zero when the file could not be parsed.
+    int error;
+    elf_bits_t bits;
+    int has_dynamic;
+    int no_def_lib;
+    struct elf_cost_t cost;
+    // The last tree in which the file was encountered, see
+    // libtree_state_t::generation.
+    size_t visited;
+    // Whether its dependencies were handed to the thread pool.
+    int prefetched;
+    // Whether it is on the work stack, so that cycles are not followed.
+    int on_stack;
+    // soname, rpath, runpath and needed libraries, null separated.
+    char *strings;
+    size_t strings_size;
+    char const *soname;
+    char const *rpath;
+    char const *runpath;
+    // Interned rpath and runpath with variables substituted for the directory
+    // `expanded_origin`, or SIZE_MAX when unset. Valid in the epoch
+    // `expanded_epoch` of the interned strings.
+    size_t expanded_origin;
+    size_t expanded_rpath;
+    size_t expanded_runpath;
+    uint64_t expanded_epoch;
+    // Offsets of the needed libraries in strings.
+    uint64_t *needed;
+    size_t needed_n;
+    // Version definitions first, then requirements, with names in strings.
+    struct elf_version_t *versions;
+    size_t verdef_n;
+    size_t versions_n;
+    // By needed library, the index of a node that was found to define all
+    // required versions, or SIZE_MAX. Allocated when first checked.
+    size_t *versions_ok;
+    // Dynamic symbols, read on demand by --check-symbols, or NULL when they
+    // could not be read.
+    struct elf_symbols_t *symbols;
+    int symbols_loaded;
+    // Position in the symbol scope with generation `checked`.
+    size_t checked;
+    size_t scope;
+};
+
+struct node_cache_t {
+    struct elf_node_t **nodes;
+    size_t n;
+    size_t capacity;
+    // Open addressing hash table on (st_dev, st_ino), with indices into
+    // nodes, or SIZE_MAX for empty slots.
+    size_t *slots;
+    size_t slots_capacity;
+    // Maps paths to an index in nodes, or to SIZE_MAX when the path cannot be
+    // opened.
+    struct str_map_t paths;
+    // Files are parsed outside of the lock; threads that need a file which is
+    // being parsed wait for `parsed`.
+    pthread_mutex_t lock;
+    pthread_cond_t parsed;
+    // Optional persistent cache, NULL when disabled.
+    struct disk_cache_t *disk;
+    // Statistics, protected by the lock.
+    size_t files_opened;
+    size_t files_parsed;
+    uint64_t bytes_read;
+};
+
+// Header of a persistent cache file, followed by disk_record_t's.
+struct disk_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// A parsed file in the persistent cache, valid as long as the file has the
+// same device, inode, size, mtime and ctime. It is followed by `needed_n`
+// uint32_t offsets of needed libraries into the strings, the strings
+// themselves, and padding to a multiple of 8 bytes. The checksum covers
+// everything after it, so that records corrupted on disk are dropped.
+struct disk_record_t {
+    uint32_t size;
+    uint32_t checksum;
+    uint64_t st_dev;
+    uint64_t st_ino;
+    uint64_t st_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t relocs;
+    uint64_t relative;
+    uint64_t plt_relocs;
+    uint64_t plt_size;
+    int32_t error;
+    uint32_t cost_flags;
+    uint32_t bits;
+    uint32_t has_dynamic;
+    uint32_t no_def_lib;
+    // Offsets into the strings, or UINT32_MAX when not set.
+    uint32_t soname;
+    uint32_t rpath;
+    uint32_t runpath;
+    uint32_t needed_n;
+    uint32_t verdef_n;
+    uint32_t versions_n;
+    uint32_t strings_size;
+};
+
+struct disk_cache_t {
+    char *path;
+    // The cache file as it was when we started.
+    unsigned char *map;
+    size_t map_size;
+    // Open addressing hash table on (st_dev, st_ino) with offsets of the
+    // latest record per inode in map, or SIZE_MAX for empty slots.
+    size_t *slots;
+    size_t slots_capacity;
+    size_t n_records;
+    size_t n_superseded;
+    // The file is rewritten from scratch when it's invalid or mostly stale.
+    int rewrite;
+    // Serialized records of files parsed during this run.
+    struct string_table_t appended;
+    size_t hits;
+    size_t misses;
+};
+
+// A view of /etc/ld.so.cache, in which glibc looks up sonames instead of
+// scanning the ld.so.conf directories.
+struct ld_cache_t {
+    char *path;
+    // The file contents, followed by a null byte.
+    char *data;
+    size_t size;
+    // Entries are sorted by soname, in descending order.
+    size_t n;
+    size_t entries;
+    size_t entry_size;
+    // Offset to which string offsets of entries are relative.
+    size_t strings;
+    int has_hwcap;
+    // Stale entries reported so far.
+    struct str_map_t reported;
+};
+
+struct pool_job_t {
+    // Either a soname to locate in the search paths, or an absolute path.
+    char *name;
+    // Colon separated directories in which to locate `name`.
+    char *search_paths;
+    // Whether to continue with ld.so.conf and the default paths.
+    int defaults;
+    // Colon separated rpaths inherited by the dependencies of `name`.
+    char *rpaths;
+    elf_bits_t bits;
+    // The verbosity of the main thread when the job was submitted, which
+    // decides whether excluded libraries are prefetched. Workers never read
+    // it from the state, where it changes during traversal.
+    int verbosity;
+    // When crawling, `name` is a file that may not be ELF. The result is
+    // stored in `is_elf` and `pending` is decremented, both under the lock.
+    char *is_elf;
+    size_t *pending;
+    struct pool_job_t *next;
+};
+
+// A pool of threads that locate and parse libraries ahead of the main
+// thread. They only fill the caches: the main thread still walks the tree in
+// order and does all the printing, so the output does not depend on the
+// number of threads.
+struct pool_t {
+    pthread_t threads[MAX_THREADS];
+    size_t n_threads;
+    struct pool_job_t *head;
+    struct pool_job_t *tail;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t has_work;
+    // Signaled when a crawled file was checked.
+    pthread_cond_t crawled;
+    // Immutable copies of the search paths that don't depend on the parent.
+    char *ld_library_path;
+    char *ld_so_conf;
+    char *default_paths;
+};
+
+// Output is collected in a large buffer and written with few system calls.
+struct output_t {
+    int fd;
+    char *buf;
+    size_t n;
+    size_t capacity;
+};
+
+// Counters for --stats. They are cheap enough to always be updated, except
+// for time, which is only measured when enabled.
+struct stats_t {
+    int enabled;
+    // Libraries tried and not found in search paths, by how_t.
+    size_t probes[DEFAULT + 1];
+    size_t failed_probes[DEFAULT + 1];
+    size_t visited_skipped;
+    size_t memo_hits;
+    size_t max_depth;
+    uint64_t config_ns;
+    uint64_t traversal_ns;
+    uint64_t output_ns;
+};
+
+typedef enum {
+    TRACE_RECURSE,
+    TRACE_PROBE,
+    TRACE_LD_CACHE,
+    TRACE_LD_SO_CONF
+} trace_kind_t;
+
+// A timeline event. Strings are truncated copies, so that recording never
+// allocates.
+struct trace_event_t {
+    uint64_t seq;
+    uint64_t start;
+    uint64_t duration;
+    trace_kind_t kind;
+    size_t depth;
+    int code;
+    char arg[2][TRACE_ARG_SIZE];
+};
+
+// Ring of the last TRACE_CAPACITY events for --trace, allocated up front.
+struct trace_t {
+    struct trace_event_t *events;
+    // Number of events started so far.
+    uint64_t n;
+    uint64_t epoch;
+};
+
+// A file whose dependencies are being located. Frames live on a heap backed
+// stack indexed by depth, so the depth of the tree is not limited.
+struct frame_t {
+    struct elf_node_t *node;
+    // Path of the file, which its dependencies refer to as their parent.
+    char const *file;
+    // Interned ids of the interpolated DT_RPATH and DT_RUNPATH. The rpaths of
+    // all frames form the rpath stack: if lib_a needs lib_b needs lib_c and
+    // all have rpaths, then first lib_c's rpaths are considered, then lib_b's,
+    // then lib_a's. SIZE_MAX when unset.
+    size_t rpath;
+    size_t runpath;
+    // Id of the rpath stack in the memo.
+    size_t rpath_chain;
+    // Id of the rpath stack in the dag, see dag_t.
+    size_t dag_chain;
+    // Offsets of the needed libraries in node->strings start at needed_begin
+    // in the stack; the first needed_not_found have not been located yet.
+    size_t needed_begin;
+    size_t needed_not_found;
+    // This is so we know we have to print a | or white space in the tree.
+    char found_all_needed;
+    // First needed libraries with a slash are tried, with `i` the next one.
+    // Then all are resolved at once, and the located ones are entered from
+    // index `next` - 1 down to needed_not_found.
+    int resolved;
+    size_t i;
+    size_t next;
+    // Buffer of 4096 bytes for candidate paths, kept when the frame is popped.
+    char *path;
+    // Trace event that ends when the frame is popped.
+    uint64_t event;
+};
+
+struct work_stack_t {
+    struct frame_t *frames;
+    size_t n;
+    size_t capacity;
+    // Offsets of needed libraries, and their memo entries once resolved.
+    uint64_t *needed;
+    size_t *resolved;
+    size_t needed_n;
+    size_t needed_capacity;
+};
+
+// Where a needed library was found, or SIZE_MAX as path when it was not.
+struct memo_entry_t {
+    size_t path;
+    how_t how;
+    size_t rpath_depth;
+    // Index of the directory in the search order, to replay the order in
+    // which libraries are found.
+    size_t position;
+};
+
+// Resolution results keyed by soname, ELF class and the search paths that
+// differ between files: the rpath stack, runpath and the NODEFLIB flag.
+struct memo_t {
+    // Maps rpath stacks and runpaths to a numeric id.
+    struct str_map_t contexts;
+    // Maps (context id, class, soname) to an index in entries.
+    struct str_map_t results;
+    struct memo_entry_t *entries;
+    size_t n;
+    size_t capacity;
+    struct string_table_t paths;
+    // Scratch space for keys.
+    struct string_table_t key;
+};
+
+// An edge from a file to a library it needs, by node index.
+struct rdep_edge_t {
+    size_t parent;
+    size_t child;
+    how_t how;
+    // Depth of the frame whose rpath located the child, with RPATH.
+    size_t rpath_depth;
+    // Next edge to the same library, or SIZE_MAX.
+    size_t next;
+};
+
+// A needed library that could not be located, by node index of the file that
+// needs it, and offset of its name in the paths of the reverse index.
+struct rdep_missing_t {
+    size_t parent;
+    size_t name;
+};
+
+// For every library the files that need it, built while crawling or resolving
+// through the library API. Edges are stored once, so memory is bounded by the
+// size of the dependency graph.
+struct reverse_index_t {
+    struct rdep_edge_t *edges;
+    size_t n;
+    size_t capacity;
+    // Open addressing hash table on (parent, child) with edge indices.
+    size_t *slots;
+    size_t slots_capacity;
+    // By node index: the first and last edge to it, and the offset of its
+    // path in `paths`, or SIZE_MAX.
+    size_t *first;
+    size_t *last;
+    size_t *path;
+    size_t nodes_capacity;
+    struct string_table_t paths;
+    // Node indices in the order they were reached.
+    size_t *reached;
+    size_t reached_n;
+    size_t reached_capacity;
+    struct rdep_missing_t *missing;
+    size_t missing_n;
+    size_t missing_capacity;
+};
+
+// How the needed libraries of a tree were located, and the rpath stacks, to
+// report what changed between two traversals.
+struct snapshot_t {
+    // Maps "file\nneeded" to an offset in `values` of the path of the library
+    // and how it was located, or of "" when it was not found.
+    struct str_map_t edges;
+    // Maps files to an offset in `values` of their rpath stack or runpath.
+    struct str_map_t stacks;
+    struct string_table_t values;
+    // Scratch space for keys.
+    struct string_table_t key;
+    // Whether sonames are looked up in ld.so.cache instead of the ld.so.conf
+    // directories.
+    int ld_cache;
+};
+
+// With --dag, the subtree of a file is printed once per search context, and
+// later occurrences refer back to it by label.
+struct dag_t {
+    // Maps "node,rpath stack,runpath" to the label of the printed subtree.
+    struct str_map_t labels;
+    // Maps "parent stack,rpath" to the id of an rpath stack. Unlike the memo,
+    // the depth of the rpaths is not part of it.
+    struct str_map_t chains;
+    struct string_table_t key;
+    // The label of the line being printed, or SIZE_MAX, and whether it refers
+    // back.
+    size_t label;
+    int is_ref;
+};
+
+// A file to copy into a bundle.
+struct bundle_file_t {
+    // Offsets in the strings of the bundle of the source path, and the
+    // destination relative to the bundle directory.
+    size_t source;
+    size_t dest;
+    size_t node;
+    // Index of the file whose copy this is a hard link to, or SIZE_MAX when it
+    // is copied itself.
+    size_t link;
+    int error;
+};
+
+// The files that a set of inputs load, collected for --bundle. Inputs go to
+// bin/, and libraries to lib/ under the name by which they are needed, so
+// that an rpath of $ORIGIN/../lib locates them.
+struct bundle_t {
+    struct bundle_file_t *files;
+    size_t n;
+    size_t capacity;
+    // Maps destinations to their file.
+    struct str_map_t dests;
+    // By node index, the file that is copied for it, or SIZE_MAX.
+    size_t *copies;
+    size_t copies_n;
+    struct string_table_t strings;
+    // Libraries that could not be located, and names that are taken by
+    // different files.
+    size_t missing;
+    size_t conflicts;
+    // Next file to copy by any thread.
+    size_t next;
+    pthread_mutex_t lock;
+    char const *dir;
+};
+
+// The files that a set of inputs load, with the work the dynamic loader does
+// for them, collected for --cost.
+struct cost_t {
+    // Node indices and offsets of the first path in `paths`, per file.
+    size_t *nodes;
+    size_t *path_offsets;
+    size_t n;
+    size_t capacity;
+    struct string_table_t paths;
+    // By node index, whether the file was counted.
+    unsigned char *counted;
+    size_t counted_n;
+    // The file of the line being printed.
+    struct elf_node_t const *node;
 };
 
-struct visited_file_array_t {
-    struct visited_file_t *arr;
+// The objects loaded for one input, in which the undefined symbols of each of
+// them are looked up.
+struct symbol_scope_t {
+    // Set while the objects are collected.
+    int collecting;
+    size_t generation;
+    struct elf_node_t **nodes;
     size_t n;
     size_t capacity;
+    // Path of every object, to read its symbols from.
+    struct string_table_t paths;
+    size_t *path_offsets;
+    // The unresolved symbols of object i are unresolved[begin[i]] up to
+    // unresolved[begin[i + 1]].
+    char const **unresolved;
+    size_t unresolved_n;
+    size_t unresolved_capacity;
+    size_t *begin;
+    // Whether the symbols of all objects could be read. If not, a symbol may
+    // be defined by the object that could not be read, so none is reported.
+    int complete;
+};
+
+// One position in a glob pattern.
+struct exclude_item_t {
+    // The bytes matched here, a bit per byte.
+    uint32_t bytes[8];
+    // Set for `*`, which matches any number of bytes.
+    int star;
+    // Set after the last position of a rule, which hides matching libraries
+    // when `exclude` is set, and shows them otherwise.
+    int end;
+    int exclude;
+};
+
+// Rules that hide libraries by soname, compiled into a DFA so that matching
+// takes time linear in the length of the soname, however many rules there are.
+// The last matching rule wins.
+struct exclude_t {
+    // The rules, one after the other.
+    struct exclude_item_t *items;
+    size_t items_n;
+    size_t items_capacity;
+    // Whether the default rules were added, which come first. They are only
+    // added along with a rule of the user, so `items_n` is 0 when only the
+    // defaults apply.
+    int has_defaults;
+    int compiled;
+    // Bytes that no rule distinguishes share a class.
+    uint8_t classes[256];
+    size_t classes_n;
+    // Next state by state and class, and whether the soname is hidden when
+    // it ends in a state. State 0 is the start, `dead` matches no rule.
+    uint32_t *transitions;
+    unsigned char *hidden;
+    size_t states_n;
+    size_t dead;
 };
 
 struct libtree_state_t {
     int verbosity;
+    // Libraries that are hidden unless verbose.
+    struct exclude_t exclude;
     int path;
     int color;
+    int json;
+    size_t jobs;
+
+    // In batch mode every input gets a tree of its own, as if libtree was
+    // invoked once per input. The caches are shared though, so the generation
+    // is bumped to mark all files as unvisited.
+    int batch;
+    size_t generation;
+
+    // Path of the persistent cache of parsed files, or NULL when disabled.
+    char const *cache_file;
+
+    // Chrome trace output file, or NULL when disabled.
+    char *trace_file;
+    struct trace_t trace;
+
+    // Scan the ld.so.conf directories instead of using ld.so.cache.
+    int scan_ld_so_conf;
+    struct ld_cache_t ld_cache;
 
     struct string_table_t string_table;
-    struct visited_file_array_t visited;
+    struct node_cache_t node_cache;
+    struct dir_index_t dir_index;
+    struct pool_t *pool;
+    struct output_t out;
+    struct stats_t stats;
 
     // rpath substitutions values (note: OSNAME/OSREL are FreeBSD specific, LIB
     // is glibc/Linux specific -- we substitute all so we can support
     // cross-compiled binaries).
-    char *PLATFORM;
-    char *LIB;
-    char *OSNAME;
-    char *OSREL;
-
-    // rpath stack: if lib_a needs lib_b needs lib_c and all have rpaths
-    // then first lib_c's rpaths are considered, then lib_b's, then lib_a's.
-    // so this data structure keeps a list of offsets into the string buffer
-    // where rpaths start, like [lib_a_rpath_offset, lib_b_rpath_offset,
-    // lib_c_rpath_offset]...
-    size_t rpath_offsets[MAX_RECURSION_DEPTH];
+    char const *PLATFORM;
+    char const *LIB;
+    char const *OSNAME;
+    char const *OSREL;
+    struct utsname uname;
+
+    // Value of LD_LIBRARY_PATH, or NULL.
+    char const *ld_library_path;
+
     size_t ld_library_path_offset;
     size_t default_paths_offset;
     size_t ld_so_conf_offset;
 
-    // This is so we know we have to print a | or white space
-    // in the tree
-    char found_all_needed[MAX_RECURSION_DEPTH];
+    // The files we are locating dependencies of, from the input down.
+    struct work_stack_t stack;
+    struct memo_t memo;
+    // Interpolated rpaths and runpaths, which the memo refers to by id.
+    struct intern_t intern;
+
+    // Crawl the inputs and print the files that need this library instead.
+    char const *dependents;
+    struct reverse_index_t *index;
+
+    // Traverse without printing anything.
+    int quiet;
+
+    // Record how libraries were located, for --watch.
+    struct snapshot_t *snapshot;
+
+    // Collect warnings instead of printing them, for the library.
+    struct string_table_t *warnings;
+
+    // Print every subtree once, for --dag.
+    struct dag_t *dag;
+
+    // Collect the files to copy, for --bundle.
+    struct bundle_t *bundle;
+
+    // Estimate the startup cost of every file, for --cost.
+    struct cost_t *cost;
+
+    // Check that undefined symbols are defined in the load scope.
+    int check_symbols;
+    struct symbol_scope_t scope;
 };
 
 // Keep track of the files we've see
@@ -289,6 +1072,28 @@ static inline int host_is_little_endian() {
     return bytes[0] == 1;
 }
 
+static inline uint16_t bswap16(uint16_t v) {
+    return (uint16_t)(v << 8 | v >> 8);
+}
+
+static inline uint32_t bswap32(uint32_t v) {
+    return (v << 24) | ((v << 8) & 0x00ff0000) | ((v >> 8) & 0x0000ff00) |
+           (v >> 24);
+}
+
+static inline uint64_t bswap64(uint64_t v) {
+    return (uint64_t)bswap32(v) << 32 | bswap32(v >> 32);
+}
+
+// Convert a field from the byte order of a file when `swap` is set.
+static inline uint16_t elf_u16(int swap, uint16_t v) {
+    return swap ? bswap16(v) : v;
+}
+
+static inline uint32_t elf_u32(int swap, uint32_t v) {
+    return swap ? bswap32(v) : v;
+}
+
 static int is_ascending_order(uint64_t *v, size_t n) {
     for (size_t j = 1; j < n; ++j)
         if (v[j - 1] >= v[j])
@@ -297,1203 +1102,7241 @@ static int is_ascending_order(uint64_t *v, size_t n) {
     return 1;
 }
 
-static void string_table_maybe_grow(struct string_table_t *t, size_t n) {
-    // The likely case of not having to resize
-    if (t->n + n <= t->capacity)
-        return;
-
-    // Otherwise give twice the amount of required space.
-    t->capacity = 2 * (t->n + n);
-    char *arr = realloc(t->arr, t->capacity);
-    if (arr == NULL) {
-        exit(1);
-    }
-    t->arr = arr;
-}
+/**
+ * elf_file_t gives bounds-checked, read-only access to the bytes of a file.
+ * Regular files are mapped into memory once; if that fails the requested
+ * ranges are read with pread instead. In that case the first ELF_HEAD_SIZE
+ * bytes are read up front, since they almost always contain both the ELF
+ * header and the program headers, so that a typical file takes only three
+ * reads: the head, the dynamic section and the string table.
+ */
 
-static void string_table_store(struct string_table_t *t, char const *str) {
-    size_t n = strlen(str) + 1;
-    string_table_maybe_grow(t, n);
-    memcpy(t->arr + t->n, str, n);
-    t->n += n;
-}
+#define ELF_HEAD_SIZE 4096
+#define ELF_MAX_VIEWS 4
+
+struct elf_file_t {
+    int fd;
+    struct stat st;
+    // The whole file when mapped, otherwise NULL.
+    unsigned char *map;
+    // The first head_size bytes of the file when not mapped.
+    unsigned char *head;
+    size_t head_size;
+    // Ranges read with pread that did not fit in the head.
+    void *views[ELF_MAX_VIEWS];
+    size_t n_views;
+    // Bytes of the file that were looked at.
+    uint64_t bytes_read;
+};
 
-static void string_table_copy_from_file(struct string_table_t *t, FILE *fptr) {
-    char c;
-    // TODO: this could be a bit more efficient...
-    while ((c = getc(fptr)) != '\0' && c != EOF) {
-        string_table_maybe_grow(t, 1);
-        t->arr[t->n++] = c;
+static int pread_all(int fd, void *buf, size_t size, uint64_t offset,
+                     size_t *bytes_read) {
+    *bytes_read = 0;
+    while (*bytes_read < size) {
+        ssize_t n = pread(fd, (char *)buf + *bytes_read, size - *bytes_read,
+                          offset + *bytes_read);
+        if (n < 0)
+            return 1;
+        if (n == 0)
+            break;
+        *bytes_read += n;
     }
-    string_table_maybe_grow(t, 1);
-    t->arr[t->n++] = '\0';
+    return 0;
 }
 
-static int is_in_exclude_list(char *soname) {
-    // Get to the end.
-    char *start = soname;
-    char *end = strrchr(start, '\0');
-
-    // Empty needed string, is that even possible?
-    if (start == end)
-        return 0;
-
-    --end;
+static int elf_file_open(struct elf_file_t *f, char const *path) {
+    memset(f, 0, sizeof(*f));
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0)
+        return 1;
 
-    // Strip "1234567890." from the right.
-    while (end != start && ((*end >= '0' && *end <= '9') || *end == '.')) {
-        --end;
+    if (fstat(f->fd, &f->st) != 0) {
+        close(f->fd);
+        return ERR_CANT_STAT;
     }
 
-    // Check if we should skip this one.
-    for (size_t j = 0; j < sizeof(exclude_list) / sizeof(char *); ++j) {
-        size_t len = strlen(exclude_list[j]);
-        if (strncmp(start, exclude_list[j], len) != 0)
-            continue;
-        return 1;
+    // The likely path: map the file, after which the descriptor is not needed.
+    if (S_ISREG(f->st.st_mode) && f->st.st_size > 0 &&
+        (uint64_t)f->st.st_size <= SIZE_MAX) {
+        void *map =
+            mmap(NULL, f->st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+        if (map != MAP_FAILED) {
+            f->map = map;
+            close(f->fd);
+            f->fd = -1;
+            return 0;
+        }
     }
 
+    // The fallback: read the head of the file.
+    f->head = malloc(ELF_HEAD_SIZE);
+    if (f->head == NULL)
+        exit(1);
+    if (pread_all(f->fd, f->head, ELF_HEAD_SIZE, 0, &f->head_size) != 0)
+        f->head_size = 0;
+    f->bytes_read = f->head_size;
     return 0;
 }
 
-static void tree_preamble(struct libtree_state_t *s, size_t depth) {
-    if (depth == 0)
-        return;
-
-    for (size_t i = 0; i < depth - 1; ++i)
-        fputs(s->found_all_needed[i] ? JUST_INDENT : LIGHT_VERTICAL_WITH_INDENT,
-              stdout);
+// Quickly rule out files that are not ELF by the magic bytes of e_ident.
+static int has_elf_magic(char const *path) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return 0;
+    unsigned char magic[4];
+    int elf = pread(fd, magic, 4, 0) == 4 && magic[0] == 0x7f &&
+              magic[1] == 'E' && magic[2] == 'L' && magic[3] == 'F';
+    close(fd);
+    return elf;
+}
 
-    fputs(s->found_all_needed[depth - 1]
-              ? LIGHT_UP_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " "
-              : LIGHT_VERTICAL_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " ",
-          stdout);
+static void elf_file_close(struct elf_file_t *f) {
+    if (f->map != NULL)
+        munmap(f->map, f->st.st_size);
+    if (f->fd >= 0)
+        close(f->fd);
+    free(f->head);
+    for (size_t i = 0; i < f->n_views; ++i)
+        free(f->views[i]);
 }
 
-static int recurse(char *current_file, size_t depth,
-                   struct libtree_state_t *state, elf_bits_t bits,
-                   struct found_t reason);
+// Returns a pointer to `size` bytes at `offset`, or NULL when the range is not
+// entirely contained in the file. The pointer is valid until the file is
+// closed.
+static void const *elf_file_view(struct elf_file_t *f, uint64_t offset,
+                                 uint64_t size) {
+    if (f->map != NULL) {
+        uint64_t file_size = f->st.st_size;
+        if (offset > file_size || size > file_size - offset)
+            return NULL;
+        f->bytes_read += size;
+        return f->map + offset;
+    }
 
-static void check_search_paths(struct found_t reason, size_t offset,
-                               size_t *needed_not_found,
-                               struct small_vec_u64_t *needed_buf_offsets,
-                               size_t depth, struct libtree_state_t *s,
-                               elf_bits_t bits) {
-    char path[4096];
-    char *path_end = path + 4096;
+    if (offset <= f->head_size && size <= f->head_size - offset)
+        return f->head + offset;
 
-    char const *buf = s->string_table.arr;
+    // Don't allocate more than the file could possibly hold.
+    if (f->n_views == ELF_MAX_VIEWS || size > SIZE_MAX ||
+        (S_ISREG(f->st.st_mode) && size > (uint64_t)f->st.st_size))
+        return NULL;
 
-    while (buf[offset] != '\0') {
-        // First remove trailing colons
-        while (buf[offset] == ':' && buf[offset] != '\0')
-            ++offset;
+    void *buf = malloc(size == 0 ? 1 : size);
+    if (buf == NULL)
+        exit(1);
 
-        // Check if it was only colons
-        if (buf[offset] == '\0')
-            return;
+    size_t bytes_read;
+    if (pread_all(f->fd, buf, size, offset, &bytes_read) != 0 ||
+        bytes_read != size) {
+        free(buf);
+        return NULL;
+    }
 
-        // Copy the search path until the first \0 or :
-        char *dest = path;
-        while (buf[offset] != '\0' && buf[offset] != ':' && dest != path_end)
-            *dest++ = buf[offset++];
+    f->views[f->n_views++] = buf;
+    f->bytes_read += size;
+    return buf;
+}
 
-        // Path too long... Can't handle.
-        if (dest + 1 >= path_end)
-            continue;
+/**
+ * end of elf_file_t
+ */
 
-        // Add a separator if necessary
-        if (*(dest - 1) != '/')
-            *dest++ = '/';
+/**
+ * elf_info_t is what we need to know about an ELF file to locate its
+ * dependencies. Strings point directly into the string table of the file, so
+ * they are only valid as long as the elf_file_t they were parsed from is open.
+ */
+struct elf_info_t {
+    elf_bits_t bits;
+    // Whether the byte order of the file differs from the host's.
+    int swap;
+    int has_dynamic;
+
+    // Shared libraries can disable searching in "default" search paths, aka
+    // ld.so.conf and /usr/lib etc. At least glibc respects this.
+    int no_def_lib;
+    struct elf_cost_t cost;
+
+    char const *strtab;
+    uint64_t strtab_size;
+    char const *soname;
+    char const *rpath;
+    char const *runpath;
+
+    // Offsets of DT_NEEDED entries into strtab.
+    struct small_vec_u64_t needed;
 
-        // Keep track of the end of the current search path.
-        char *search_path_end = dest;
+    // File offsets of DT_SYMTAB, DT_GNU_HASH, DT_HASH and DT_VERSYM, or
+    // MAX_OFFSET_T when absent.
+    uint64_t symtab;
+    uint64_t gnu_hash;
+    uint64_t hash;
+    uint64_t versym;
+
+    // Version definitions first, then the non-weak version requirements.
+    struct elf_version_t *versions;
+    size_t verdef_n;
+    size_t versions_n;
+    size_t versions_capacity;
+};
 
-        // Try to open it -- if we've found anything, swap it with the back.
-        for (size_t i = 0; i < *needed_not_found;) {
-            size_t soname_len = strlen(buf + needed_buf_offsets->p[i]);
+// Returns the string at offset `off` in a string table of `size` bytes, or
+// NULL if it is not null terminated within the table.
+static char const *elf_string(char const *strtab, uint64_t size,
+                              uint64_t off) {
+    if (off >= size || memchr(strtab + off, '\0', size - off) == NULL)
+        return NULL;
+    return strtab + off;
+}
 
-            // Path too long, can't handle.
-            if (search_path_end + soname_len + 1 >= path_end)
-                continue;
+static void elf_info_free(struct elf_info_t *info) {
+    small_vec_u64_free(&info->needed);
+    free(info->versions);
+}
 
-            // Otherwise append.
-            memcpy(search_path_end, buf + needed_buf_offsets->p[i],
-                   soname_len + 1);
-            s->found_all_needed[depth] = *needed_not_found <= 1;
-
-            // And try to locate the lib.
-            if (recurse(path, depth + 1, s, bits, reason) == 0) {
-                // Found it, so swap out the current soname to the back,
-                // and reduce the number of to be found by one.
-                size_t tmp = needed_buf_offsets->p[i];
-                needed_buf_offsets->p[i] =
-                    needed_buf_offsets->p[*needed_not_found - 1];
-                needed_buf_offsets->p[--(*needed_not_found)] = tmp;
-            } else {
-                ++i;
-            }
-        }
+static void elf_info_add_version(struct elf_info_t *info, uint32_t hash,
+                                 uint32_t name, uint32_t file) {
+    if (info->versions_n == info->versions_capacity) {
+        info->versions_capacity =
+            info->versions_capacity == 0 ? 16 : 2 * info->versions_capacity;
+        info->versions =
+            realloc(info->versions,
+                    info->versions_capacity * sizeof(struct elf_version_t));
+        if (info->versions == NULL)
+            exit(1);
     }
+    info->versions[info->versions_n++] =
+        (struct elf_version_t){.hash = hash, .name = name, .file = file};
 }
 
-static int interpolate_variables(struct libtree_state_t *s, size_t src,
-                                 char const *ORIGIN) {
-    // We do not write to dst if there is no variables to interpolate.
-    size_t prev_src = src;
-    size_t curr_src = src;
-
-    struct string_table_t *st = &s->string_table;
-
-    while (1) {
-        // Find the next potential variable.
-        char *dollar = strchr(st->arr + curr_src, '$');
-        if (dollar == NULL)
+// Read DT_VERDEF and DT_VERNEED, each a linked list of `num` entries at file
+// offset `def` and `need`, or MAX_OFFSET_T.
+static int elf_parse_versions(struct elf_file_t *f, struct elf_info_t *info,
+                              uint64_t def, uint64_t def_num, uint64_t need,
+                              uint64_t need_num) {
+    int swap = info->swap;
+    for (uint64_t i = 0; def != MAX_OFFSET_T && i < def_num; ++i) {
+        struct verdef_t vd;
+        struct verdaux_t vda;
+        void const *p = elf_file_view(f, def, sizeof(vd));
+        if (p == NULL)
+            return 1;
+        memcpy(&vd, p, sizeof(vd));
+        vd.vd_flags = elf_u16(swap, vd.vd_flags);
+        vd.vd_cnt = elf_u16(swap, vd.vd_cnt);
+        vd.vd_hash = elf_u32(swap, vd.vd_hash);
+        vd.vd_aux = elf_u32(swap, vd.vd_aux);
+        vd.vd_next = elf_u32(swap, vd.vd_next);
+
+        // The base version is the file itself, which is never required.
+        if ((vd.vd_flags & VER_FLG_BASE) == 0 && vd.vd_cnt > 0) {
+            p = elf_file_view(f, def + vd.vd_aux, sizeof(vda));
+            if (p == NULL)
+                return 1;
+            memcpy(&vda, p, sizeof(vda));
+            vda.vda_name = elf_u32(swap, vda.vda_name);
+            if (elf_string(info->strtab, info->strtab_size, vda.vda_name) ==
+                NULL)
+                return 1;
+            elf_info_add_version(info, vd.vd_hash, vda.vda_name, UINT32_MAX);
+        }
+        if (vd.vd_next == 0)
             break;
-        curr_src = dollar - st->arr;
+        def += vd.vd_next;
+    }
+    info->verdef_n = info->versions_n;
 
-        size_t bytes_to_dollar = curr_src - prev_src;
+    for (uint64_t i = 0; need != MAX_OFFSET_T && i < need_num; ++i) {
+        struct verneed_t vn;
+        void const *p = elf_file_view(f, need, sizeof(vn));
+        if (p == NULL)
+            return 1;
+        memcpy(&vn, p, sizeof(vn));
+        vn.vn_cnt = elf_u16(swap, vn.vn_cnt);
+        vn.vn_file = elf_u32(swap, vn.vn_file);
+        vn.vn_aux = elf_u32(swap, vn.vn_aux);
+        vn.vn_next = elf_u32(swap, vn.vn_next);
+        if (elf_string(info->strtab, info->strtab_size, vn.vn_file) == NULL)
+            return 1;
 
-        // Go past the dollar.
-        ++curr_src;
+        uint64_t aux = need + vn.vn_aux;
+        for (uint16_t j = 0; j < vn.vn_cnt; ++j) {
+            struct vernaux_t vna;
+            p = elf_file_view(f, aux, sizeof(vna));
+            if (p == NULL)
+                return 1;
+            memcpy(&vna, p, sizeof(vna));
+            vna.vna_hash = elf_u32(swap, vna.vna_hash);
+            vna.vna_flags = elf_u16(swap, vna.vna_flags);
+            vna.vna_name = elf_u32(swap, vna.vna_name);
+            vna.vna_next = elf_u32(swap, vna.vna_next);
+            if (elf_string(info->strtab, info->strtab_size, vna.vna_name) ==
+                NULL)
+                return 1;
 
-        // Remember if we have to look for matching curly braces.
-        int curly = 0;
-        if (st->arr[curr_src] == '{') {
-            curly = 1;
-            ++curr_src;
+            // The dynamic loader only warns about missing weak versions.
+            if ((vna.vna_flags & VER_FLG_WEAK) == 0)
+                elf_info_add_version(info, vna.vna_hash, vna.vna_name,
+                                     vn.vn_file);
+            if (vna.vna_next == 0)
+                break;
+            aux += vna.vna_next;
         }
+        if (vn.vn_next == 0)
+            break;
+        need += vn.vn_next;
+    }
+    return 0;
+}
 
-        // String to interpolate.
-        char const *var_val = NULL;
-        if (strncmp(&st->arr[curr_src], "ORIGIN", 6) == 0) {
-            var_val = ORIGIN;
-            curr_src += 6;
-        } else if (strncmp(&st->arr[curr_src], "LIB", 3) == 0) {
-            var_val = s->LIB;
-            curr_src += 3;
-        } else if (strncmp(&st->arr[curr_src], "PLATFORM", 8) == 0) {
-            var_val = s->PLATFORM;
-            curr_src += 8;
-        } else if (strncmp(&st->arr[curr_src], "OSNAME", 6) == 0) {
-            var_val = s->OSNAME;
-            curr_src += 6;
-        } else if (strncmp(&st->arr[curr_src], "OSREL", 5) == 0) {
-            var_val = s->OSREL;
-            curr_src += 5;
+// Returns the file offset of the virtual address `vaddr`, given the PT_LOAD
+// segments in ascending order, or MAX_OFFSET_T when `vaddr` is MAX_OFFSET_T.
+static uint64_t elf_vaddr_to_offset(struct small_vec_u64_t *vaddrs,
+                                    struct small_vec_u64_t *offsets,
+                                    uint64_t vaddr) {
+    if (vaddr == MAX_OFFSET_T)
+        return MAX_OFFSET_T;
+    size_t vaddr_idx = 0;
+    while (vaddr_idx + 1 != vaddrs->n && vaddr >= vaddrs->p[vaddr_idx + 1])
+        ++vaddr_idx;
+    return offsets->p[vaddr_idx] + vaddr - vaddrs->p[vaddr_idx];
+}
+
+// Dynamic section entries that are used, as found in the file.
+struct elf_dynamic_t {
+    uint64_t strtab;
+    uint64_t strsz;
+    uint64_t rpath;
+    uint64_t runpath;
+    uint64_t soname;
+    uint64_t symtab;
+    uint64_t gnu_hash;
+    uint64_t hash;
+    uint64_t versym;
+    uint64_t verdef;
+    uint64_t verdef_num;
+    uint64_t verneed;
+    uint64_t verneed_num;
+    // Sizes of the relocation tables, and the type of DT_JMPREL.
+    uint64_t relasz;
+    uint64_t relaent;
+    uint64_t relsz;
+    uint64_t relent;
+    uint64_t pltrelsz;
+    uint64_t pltrel;
+    uint64_t relr;
+    uint64_t relrsz;
+};
+
+static void elf_dynamic_entry(struct elf_info_t *info, struct elf_dynamic_t *d,
+                              uint64_t d_tag, uint64_t d_val) {
+    switch (d_tag) {
+    case DT_STRTAB:
+        d->strtab = d_val;
+        break;
+    case DT_STRSZ:
+        d->strsz = d_val;
+        break;
+    case DT_RPATH:
+        d->rpath = d_val;
+        break;
+    case DT_RUNPATH:
+        d->runpath = d_val;
+        break;
+    case DT_NEEDED:
+        small_vec_u64_append(&info->needed, d_val);
+        break;
+    case DT_SONAME:
+        d->soname = d_val;
+        break;
+    case DT_FLAGS_1:
+        info->no_def_lib |= (DT_1_NODEFLIB & d_val) == DT_1_NODEFLIB;
+        if (d_val & DT_1_NOW)
+            info->cost.flags |= COST_BIND_NOW;
+        break;
+    case DT_FLAGS:
+        if (d_val & DF_TEXTREL)
+            info->cost.flags |= COST_TEXTREL;
+        if (d_val & DF_BIND_NOW)
+            info->cost.flags |= COST_BIND_NOW;
+        break;
+    case DT_TEXTREL:
+        info->cost.flags |= COST_TEXTREL;
+        break;
+    case DT_BIND_NOW:
+        info->cost.flags |= COST_BIND_NOW;
+        break;
+    case DT_RELACOUNT:
+    case DT_RELCOUNT:
+        info->cost.relative += d_val;
+        break;
+    case DT_RELASZ:
+        d->relasz = d_val;
+        break;
+    case DT_RELAENT:
+        d->relaent = d_val;
+        break;
+    case DT_RELSZ:
+        d->relsz = d_val;
+        break;
+    case DT_RELENT:
+        d->relent = d_val;
+        break;
+    case DT_PLTRELSZ:
+        d->pltrelsz = d_val;
+        break;
+    case DT_PLTREL:
+        d->pltrel = d_val;
+        break;
+    case DT_RELR:
+        d->relr = d_val;
+        break;
+    case DT_RELRSZ:
+        d->relrsz = d_val;
+        break;
+    case DT_SYMTAB:
+        d->symtab = d_val;
+        break;
+    case DT_GNU_HASH:
+        d->gnu_hash = d_val;
+        break;
+    case DT_HASH:
+        d->hash = d_val;
+        break;
+    case DT_VERSYM:
+        d->versym = d_val;
+        break;
+    case DT_VERDEF:
+        d->verdef = d_val;
+        break;
+    case DT_VERDEFNUM:
+        d->verdef_num = d_val;
+        break;
+    case DT_VERNEED:
+        d->verneed = d_val;
+        break;
+    case DT_VERNEEDNUM:
+        d->verneed_num = d_val;
+        break;
+    }
+}
+
+#define ELF_NATIVE(bits, x) (x)
+#define ELF_SWAPPED(bits, x) bswap##bits(x)
+
+// Defines elf_parse_segments_S, which reads the header, the program headers
+// and the dynamic array of a file with W bits, converting fields from file
+// byte order with CONV. Specializing per class and byte order keeps branches
+// out of the loops over entries.
+#define ELF_DEFINE_PARSE_SEGMENTS(S, W, CONV)                                  \
+    static int elf_parse_segments_##S(                                         \
+        struct elf_file_t *f, struct elf_info_t *info,                         \
+        struct small_vec_u64_t *pt_load_offset,                                \
+        struct small_vec_u64_t *pt_load_vaddr, struct elf_dynamic_t *d) {      \
+        struct header_##W##_t h;                                               \
+        void const *p = elf_file_view(f, 16, sizeof(h));                       \
+        if (p == NULL)                                                         \
+            return ERR_INVALID_HEADER;                                         \
+        memcpy(&h, p, sizeof(h));                                              \
+        uint16_t e_type = CONV(16, h.e_type);                                  \
+        uint16_t e_phnum = CONV(16, h.e_phnum);                                \
+        uint64_t e_phoff = CONV(W, h.e_phoff);                                 \
+                                                                               \
+        /* Make sure it's an executable or library */                          \
+        if (e_type != ET_EXEC && e_type != ET_DYN)                             \
+            return ERR_NO_EXEC_OR_DYN;                                         \
+                                                                               \
+        if (S_ISREG(f->st.st_mode) && e_phoff > (uint64_t)f->st.st_size)       \
+            return ERR_INVALID_PHOFF;                                          \
+                                                                               \
+        unsigned char const *phdrs = elf_file_view(                            \
+            f, e_phoff, (uint64_t)e_phnum * sizeof(struct prog_##W##_t));      \
+        if (phdrs == NULL)                                                     \
+            return ERR_INVALID_PROG_HEADER;                                    \
+                                                                               \
+        uint64_t dyn_offset = MAX_OFFSET_T;                                    \
+        uint64_t dyn_size = 0;                                                 \
+        for (uint64_t i = 0; i < e_phnum; ++i) {                               \
+            struct prog_##W##_t prog;                                          \
+            memcpy(&prog, phdrs + i * sizeof(prog), sizeof(prog));             \
+            uint32_t p_type = CONV(32, prog.p_type);                           \
+            if (p_type == PT_LOAD) {                                           \
+                small_vec_u64_append(pt_load_offset, CONV(W, prog.p_offset));  \
+                small_vec_u64_append(pt_load_vaddr, CONV(W, prog.p_vaddr));    \
+            } else if (p_type == PT_DYNAMIC) {                                 \
+                dyn_offset = CONV(W, prog.p_offset);                           \
+                dyn_size = CONV(W, prog.p_filesz);                             \
+            }                                                                  \
+        }                                                                      \
+                                                                               \
+        /* No dynamic section? */                                              \
+        if (dyn_offset == MAX_OFFSET_T)                                        \
+            return 0;                                                          \
+                                                                               \
+        info->has_dynamic = 1;                                                 \
+                                                                               \
+        /* I guess you always have to load at least a string table, so if */   \
+        /* there are not PT_LOAD sections, then it is an error. */             \
+        if (pt_load_offset->n == 0)                                            \
+            return ERR_NO_PT_LOAD;                                             \
+                                                                               \
+        unsigned char const *dyn = elf_file_view(f, dyn_offset, dyn_size);     \
+        if (dyn == NULL)                                                       \
+            return ERR_INVALID_DYNAMIC_SECTION;                                \
+                                                                               \
+        /* The dynamic array must be terminated by DT_NULL */                  \
+        size_t dyn_num = dyn_size / sizeof(struct dyn_##W##_t);                \
+        for (size_t i = 0; i < dyn_num; ++i) {                                 \
+            struct dyn_##W##_t e;                                              \
+            memcpy(&e, dyn + i * sizeof(e), sizeof(e));                        \
+            uint64_t d_tag = CONV(W, e.d_tag);                                 \
+            if (d_tag == DT_NULL)                                              \
+                return 0;                                                      \
+            elf_dynamic_entry(info, d, d_tag, CONV(W, e.d_val));               \
+        }                                                                      \
+        return ERR_INVALID_DYNAMIC_ARRAY_ENTRY;                                \
+    }
+
+ELF_DEFINE_PARSE_SEGMENTS(32, 32, ELF_NATIVE)
+ELF_DEFINE_PARSE_SEGMENTS(32_swapped, 32, ELF_SWAPPED)
+ELF_DEFINE_PARSE_SEGMENTS(64, 64, ELF_NATIVE)
+ELF_DEFINE_PARSE_SEGMENTS(64_swapped, 64, ELF_SWAPPED)
+
+typedef int (*elf_parse_segments_t)(struct elf_file_t *, struct elf_info_t *,
+                                    struct small_vec_u64_t *,
+                                    struct small_vec_u64_t *,
+                                    struct elf_dynamic_t *);
+
+// Indexed by whether the file is 64 bits, and whether bytes are swapped.
+static elf_parse_segments_t const elf_parse_segments[2][2] = {
+    {elf_parse_segments_32, elf_parse_segments_32_swapped},
+    {elf_parse_segments_64, elf_parse_segments_64_swapped}};
+
+// Count the relative relocations in the DT_RELR table at file offset
+// `offset`. A word with the low bit clear is the address of one relocation,
+// the other bits of a bitmap word each mark one after it.
+static uint64_t elf_count_relr(struct elf_file_t *f, struct elf_info_t *info,
+                               uint64_t offset, uint64_t size) {
+    uint64_t word = info->bits == BITS64 ? 8 : 4;
+    unsigned char const *p = elf_file_view(f, offset, size);
+    if (p == NULL)
+        return 0;
+    uint64_t count = 0;
+    for (uint64_t i = 0; i + word <= size; i += word) {
+        uint64_t w;
+        if (word == 8) {
+            memcpy(&w, p + i, 8);
+            w = info->swap ? bswap64(w) : w;
         } else {
+            uint32_t w32;
+            memcpy(&w32, p + i, 4);
+            w = elf_u32(info->swap, w32);
+        }
+        if ((w & 1) == 0) {
+            ++count;
             continue;
         }
+        for (w >>= 1; w != 0; w &= w - 1)
+            ++count;
+    }
+    return count;
+}
 
-        // Require matching {...}.
-        if (curly) {
-            if (st->arr[curr_src] != '}') {
-                continue;
-            }
-            ++curr_src;
-        }
+// Locate the strings and tables of the dynamic section in the file.
+static int elf_parse_dynamic(struct elf_file_t *f, struct elf_info_t *info,
+                             struct small_vec_u64_t *pt_load_offset,
+                             struct small_vec_u64_t *pt_load_vaddr,
+                             struct elf_dynamic_t *d) {
+    if (d->strtab == MAX_OFFSET_T)
+        return ERR_NO_STRTAB;
 
-        size_t var_len = strlen(var_val);
+    // Count relocations by the size of their tables. Entries are 3 or 2 words
+    // when the entry size is not given.
+    uint64_t word = info->bits == BITS64 ? 8 : 4;
+    uint64_t relaent = d->relaent != 0 ? d->relaent : 3 * word;
+    uint64_t relent = d->relent != 0 ? d->relent : 2 * word;
+    info->cost.relocs = d->relasz / relaent + d->relsz / relent;
+    info->cost.plt_size = d->pltrelsz;
+    info->cost.plt_relocs =
+        d->pltrelsz / (d->pltrel == DT_RELA ? relaent : relent);
+    if (info->cost.relative > info->cost.relocs)
+        info->cost.relative = info->cost.relocs;
+    if (d->gnu_hash != MAX_OFFSET_T)
+        info->cost.flags |= COST_GNU_HASH;
 
-        // Make sure we have enough space to write to.
-        string_table_maybe_grow(st, bytes_to_dollar + var_len);
+    // Let's verify just to be sure that the offsets are
+    // ordered.
+    if (!is_ascending_order(pt_load_vaddr->p, pt_load_vaddr->n))
+        return ERR_VADDRS_NOT_ORDERED;
 
-        // First copy over the string until the variable.
-        memcpy(&st->arr[s->string_table.n], &st->arr[prev_src],
-               bytes_to_dollar);
-        s->string_table.n += bytes_to_dollar;
+    // Find the file offsets corresponding to the virtual addresses
+    uint64_t strtab_offset =
+        elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->strtab);
+    info->symtab =
+        elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->symtab);
+    info->gnu_hash =
+        elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->gnu_hash);
+    info->hash = elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->hash);
+    info->versym =
+        elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->versym);
+    uint64_t verdef =
+        elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->verdef);
+    uint64_t verneed =
+        elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->verneed);
+
+    // Without DT_STRSZ the string table can extend up to the end of the file.
+    uint64_t strsz = d->strsz;
+    if (strsz == MAX_OFFSET_T) {
+        if (!S_ISREG(f->st.st_mode) ||
+            strtab_offset > (uint64_t)f->st.st_size)
+            return ERR_NO_STRTAB;
+        strsz = f->st.st_size - strtab_offset;
+    }
 
-        // Then move prev_src until after the variable.
-        prev_src = curr_src;
+    info->strtab = elf_file_view(f, strtab_offset, strsz);
+    if (info->strtab == NULL)
+        return ERR_NO_STRTAB;
+    info->strtab_size = strsz;
 
-        // Then copy the variable value (without null).
-        memcpy(&st->arr[s->string_table.n], var_val, var_len);
-        s->string_table.n += var_len;
-    }
+    if (d->soname != MAX_OFFSET_T &&
+        (info->soname = elf_string(info->strtab, strsz, d->soname)) == NULL)
+        return ERR_INVALID_SONAME;
 
-    // Did we copy anything? That implies a variable was interpolated.
-    // Copy the remainder, including the \0.
-    if (prev_src != src) {
-        string_table_store(st, st->arr + prev_src);
-        return 1;
-    }
+    if (d->rpath != MAX_OFFSET_T &&
+        (info->rpath = elf_string(info->strtab, strsz, d->rpath)) == NULL)
+        return ERR_INVALID_RPATH;
 
+    if (d->runpath != MAX_OFFSET_T &&
+        (info->runpath = elf_string(info->strtab, strsz, d->runpath)) == NULL)
+        return ERR_INVALID_RUNPATH;
+
+    for (size_t i = 0; i < info->needed.n; ++i)
+        if (elf_string(info->strtab, strsz, info->needed.p[i]) == NULL)
+            return ERR_INVALID_NEEDED;
+
+    // Versions are only checked, so a file with broken version sections can
+    // still be used.
+    if (elf_parse_versions(f, info, verdef, d->verdef_num, verneed,
+                           d->verneed_num) != 0)
+        info->verdef_n = info->versions_n = 0;
+
+    uint64_t relr = elf_vaddr_to_offset(pt_load_vaddr, pt_load_offset, d->relr);
+    if (relr != MAX_OFFSET_T) {
+        uint64_t packed = elf_count_relr(f, info, relr, d->relrsz);
+        info->cost.relocs += packed;
+        info->cost.relative += packed;
+    }
     return 0;
 }
 
-static void print_colon_delimited_paths(char const *start, char const *indent) {
-    while (1) {
-        // Don't print empty string
-        if (*start == '\0')
-            break;
+static int elf_parse(struct elf_file_t *f, struct elf_info_t *info) {
+    memset(info, 0, sizeof(*info));
+    small_vec_u64_init(&info->needed);
+    info->versions = NULL;
+    info->symtab = info->gnu_hash = info->hash = info->versym = MAX_OFFSET_T;
 
-        // Find the next delimiter after start
-        char *next = strchr(start, ':');
+    // Parse the header
+    unsigned char const *e_ident = elf_file_view(f, 0, 16);
+    if (e_ident == NULL)
+        return ERR_INVALID_MAGIC;
 
-        // Don't print empty strings
-        if (start == next) {
-            ++start;
-            continue;
-        }
+    // Find magic elfs
+    if (e_ident[0] != 0x7f || e_ident[1] != 'E' || e_ident[2] != 'L' ||
+        e_ident[3] != 'F')
+        return ERR_INVALID_MAGIC;
 
-        fputs(indent, stdout);
-        fputs(JUST_INDENT, stdout);
+    // Do at least *some* header validation
+    if (e_ident[4] != 1 && e_ident[4] != 2)
+        return ERR_INVALID_CLASS;
 
-        // Print up to but not including : or \0, followed by a newline.
-        if (next == NULL) {
-            puts(start);
-        } else {
-            fwrite(start, 1, next - start, stdout);
-            putchar('\n');
-        }
+    if (e_ident[5] != 1 && e_ident[5] != 2)
+        return ERR_INVALID_DATA;
 
-        // We done yet?
-        if (next == NULL)
-            break;
+    info->bits = e_ident[4] == 2 ? BITS64 : BITS32;
+    int is_little_endian = e_ident[5] == 1;
 
-        // Otherwise put the : back in place and continue.
-        start = next + 1;
-    }
+    // Files of the other byte order are swapped as they are read.
+    info->swap = is_little_endian ^ host_is_little_endian();
+
+    // map vaddr to file offset
+    struct small_vec_u64_t pt_load_offset;
+    struct small_vec_u64_t pt_load_vaddr;
+
+    small_vec_u64_init(&pt_load_offset);
+    small_vec_u64_init(&pt_load_vaddr);
+
+    struct elf_dynamic_t d;
+    d.strtab = d.strsz = d.rpath = d.runpath = d.soname = MAX_OFFSET_T;
+    d.symtab = d.gnu_hash = d.hash = d.versym = d.verdef = d.verneed =
+        MAX_OFFSET_T;
+    d.verdef_num = d.verneed_num = 0;
+    d.relasz = d.relaent = d.relsz = d.relent = d.pltrelsz = d.pltrel = 0;
+    d.relr = MAX_OFFSET_T;
+    d.relrsz = 0;
+
+    int code = elf_parse_segments[info->bits == BITS64][info->swap](
+        f, info, &pt_load_offset, &pt_load_vaddr, &d);
+    if (code == 0 && info->has_dynamic)
+        code = elf_parse_dynamic(f, info, &pt_load_offset, &pt_load_vaddr, &d);
+
+    small_vec_u64_free(&pt_load_offset);
+    small_vec_u64_free(&pt_load_vaddr);
+    return code;
 }
 
-static void print_line(size_t depth, char *name, char *color_bold,
-                       char *color_regular, int highlight,
-                       struct found_t reason, struct libtree_state_t *s) {
-    tree_preamble(s, depth);
-    // Color the filename different than the path name, if we have a path.
-    char *slash = NULL;
-    if (s->color && highlight && (slash = strrchr(name, '/')) != NULL) {
-        fputs(color_regular, stdout);
-        fwrite(name, 1, slash + 1 - name, stdout);
-        fputs(color_bold, stdout);
-        fputs(slash + 1, stdout);
-    } else {
-        if (s->color)
-            fputs(color_bold, stdout);
+/**
+ * end of elf_info_t
+ */
 
-        fputs(name, stdout);
-    }
-    if (s->color && highlight)
-        fputs(CLEAR " " BOLD_YELLOW, stdout);
-    else
-        putchar(' ');
-    switch (reason.how) {
-    case RPATH:
-        if (reason.depth + 1 >= depth) {
-            fputs("[rpath]", stdout);
-        } else {
-            char num[8];
-            utoa(num, reason.depth + 1);
-            fputs("[rpath of ", stdout);
-            fputs(num, stdout);
-            putchar(']');
-        }
-        break;
-    case LD_LIBRARY_PATH:
-        fputs("[LD_LIBRARY_PATH]", stdout);
-        break;
-    case RUNPATH:
-        fputs("[runpath]", stdout);
-        break;
-    case LD_SO_CONF:
-        fputs("[ld.so.conf]", stdout);
-        break;
-    case DIRECT:
-        fputs("[direct]", stdout);
-        break;
-    case DEFAULT:
-        fputs("[default path]", stdout);
-        break;
-    default:
-        break;
+/**
+ * elf_symbols_t is the dynamic symbol table of a file, to check that its
+ * undefined symbols are defined by some object in its load scope. It is only
+ * read when asked for, and then once per inode.
+ */
+struct elf_symbols_t {
+    // Copy of the string table, with a null terminator appended.
+    char *strtab;
+    // By symbol index: the name in strtab, and whether the symbol is defined
+    // and visible to other objects.
+    uint32_t *names;
+    unsigned char *exported;
+    uint32_t n;
+    // Indices of the undefined symbols that are not weak.
+    uint32_t *undefined;
+    uint32_t undefined_n;
+    // Either DT_GNU_HASH, with the bloom filter widened to 64 bits, or DT_HASH
+    // which has neither bloom filter nor symoffset.
+    int gnu;
+    uint32_t nbuckets;
+    uint32_t symoffset;
+    uint32_t bloom_size;
+    uint32_t bloom_shift;
+    uint32_t bloom_bits;
+    uint64_t *bloom;
+    uint32_t *buckets;
+    uint32_t *chain;
+};
+
+static uint32_t gnu_hash(char const *name) {
+    uint32_t h = 5381;
+    for (unsigned char const *c = (unsigned char const *)name; *c; ++c)
+        h = h * 33 + *c;
+    return h;
+}
+
+static uint32_t sysv_hash(char const *name) {
+    uint32_t h = 0;
+    for (unsigned char const *c = (unsigned char const *)name; *c; ++c) {
+        h = (h << 4) + *c;
+        uint32_t g = h & 0xf0000000;
+        h ^= g >> 24;
+        h &= ~g;
     }
-    if (s->color)
-        fputs(CLEAR "\n", stdout);
-    else
-        putchar('\n');
+    return h;
 }
 
-static void print_error(size_t depth, size_t needed_not_found,
-                        struct small_vec_u64_t *needed_buf_offsets,
-                        char *runpath, struct libtree_state_t *s,
-                        int no_def_lib) {
-    for (size_t i = 0; i < needed_not_found; ++i) {
-        s->found_all_needed[depth] = i + 1 >= needed_not_found;
-        tree_preamble(s, depth + 1);
-        if (s->color)
-            fputs(BOLD_RED, stdout);
-        fputs(s->string_table.arr + needed_buf_offsets->p[i], stdout);
-        fputs(s->color ? " not found" CLEAR "\n" : " not found\n", stdout);
+static void elf_symbols_free(struct elf_symbols_t *sym) {
+    if (sym == NULL)
+        return;
+    free(sym->strtab);
+    free(sym->names);
+    free(sym->exported);
+    free(sym->undefined);
+    free(sym->bloom);
+    free(sym->buckets);
+    free(sym->chain);
+    free(sym);
+}
+
+// Copy `n` 32-bit words at `offset` in the file in host byte order, or return
+// NULL.
+static uint32_t *elf_copy_words(struct elf_file_t *f, uint64_t offset,
+                                uint64_t n, int swap) {
+    void const *p = elf_file_view(f, offset, n * sizeof(uint32_t));
+    if (p == NULL)
+        return NULL;
+    uint32_t *words = malloc(n == 0 ? 1 : n * sizeof(uint32_t));
+    if (words == NULL)
+        exit(1);
+    memcpy(words, p, n * sizeof(uint32_t));
+    if (swap)
+        for (uint64_t i = 0; i < n; ++i)
+            words[i] = bswap32(words[i]);
+    return words;
+}
+
+// Read the hash table, which also tells the number of symbols.
+static int elf_parse_hash_table(struct elf_file_t *f, struct elf_info_t *info,
+                                struct elf_symbols_t *sym) {
+    int swap = info->swap;
+    if (info->gnu_hash == MAX_OFFSET_T) {
+        uint32_t *h = elf_copy_words(f, info->hash, 2, swap);
+        if (h == NULL)
+            return 1;
+        sym->nbuckets = h[0];
+        sym->n = h[1];
+        free(h);
+        uint64_t chain = info->hash + 8 + 4 * (uint64_t)sym->nbuckets;
+        sym->buckets = elf_copy_words(f, info->hash + 8, sym->nbuckets, swap);
+        sym->chain = sym->buckets == NULL
+                         ? NULL
+                         : elf_copy_words(f, chain, sym->n, swap);
+        return sym->chain == NULL;
     }
 
-    // If anything was not found, we print the search paths in order they
-    // are considered.
-    char *box_vertical =
-        s->color ? JUST_INDENT REGULAR_RED LIGHT_QUADRUPLE_DASH_VERTICAL CLEAR
-                 : JUST_INDENT LIGHT_QUADRUPLE_DASH_VERTICAL;
-    char *indent = malloc(sizeof(LIGHT_VERTICAL_WITH_INDENT) * depth +
-                          strlen(box_vertical) + 1);
-    char *p = indent;
-    for (int i = 0; i < depth; ++i) {
-        if (s->found_all_needed[i]) {
-            int len = sizeof(JUST_INDENT) - 1;
-            memcpy(p, JUST_INDENT, len);
-            p += len;
+    uint32_t *h = elf_copy_words(f, info->gnu_hash, 4, swap);
+    if (h == NULL)
+        return 1;
+    sym->gnu = 1;
+    sym->nbuckets = h[0];
+    sym->symoffset = h[1];
+    sym->bloom_size = h[2];
+    sym->bloom_shift = h[3];
+    sym->bloom_bits = info->bits == BITS64 ? 64 : 32;
+    free(h);
+    if (sym->nbuckets == 0 || sym->bloom_size == 0)
+        return 1;
+
+    uint64_t offset = info->gnu_hash + 16;
+    uint64_t bloom_bytes = (uint64_t)sym->bloom_size * sym->bloom_bits / 8;
+    unsigned char const *bloom = elf_file_view(f, offset, bloom_bytes);
+    if (bloom == NULL)
+        return 1;
+    sym->bloom = malloc(sym->bloom_size * sizeof(uint64_t));
+    if (sym->bloom == NULL)
+        exit(1);
+    for (uint32_t i = 0; i < sym->bloom_size; ++i) {
+        if (sym->bloom_bits == 64) {
+            memcpy(&sym->bloom[i], bloom + 8 * i, 8);
+            if (swap)
+                sym->bloom[i] = bswap64(sym->bloom[i]);
         } else {
-            int len = sizeof(LIGHT_VERTICAL_WITH_INDENT) - 1;
-            memcpy(p, LIGHT_VERTICAL_WITH_INDENT, len);
-            p += len;
+            uint32_t word;
+            memcpy(&word, bloom + 4 * i, 4);
+            sym->bloom[i] = elf_u32(swap, word);
         }
     }
-    // dotted | in red
-    strcpy(p, box_vertical);
-
-    fputs(indent, stdout);
-    if (s->color)
-        fputs(BRIGHT_BLACK, stdout);
-    fputs(" Paths considered in this order:\n", stdout);
-    if (s->color)
-        fputs(CLEAR, stdout);
+    offset += bloom_bytes;
 
-    // Consider rpaths only when runpath is empty
-    fputs(indent, stdout);
-    if (runpath != NULL) {
-        if (s->color)
-            fputs(BRIGHT_BLACK, stdout);
-        fputs(" 1. rpath is skipped because runpath was set\n", stdout);
-        if (s->color)
-            fputs(CLEAR, stdout);
-    } else {
-        fputs(s->color ? BRIGHT_BLACK " 1. rpath:" CLEAR "\n" : " 1. rpath:\n",
-              stdout);
-        for (int j = depth; j >= 0; --j) {
-            if (s->rpath_offsets[j] != SIZE_MAX) {
-                char num[8];
-                utoa(num, j + 1);
-                fputs(indent, stdout);
-                if (s->color)
-                    fputs(BRIGHT_BLACK, stdout);
-                fputs("    depth ", stdout);
-                fputs(num, stdout);
-                if (s->color)
-                    fputs(CLEAR, stdout);
-                putchar('\n');
-                print_colon_delimited_paths(
-                    s->string_table.arr + s->rpath_offsets[j], indent);
+    sym->buckets = elf_copy_words(f, offset, sym->nbuckets, swap);
+    if (sym->buckets == NULL)
+        return 1;
+    offset += 4 * (uint64_t)sym->nbuckets;
+
+    // Symbols are sorted by bucket, so the chain of the last bucket ends the
+    // table; its last entry has the lowest bit set.
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < sym->nbuckets; ++i)
+        if (sym->buckets[i] > last)
+            last = sym->buckets[i];
+    sym->n = sym->symoffset;
+    if (last >= sym->symoffset) {
+        for (uint32_t i = last;; ++i) {
+            uint64_t at = offset + 4 * (uint64_t)(i - sym->symoffset);
+            uint32_t const *word = elf_file_view(f, at, 4);
+            if (word == NULL || i == UINT32_MAX)
+                return 1;
+            uint32_t value;
+            memcpy(&value, word, 4);
+            if (elf_u32(swap, value) & 1) {
+                sym->n = i + 1;
+                break;
             }
         }
     }
+    sym->chain = elf_copy_words(f, offset, sym->n - sym->symoffset, swap);
+    if (sym->chain == NULL)
+        return 1;
 
-    fputs(indent, stdout);
-    if (s->ld_library_path_offset == SIZE_MAX) {
-        fputs(s->color ? BRIGHT_BLACK " 2. LD_LIBRARY_PATH was not set" CLEAR
-                                      "\n"
-                       : " 2. LD_LIBRARY_PATH was not set\n",
-              stdout);
-    } else {
-        fputs(s->color ? BRIGHT_BLACK " 2. LD_LIBRARY_PATH:" CLEAR "\n"
-                       : " 2. LD_LIBRARY_PATH:\n",
-              stdout);
-        print_colon_delimited_paths(
-            s->string_table.arr + s->ld_library_path_offset, indent);
-    }
+    // Without defined symbols the table does not tell how many undefined ones
+    // there are, but linkers put the string table right after the symbols.
+    uint64_t strtab = (unsigned char const *)info->strtab - f->map;
+    uint64_t entsize = info->bits == BITS64 ? sizeof(struct sym_64_t)
+                                            : sizeof(struct sym_32_t);
+    if (last < sym->symoffset && strtab > info->symtab &&
+        (strtab - info->symtab) / entsize > sym->n &&
+        (strtab - info->symtab) / entsize < UINT32_MAX)
+        sym->n = (strtab - info->symtab) / entsize;
+    return 0;
+}
 
-    fputs(indent, stdout);
-    if (runpath == NULL) {
-        fputs(s->color ? BRIGHT_BLACK " 3. runpath was not set" CLEAR "\n"
-                       : " 3. runpath was not set\n",
-              stdout);
-    } else {
-        fputs(s->color ? BRIGHT_BLACK " 3. runpath:" CLEAR "\n"
-                       : " 3. runpath:\n",
-              stdout);
-        print_colon_delimited_paths(runpath, indent);
+// Classify symbol `i` as exported, undefined or neither.
+static void elf_add_symbol(struct elf_symbols_t *sym, uint32_t i,
+                           uint32_t st_name, unsigned char st_info,
+                           unsigned char st_other, uint16_t st_shndx,
+                           uint16_t version, uint64_t strtab_size) {
+    // Names out of bounds point to the terminator, which never matches.
+    sym->names[i] = st_name < strtab_size ? st_name : strtab_size;
+    int named = sym->strtab[sym->names[i]] != '\0';
+    int bind = st_info >> 4;
+    int visibility = st_other & 3;
+
+    // Local versions (index 0) and hidden versions can't be bound to.
+    sym->exported[i] =
+        named && st_shndx != SHN_UNDEF &&
+        (bind == STB_GLOBAL || bind == STB_WEAK || bind == STB_GNU_UNIQUE) &&
+        (visibility == STV_DEFAULT || visibility == STV_PROTECTED) &&
+        (version & VERSYM_HIDDEN) == 0 && version != 0;
+    if (named && st_shndx == SHN_UNDEF && bind == STB_GLOBAL)
+        sym->undefined[sym->undefined_n++] = i;
+}
+
+// Defines elf_decode_symbols_S, which classifies all symbols of a file with W
+// bits, converting fields from file byte order with CONV.
+#define ELF_DEFINE_DECODE_SYMBOLS(S, W, CONV)                                  \
+    static void elf_decode_symbols_##S(                                        \
+        struct elf_symbols_t *sym, unsigned char const *syms,                  \
+        unsigned char const *versym, uint64_t strtab_size) {                   \
+        for (uint32_t i = 0; i < sym->n; ++i) {                                \
+            struct sym_##W##_t e;                                              \
+            memcpy(&e, syms + i * sizeof(e), sizeof(e));                       \
+            uint16_t version = 1;                                              \
+            if (versym != NULL) {                                              \
+                memcpy(&version, versym + 2 * i, 2);                           \
+                version = CONV(16, version);                                   \
+            }                                                                  \
+            elf_add_symbol(sym, i, CONV(32, e.st_name), e.st_info,             \
+                           e.st_other, CONV(16, e.st_shndx), version,          \
+                           strtab_size);                                       \
+        }                                                                      \
     }
 
-    fputs(indent, stdout);
-    if (no_def_lib) {
-        fputs(s->color ? BRIGHT_BLACK
-                  " 4. ld.so.conf not considered due to NODEFLIB flag" CLEAR
-                  "\n"
-                       : " 4. ld.so.conf not considered due to NODEFLIB flag\n",
-              stdout);
-    } else {
-        fputs(s->color ? BRIGHT_BLACK " 4. ld.so.conf:" CLEAR "\n"
-                       : " 4. ld.so.conf:\n",
-              stdout);
+ELF_DEFINE_DECODE_SYMBOLS(32, 32, ELF_NATIVE)
+ELF_DEFINE_DECODE_SYMBOLS(32_swapped, 32, ELF_SWAPPED)
+ELF_DEFINE_DECODE_SYMBOLS(64, 64, ELF_NATIVE)
+ELF_DEFINE_DECODE_SYMBOLS(64_swapped, 64, ELF_SWAPPED)
+
+typedef void (*elf_decode_symbols_t)(struct elf_symbols_t *,
+                                     unsigned char const *,
+                                     unsigned char const *, uint64_t);
+
+// Indexed by whether the file is 64 bits, and whether bytes are swapped.
+static elf_decode_symbols_t const elf_decode_symbols[2][2] = {
+    {elf_decode_symbols_32, elf_decode_symbols_32_swapped},
+    {elf_decode_symbols_64, elf_decode_symbols_64_swapped}};
+
+// Read the dynamic symbol table of a parsed file. Returns NULL when it cannot
+// be read, which is only attempted for mapped files.
+static struct elf_symbols_t *elf_parse_symbols(struct elf_file_t *f,
+                                               struct elf_info_t *info) {
+    struct elf_symbols_t *sym = calloc(1, sizeof(struct elf_symbols_t));
+    if (sym == NULL)
+        exit(1);
+
+    // Nothing is defined or needed.
+    if (!info->has_dynamic || info->symtab == MAX_OFFSET_T)
+        return sym;
+
+    if (f->map == NULL ||
+        (info->gnu_hash == MAX_OFFSET_T && info->hash == MAX_OFFSET_T) ||
+        elf_parse_hash_table(f, info, sym) != 0) {
+        elf_symbols_free(sym);
+        return NULL;
     }
-    print_colon_delimited_paths(s->string_table.arr + s->ld_so_conf_offset,
-                                indent);
 
-    fputs(indent, stdout);
-    if (no_def_lib) {
-        fputs(s->color
-                  ? BRIGHT_BLACK
-                  " 5. Standard paths not considered due to NODEFLIB flag" CLEAR
-                  "\n"
-                  : " 4. Standard paths not considered due to NODEFLIB flag\n",
-              stdout);
-    } else {
-        fputs(s->color ? BRIGHT_BLACK " 5. Standard paths:" CLEAR "\n"
-                       : " 5. Standard paths:\n",
-              stdout);
+    size_t entsize = info->bits == BITS64 ? sizeof(struct sym_64_t)
+                                          : sizeof(struct sym_32_t);
+    unsigned char const *syms =
+        elf_file_view(f, info->symtab, (uint64_t)sym->n * entsize);
+    unsigned char const *versym =
+        info->versym == MAX_OFFSET_T
+            ? NULL
+            : elf_file_view(f, info->versym, (uint64_t)sym->n * 2);
+    if (syms == NULL) {
+        elf_symbols_free(sym);
+        return NULL;
     }
-    print_colon_delimited_paths(s->string_table.arr + s->default_paths_offset,
-                                indent);
 
-    free(indent);
+    sym->strtab = malloc(info->strtab_size + 1);
+    sym->names = malloc((sym->n + 1) * sizeof(uint32_t));
+    sym->exported = malloc(sym->n + 1);
+    sym->undefined = malloc((sym->n + 1) * sizeof(uint32_t));
+    if (sym->strtab == NULL || sym->names == NULL || sym->exported == NULL ||
+        sym->undefined == NULL)
+        exit(1);
+    memcpy(sym->strtab, info->strtab, info->strtab_size);
+    sym->strtab[info->strtab_size] = '\0';
+
+    elf_decode_symbols[info->bits == BITS64][info->swap](
+        sym, syms, versym, info->strtab_size);
+    return sym;
+}
+
+// Whether `sym` exports `name`, whose GNU and SysV hashes are given.
+static int elf_symbols_defines(struct elf_symbols_t const *sym,
+                               char const *name, uint32_t gnu_h,
+                               uint32_t sysv_h) {
+    if (sym->nbuckets == 0)
+        return 0;
+
+    if (!sym->gnu) {
+        // Guard against cycles in malformed chains.
+        uint32_t steps = 0;
+        for (uint32_t i = sym->buckets[sysv_h % sym->nbuckets];
+             i != 0 && i < sym->n && steps++ < sym->n; i = sym->chain[i])
+            if (sym->exported[i] &&
+                strcmp(sym->strtab + sym->names[i], name) == 0)
+                return 1;
+        return 0;
+    }
+
+    // The bloom filter rules out most symbols with two bits.
+    uint64_t word = sym->bloom[(gnu_h / sym->bloom_bits) % sym->bloom_size];
+    uint64_t mask = (uint64_t)1 << (gnu_h % sym->bloom_bits) |
+                    (uint64_t)1 << ((gnu_h >> sym->bloom_shift) % sym->bloom_bits);
+    if ((word & mask) != mask)
+        return 0;
+
+    uint32_t i = sym->buckets[gnu_h % sym->nbuckets];
+    if (i < sym->symoffset)
+        return 0;
+    for (; i < sym->n; ++i) {
+        uint32_t h = sym->chain[i - sym->symoffset];
+        if ((h | 1) == (gnu_h | 1) && sym->exported[i] &&
+            strcmp(sym->strtab + sym->names[i], name) == 0)
+            return 1;
+        if (h & 1)
+            break;
+    }
+    return 0;
+}
+
+// Parse the dynamic symbol table of the file at `path`, or return NULL.
+static struct elf_symbols_t *elf_symbols_load(char const *path) {
+    struct elf_file_t file;
+    if (elf_file_open(&file, path) != 0)
+        return NULL;
+    struct elf_info_t info;
+    struct elf_symbols_t *sym = NULL;
+    if (elf_parse(&file, &info) == 0)
+        sym = elf_parse_symbols(&file, &info);
+    elf_info_free(&info);
+    elf_file_close(&file);
+    return sym;
+}
+
+/**
+ * end of elf_symbols_t
+ */
+
+static void string_table_maybe_grow(struct string_table_t *t, size_t n) {
+    // The likely case of not having to resize
+    if (t->n + n <= t->capacity)
+        return;
+
+    // Otherwise give twice the amount of required space.
+    t->capacity = 2 * (t->n + n);
+    char *arr = realloc(t->arr, t->capacity);
+    if (arr == NULL) {
+        exit(1);
+    }
+    t->arr = arr;
+}
+
+static void string_table_store(struct string_table_t *t, char const *str) {
+    size_t n = strlen(str) + 1;
+    string_table_maybe_grow(t, n);
+    memcpy(t->arr + t->n, str, n);
+    t->n += n;
+}
+
+static char *string_copy(char const *str) {
+    if (str == NULL)
+        return NULL;
+    size_t n = strlen(str) + 1;
+    char *copy = malloc(n);
+    if (copy == NULL)
+        exit(1);
+    memcpy(copy, str, n);
+    return copy;
+}
+
+/**
+ * str_map_t
+ */
+
+// FNV-1a
+static uint64_t hash_string(char const *str) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (; *str != '\0'; ++str)
+        hash = (hash ^ (unsigned char)*str) * 0x100000001b3;
+    return hash;
+}
+
+static void str_map_init(struct str_map_t *m, size_t capacity) {
+    m->keys.n = 0;
+    m->keys.capacity = 16 * capacity;
+    m->keys.arr = malloc(m->keys.capacity);
+    m->n = 0;
+    m->capacity = capacity;
+    m->slots = malloc(capacity * sizeof(struct str_map_slot_t));
+    if (m->keys.arr == NULL || m->slots == NULL)
+        exit(1);
+    for (size_t i = 0; i < capacity; ++i)
+        m->slots[i].key = SIZE_MAX;
+}
+
+static void str_map_free(struct str_map_t *m) {
+    free(m->keys.arr);
+    free(m->slots);
+}
+
+// Returns the slot of `key`, or the empty slot where it should be inserted.
+static struct str_map_slot_t *str_map_slot(struct str_map_t *m,
+                                           char const *key, uint64_t hash) {
+    size_t mask = m->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct str_map_slot_t *slot = &m->slots[i];
+        if (slot->key == SIZE_MAX ||
+            (slot->hash == hash && strcmp(m->keys.arr + slot->key, key) == 0))
+            return slot;
+    }
+}
+
+static size_t *str_map_get(struct str_map_t *m, char const *key) {
+    struct str_map_slot_t *slot = str_map_slot(m, key, hash_string(key));
+    return slot->key == SIZE_MAX ? NULL : &slot->value;
+}
+
+static void str_map_put(struct str_map_t *m, char const *key, size_t value) {
+    // Keep the load factor below 1/2.
+    if (2 * (m->n + 1) > m->capacity) {
+        struct str_map_slot_t *old = m->slots;
+        size_t old_capacity = m->capacity;
+        m->capacity *= 2;
+        m->slots = malloc(m->capacity * sizeof(struct str_map_slot_t));
+        if (m->slots == NULL)
+            exit(1);
+        for (size_t i = 0; i < m->capacity; ++i)
+            m->slots[i].key = SIZE_MAX;
+        size_t mask = m->capacity - 1;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].key == SIZE_MAX)
+                continue;
+            size_t j = old[i].hash & mask;
+            while (m->slots[j].key != SIZE_MAX)
+                j = (j + 1) & mask;
+            m->slots[j] = old[i];
+        }
+        free(old);
+    }
+
+    uint64_t hash = hash_string(key);
+    struct str_map_slot_t *slot = str_map_slot(m, key, hash);
+    if (slot->key == SIZE_MAX) {
+        slot->hash = hash;
+        slot->key = m->keys.n;
+        string_table_store(&m->keys, key);
+        ++m->n;
+    }
+    slot->value = value;
+}
+
+/**
+ * end of str_map_t
+ */
+
+/**
+ * arena_t
+ */
+
+#define ARENA_CHUNK_SIZE 65536
+
+static void *arena_alloc(struct arena_t *a, size_t size) {
+    if (a->chunk == NULL || a->n + size > a->capacity) {
+        size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk_t *chunk =
+            malloc(sizeof(struct arena_chunk_t) + capacity);
+        if (chunk == NULL)
+            exit(1);
+        chunk->prev = a->chunk;
+        a->chunk = chunk;
+        a->n = 0;
+        a->capacity = capacity;
+    }
+    void *p = a->chunk->data + a->n;
+    a->n += size;
+    a->bytes += size;
+    return p;
+}
+
+static void arena_free(struct arena_t *a) {
+    while (a->chunk != NULL) {
+        struct arena_chunk_t *prev = a->chunk->prev;
+        free(a->chunk);
+        a->chunk = prev;
+    }
+    a->n = a->capacity = a->bytes = 0;
+}
+
+/**
+ * end of arena_t
+ */
+
+/**
+ * intern_t
+ */
+
+static void intern_init(struct intern_t *t, uint64_t epoch) {
+    memset(t, 0, sizeof(*t));
+    t->epoch = epoch;
+    t->capacity = 256;
+    t->slots = malloc(t->capacity * sizeof(struct intern_slot_t));
+    t->strings_capacity = 128;
+    t->strings = malloc(t->strings_capacity * sizeof(char const *));
+    if (t->slots == NULL || t->strings == NULL)
+        exit(1);
+    for (size_t i = 0; i < t->capacity; ++i)
+        t->slots[i].id = SIZE_MAX;
+}
+
+static void intern_free(struct intern_t *t) {
+    arena_free(&t->arena);
+    free(t->slots);
+    free(t->strings);
+    free(t->scratch.arr);
+}
+
+// Forget all strings. Ids handed out before are stale.
+static void intern_reset(struct intern_t *t) {
+    uint64_t epoch = t->epoch + 1;
+    intern_free(t);
+    intern_init(t, epoch);
+}
+
+static struct intern_slot_t *intern_slot(struct intern_t *t, char const *str,
+                                         uint64_t hash) {
+    size_t mask = t->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct intern_slot_t *slot = &t->slots[i];
+        if (slot->id == SIZE_MAX ||
+            (slot->hash == hash && strcmp(t->strings[slot->id], str) == 0))
+            return slot;
+    }
+}
+
+// Returns the id of `str`, storing it when it is new.
+static size_t intern_string(struct intern_t *t, char const *str) {
+    uint64_t hash = hash_string(str);
+    struct intern_slot_t *slot = intern_slot(t, str, hash);
+    if (slot->id != SIZE_MAX)
+        return slot->id;
+
+    // Keep the load factor below 1/2.
+    if (2 * (t->n + 1) > t->capacity) {
+        struct intern_slot_t *old = t->slots;
+        size_t old_capacity = t->capacity;
+        t->capacity *= 2;
+        t->slots = malloc(t->capacity * sizeof(struct intern_slot_t));
+        if (t->slots == NULL)
+            exit(1);
+        for (size_t i = 0; i < t->capacity; ++i)
+            t->slots[i].id = SIZE_MAX;
+        size_t mask = t->capacity - 1;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i].id == SIZE_MAX)
+                continue;
+            size_t j = old[i].hash & mask;
+            while (t->slots[j].id != SIZE_MAX)
+                j = (j + 1) & mask;
+            t->slots[j] = old[i];
+        }
+        free(old);
+        slot = intern_slot(t, str, hash);
+    }
+    if (t->n == t->strings_capacity) {
+        t->strings_capacity *= 2;
+        t->strings =
+            realloc(t->strings, t->strings_capacity * sizeof(char const *));
+        if (t->strings == NULL)
+            exit(1);
+    }
+
+    size_t size = strlen(str) + 1;
+    char *copy = arena_alloc(&t->arena, size);
+    memcpy(copy, str, size);
+    t->strings[t->n] = copy;
+    slot->hash = hash;
+    slot->id = t->n;
+    return t->n++;
+}
+
+static inline char const *intern_get(struct intern_t *t, size_t id) {
+    return t->strings[id];
+}
+
+/**
+ * end of intern_t
+ */
+
+/**
+ * dir_index_t
+ */
+
+static void dir_index_init(struct dir_index_t *idx) {
+    str_map_init(&idx->paths, 64);
+    idx->n = 0;
+    idx->capacity = 16;
+    idx->dirs = malloc(idx->capacity * sizeof(struct dir_t *));
+    if (idx->dirs == NULL)
+        exit(1);
+    pthread_mutex_init(&idx->lock, NULL);
+    pthread_cond_init(&idx->listed, NULL);
+}
+
+static void dir_free(struct dir_t *dir) {
+    str_map_free(&dir->entries);
+    free(dir);
+}
+
+static void dir_index_free(struct dir_index_t *idx) {
+    for (size_t i = 0; i < idx->n; ++i)
+        dir_free(idx->dirs[i]);
+    free(idx->dirs);
+    str_map_free(&idx->paths);
+    pthread_mutex_destroy(&idx->lock);
+    pthread_cond_destroy(&idx->listed);
+}
+
+static struct dir_t *dir_list(char const *path, struct stat *finfo) {
+    struct dir_t *dir = malloc(sizeof(struct dir_t));
+    if (dir == NULL)
+        exit(1);
+    dir->st_dev = finfo->st_dev;
+    dir->st_ino = finfo->st_ino;
+    dir->listed = 0;
+    str_map_init(&dir->entries, 64);
+
+    DIR *dirp = opendir(path);
+    if (dirp != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dirp)) != NULL)
+            str_map_put(&dir->entries, entry->d_name, 0);
+        closedir(dirp);
+        dir->listed = 1;
+    }
+
+    return dir;
+}
+
+// Maybe we know this directory under a different name. Requires the lock.
+static size_t dir_index_find(struct dir_index_t *idx, struct stat *finfo) {
+    for (size_t i = 0; i < idx->n; ++i)
+        if (idx->dirs[i]->st_dev == finfo->st_dev &&
+            idx->dirs[i]->st_ino == finfo->st_ino)
+            return i;
+    return SIZE_MAX;
+}
+
+// Requires the lock.
+static size_t dir_index_append(struct dir_index_t *idx, struct dir_t *dir) {
+    if (idx->n == idx->capacity) {
+        idx->capacity *= 2;
+        idx->dirs = realloc(idx->dirs, idx->capacity * sizeof(struct dir_t *));
+        if (idx->dirs == NULL)
+            exit(1);
+    }
+    idx->dirs[idx->n] = dir;
+    return idx->n++;
+}
+
+// Returns the entries of the directory `path`, listing it when it is first
+// encountered, or NULL when `path` is not a directory.
+static struct dir_t *dir_index_get(struct dir_index_t *idx, char const *path) {
+    pthread_mutex_lock(&idx->lock);
+    size_t *known;
+    while ((known = str_map_get(&idx->paths, path)) != NULL &&
+           *known == CACHE_PENDING)
+        pthread_cond_wait(&idx->listed, &idx->lock);
+
+    if (known != NULL) {
+        struct dir_t *dir = *known == SIZE_MAX ? NULL : idx->dirs[*known];
+        pthread_mutex_unlock(&idx->lock);
+        return dir;
+    }
+
+    str_map_put(&idx->paths, path, CACHE_PENDING);
+    pthread_mutex_unlock(&idx->lock);
+
+    // Stat and list the directory without holding the lock.
+    struct stat finfo;
+    int is_dir = stat(path, &finfo) == 0 && S_ISDIR(finfo.st_mode);
+
+    size_t i = SIZE_MAX;
+    if (is_dir) {
+        pthread_mutex_lock(&idx->lock);
+        i = dir_index_find(idx, &finfo);
+        pthread_mutex_unlock(&idx->lock);
+    }
+
+    struct dir_t *listing = NULL;
+    if (is_dir && i == SIZE_MAX)
+        listing = dir_list(path, &finfo);
+
+    pthread_mutex_lock(&idx->lock);
+    if (listing != NULL) {
+        // Another thread may have listed it under a different name meanwhile.
+        i = dir_index_find(idx, &finfo);
+        if (i == SIZE_MAX)
+            i = dir_index_append(idx, listing);
+        else
+            dir_free(listing);
+    }
+    str_map_put(&idx->paths, path, i);
+    struct dir_t *dir = i == SIZE_MAX ? NULL : idx->dirs[i];
+    pthread_cond_broadcast(&idx->listed);
+    pthread_mutex_unlock(&idx->lock);
+    return dir;
+}
+
+// Returns 0 when `name` certainly does not exist in the directory, 1 when it
+// may exist.
+static int dir_may_contain(struct dir_t *dir, char const *name) {
+    if (dir == NULL)
+        return 0;
+    if (!dir->listed)
+        return 1;
+    return str_map_get(&dir->entries, name) != NULL;
+}
+
+// List the directory `path` again when its entries changed. Returns 1 when it
+// is no longer the directory that was listed, so the index should be reset.
+static int dir_index_relist(struct dir_index_t *idx, char const *path) {
+    size_t *known = str_map_get(&idx->paths, path);
+    if (known == NULL)
+        return 0;
+    if (*known == SIZE_MAX)
+        return 1;
+    struct dir_t *dir = idx->dirs[*known];
+    struct stat finfo;
+    if (stat(path, &finfo) != 0 || !S_ISDIR(finfo.st_mode) ||
+        finfo.st_dev != dir->st_dev || finfo.st_ino != dir->st_ino)
+        return 1;
+    // Other names of the directory share the listing.
+    idx->dirs[*known] = dir_list(path, &finfo);
+    dir_free(dir);
+    return 0;
+}
+
+/**
+ * end of dir_index_t
+ */
+
+/**
+ * ld_cache_t
+ */
+
+struct ld_cache_entry_t {
+    int32_t flags;
+    uint32_t key;
+    uint32_t value;
+    uint64_t hwcap;
+};
+
+static void ld_cache_init(struct ld_cache_t *c) {
+    memset(c, 0, sizeof(*c));
+    str_map_init(&c->reported, 16);
+}
+
+static void ld_cache_free(struct ld_cache_t *c) {
+    free(c->path);
+    free(c->data);
+    str_map_free(&c->reported);
+}
+
+static void ld_cache_entry(struct ld_cache_t *c, size_t i,
+                           struct ld_cache_entry_t *e) {
+    char const *p = c->data + c->entries + i * c->entry_size;
+    memcpy(&e->flags, p, 4);
+    memcpy(&e->key, p + 4, 4);
+    memcpy(&e->value, p + 8, 4);
+    e->hwcap = 0;
+    if (c->has_hwcap)
+        memcpy(&e->hwcap, p + 16, 8);
+}
+
+// Read the cache at `path` in the old format, the new format, or the old
+// format followed by the new format. Returns 1 when it can't be used.
+static int ld_cache_open(struct ld_cache_t *c, char const *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat finfo;
+    size_t bytes_read;
+    if (fstat(fd, &finfo) != 0 || (uint64_t)finfo.st_size >= SIZE_MAX) {
+        close(fd);
+        return 1;
+    }
+    size_t size = finfo.st_size;
+    c->data = malloc(size + 1);
+    if (c->data == NULL)
+        exit(1);
+    int err = pread_all(fd, c->data, size, 0, &bytes_read);
+    close(fd);
+    if (err || bytes_read != size)
+        goto invalid;
+
+    // Strings can't run past the end.
+    c->data[size] = '\0';
+    c->size = size;
+
+    size_t offset = 0;
+    uint32_t n;
+    if (size >= 16 && memcmp(c->data, LD_CACHE_MAGIC_OLD,
+                             sizeof(LD_CACHE_MAGIC_OLD) - 1) == 0) {
+        memcpy(&n, c->data + 12, 4);
+        if ((size - 16) / 12 < n)
+            goto invalid;
+        c->n = n;
+        c->entries = 16;
+        c->entry_size = 12;
+        c->strings = 16 + 12 * (size_t)n;
+        c->has_hwcap = 0;
+        offset = (c->strings + 7) & ~(size_t)7;
+    }
+
+    if (size >= 48 && offset <= size - 48 &&
+        memcmp(c->data + offset, LD_CACHE_MAGIC_NEW,
+               sizeof(LD_CACHE_MAGIC_NEW) - 1) == 0) {
+        // Byte order: 0 is unknown, 2 is little endian, 3 is big endian.
+        char order = c->data[offset + 28];
+        if ((order == 2 && !host_is_little_endian()) ||
+            (order == 3 && host_is_little_endian()))
+            goto invalid;
+        memcpy(&n, c->data + offset + 20, 4);
+        if ((size - offset - 48) / 24 < n)
+            goto invalid;
+        c->n = n;
+        c->entries = offset + 48;
+        c->entry_size = 24;
+        c->strings = offset;
+        c->has_hwcap = 1;
+    } else if (c->entry_size == 0) {
+        goto invalid;
+    }
+
+    for (size_t i = 0; i < c->n; ++i) {
+        struct ld_cache_entry_t e;
+        ld_cache_entry(c, i, &e);
+        if (c->strings > size || e.key > size - c->strings ||
+            e.value > size - c->strings)
+            goto invalid;
+    }
+
+    c->path = string_copy(path);
+    return 0;
+
+invalid:
+    free(c->data);
+    c->data = NULL;
+    c->n = 0;
+    return 1;
+}
+
+// Compare sonames like glibc does: runs of digits compare as numbers.
+static int ld_cache_libcmp(char const *p1, char const *p2) {
+    while (*p1 != '\0') {
+        if (*p1 >= '0' && *p1 <= '9') {
+            if (*p2 < '0' || *p2 > '9')
+                return 1;
+            uint64_t val1 = 0;
+            uint64_t val2 = 0;
+            while (*p1 >= '0' && *p1 <= '9')
+                val1 = val1 * 10 + *p1++ - '0';
+            while (*p2 >= '0' && *p2 <= '9')
+                val2 = val2 * 10 + *p2++ - '0';
+            if (val1 != val2)
+                return val1 < val2 ? -1 : 1;
+        } else if (*p2 >= '0' && *p2 <= '9') {
+            return -1;
+        } else if (*p1 != *p2) {
+            return *p1 - *p2;
+        } else {
+            ++p1;
+            ++p2;
+        }
+    }
+    return *p1 - *p2;
+}
+
+// Binary search for the range [*begin, *end) of entries of `soname`.
+static void ld_cache_find(struct ld_cache_t *c, char const *soname,
+                          size_t *begin, size_t *end) {
+    struct ld_cache_entry_t e;
+    size_t left = 0;
+    size_t right = c->n;
+    while (left < right) {
+        size_t middle = left + (right - left) / 2;
+        ld_cache_entry(c, middle, &e);
+        int cmp = ld_cache_libcmp(soname, c->data + c->strings + e.key);
+        if (cmp < 0) {
+            left = middle + 1;
+        } else if (cmp > 0) {
+            right = middle;
+        } else {
+            *begin = middle;
+            *end = middle + 1;
+            for (; *begin > left; --*begin) {
+                ld_cache_entry(c, *begin - 1, &e);
+                if (ld_cache_libcmp(soname, c->data + c->strings + e.key))
+                    break;
+            }
+            for (; *end < right; ++*end) {
+                ld_cache_entry(c, *end, &e);
+                if (ld_cache_libcmp(soname, c->data + c->strings + e.key))
+                    break;
+            }
+            return;
+        }
+    }
+    *begin = *end = 0;
+}
+
+// The ELF class implied by the architecture specific flags of an entry.
+static elf_bits_t ld_cache_flag_bits(int32_t flags) {
+    switch ((flags & FLAG_REQUIRED_MASK) >> 8) {
+    case 0x01: // sparc64
+    case 0x02: // ia64
+    case 0x03: // x86-64
+    case 0x04: // s390x
+    case 0x05: // ppc64
+    case 0x07: // mips64 n64
+    case 0x0a: // aarch64
+    case 0x0e: // mips64 n64 nan2008
+    case 0x11: // loongarch soft float
+    case 0x12: // loongarch double float
+        return BITS64;
+    case 0x06: // mips64 n32
+    case 0x08: // x32
+    case 0x09: // arm hard float
+    case 0x0b: // arm soft float
+    case 0x0c: // mips32 nan2008
+    case 0x0d: // mips64 n32 nan2008
+        return BITS32;
+    default:
+        return EITHER;
+    }
+}
+
+// Entries for specific hardware capabilities are skipped, so that we show
+// the libraries that are loaded on any CPU.
+static int ld_cache_entry_matches(struct ld_cache_entry_t *e, elf_bits_t bits) {
+    int type = e->flags & FLAG_TYPE_MASK;
+    if ((type != FLAG_ELF && type != FLAG_ELF_LIBC6) || e->hwcap != 0)
+        return 0;
+    elf_bits_t entry_bits = ld_cache_flag_bits(e->flags);
+    return bits == EITHER || entry_bits == EITHER || entry_bits == bits;
+}
+
+/**
+ * end of ld_cache_t
+ */
+
+/**
+ * node_cache_t
+ */
+
+static uint64_t hash_inode(dev_t dev, ino_t ino) {
+    uint64_t h = (uint64_t)dev * 0x9e3779b97f4a7c15 ^ (uint64_t)ino;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccd;
+    h ^= h >> 33;
+    return h;
+}
+
+static void node_cache_init(struct node_cache_t *c) {
+    c->n = 0;
+    c->capacity = 64;
+    c->nodes = malloc(c->capacity * sizeof(struct elf_node_t *));
+    c->slots_capacity = 128;
+    c->slots = malloc(c->slots_capacity * sizeof(size_t));
+    if (c->nodes == NULL || c->slots == NULL)
+        exit(1);
+    for (size_t i = 0; i < c->slots_capacity; ++i)
+        c->slots[i] = SIZE_MAX;
+    str_map_init(&c->paths, 256);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->parsed, NULL);
+    c->disk = NULL;
+    c->files_opened = 0;
+    c->files_parsed = 0;
+    c->bytes_read = 0;
+}
+
+static void elf_node_free(struct elf_node_t *node) {
+    elf_symbols_free(node->symbols);
+    free(node->versions);
+    free(node->versions_ok);
+    free(node->strings);
+    free(node->needed);
+    free(node);
+}
+
+static void node_cache_free(struct node_cache_t *c) {
+    for (size_t i = 0; i < c->n; ++i)
+        elf_node_free(c->nodes[i]);
+    free(c->nodes);
+    free(c->slots);
+    str_map_free(&c->paths);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->parsed);
+}
+
+// Returns the slot of the node with the given inode, or the empty slot where
+// it should be inserted.
+static size_t *node_cache_slot(struct node_cache_t *c, dev_t dev, ino_t ino) {
+    size_t mask = c->slots_capacity - 1;
+    for (size_t i = hash_inode(dev, ino) & mask;; i = (i + 1) & mask) {
+        size_t *slot = &c->slots[i];
+        if (*slot == SIZE_MAX || (c->nodes[*slot]->st_dev == dev &&
+                                  c->nodes[*slot]->st_ino == ino))
+            return slot;
+    }
+}
+
+static size_t node_cache_insert(struct node_cache_t *c,
+                                struct elf_node_t *node) {
+    // Keep the load factor below 1/2.
+    if (2 * (c->n + 1) > c->slots_capacity) {
+        free(c->slots);
+        c->slots_capacity *= 2;
+        c->slots = malloc(c->slots_capacity * sizeof(size_t));
+        if (c->slots == NULL)
+            exit(1);
+        for (size_t i = 0; i < c->slots_capacity; ++i)
+            c->slots[i] = SIZE_MAX;
+        for (size_t i = 0; i < c->n; ++i)
+            *node_cache_slot(c, c->nodes[i]->st_dev, c->nodes[i]->st_ino) = i;
+    }
+
+    if (c->n == c->capacity) {
+        c->capacity *= 2;
+        c->nodes = realloc(c->nodes, c->capacity * sizeof(struct elf_node_t *));
+        if (c->nodes == NULL)
+            exit(1);
+    }
+
+    // A node of an older version of the file is no longer found by inode, but
+    // it stays put, as it may still be referenced.
+    c->nodes[c->n] = node;
+    node->index = c->n;
+    *node_cache_slot(c, node->st_dev, node->st_ino) = c->n;
+    return c->n++;
+}
+
+// Copy what we need from a parsed ELF file, so the file can be closed.
+static void elf_node_set_stat(struct elf_node_t *node,
+                              struct stat const *finfo) {
+    node->st_dev = finfo->st_dev;
+    node->st_ino = finfo->st_ino;
+    node->st_size = finfo->st_size;
+    node->st_mtim = finfo->st_mtim;
+    node->st_ctim = finfo->st_ctim;
+}
+
+// Whether the file has not changed since the node was created.
+static int elf_node_is_current(struct elf_node_t const *node,
+                               struct stat const *finfo) {
+    return node->st_size == finfo->st_size &&
+           node->st_mtim.tv_sec == finfo->st_mtim.tv_sec &&
+           node->st_mtim.tv_nsec == finfo->st_mtim.tv_nsec &&
+           node->st_ctim.tv_sec == finfo->st_ctim.tv_sec &&
+           node->st_ctim.tv_nsec == finfo->st_ctim.tv_nsec;
+}
+
+static struct elf_node_t *elf_node_create(struct stat *finfo, int error,
+                                          struct elf_info_t *info) {
+    struct elf_node_t *node = calloc(1, sizeof(struct elf_node_t));
+    if (node == NULL)
+        exit(1);
+    elf_node_set_stat(node, finfo);
+    node->error = error;
+    if (error != 0)
+        return node;
+
+    node->bits = info->bits;
+    node->has_dynamic = info->has_dynamic;
+    node->no_def_lib = info->no_def_lib;
+    node->cost = info->cost;
+
+    char const *strings[3] = {info->soname, info->rpath, info->runpath};
+    size_t size = 0;
+    for (size_t i = 0; i < 3; ++i)
+        if (strings[i] != NULL)
+            size += strlen(strings[i]) + 1;
+    for (size_t i = 0; i < info->needed.n; ++i)
+        size += strlen(info->strtab + info->needed.p[i]) + 1;
+    for (size_t i = 0; i < info->versions_n; ++i)
+        size += strlen(info->strtab + info->versions[i].name) + 1;
+
+    node->strings_size = size;
+    node->strings = malloc(size == 0 ? 1 : size);
+    node->needed = malloc((info->needed.n == 0 ? 1 : info->needed.n) *
+                          sizeof(uint64_t));
+    if (node->strings == NULL || node->needed == NULL)
+        exit(1);
+
+    char *p = node->strings;
+    char const **dest[3] = {&node->soname, &node->rpath, &node->runpath};
+    for (size_t i = 0; i < 3; ++i) {
+        if (strings[i] == NULL)
+            continue;
+        size_t len = strlen(strings[i]) + 1;
+        memcpy(p, strings[i], len);
+        *dest[i] = p;
+        p += len;
+    }
+    for (size_t i = 0; i < info->needed.n; ++i) {
+        char const *name = info->strtab + info->needed.p[i];
+        size_t len = strlen(name) + 1;
+        memcpy(p, name, len);
+        node->needed[i] = p - node->strings;
+        p += len;
+    }
+    node->needed_n = info->needed.n;
+
+    node->versions =
+        malloc((info->versions_n == 0 ? 1 : info->versions_n) *
+               sizeof(struct elf_version_t));
+    if (node->versions == NULL)
+        exit(1);
+    for (size_t i = 0; i < info->versions_n; ++i) {
+        struct elf_version_t const *v = &info->versions[i];
+        struct elf_version_t *copy = &node->versions[node->versions_n];
+        copy->hash = v->hash;
+
+        // Requirements refer to the needed library by the offset of its name,
+        // so that they can be matched without comparing strings. Those from
+        // libraries that aren't needed can't be checked and are dropped.
+        copy->file = UINT32_MAX;
+        for (size_t j = 0; j < info->needed.n && v->file != UINT32_MAX; ++j)
+            if (strcmp(info->strtab + v->file,
+                       info->strtab + info->needed.p[j]) == 0)
+                copy->file = node->needed[j];
+        if (v->file != UINT32_MAX && copy->file == UINT32_MAX)
+            continue;
+        ++node->versions_n;
+        char const *name = info->strtab + v->name;
+        size_t len = strlen(name) + 1;
+        memcpy(p, name, len);
+        copy->name = p - node->strings;
+        p += len;
+    }
+    node->verdef_n = info->verdef_n;
+    return node;
+}
+
+/**
+ * disk_cache_t
+ */
+
+#define DISK_CACHE_MAGIC "LIBTREE"
+#define DISK_CACHE_VERSION 4
+
+static char *disk_cache_default_path(void) {
+    char const *dir = getenv("XDG_CACHE_HOME");
+    char const *suffix = "/libtree/nodes";
+    if (dir == NULL || *dir == '\0') {
+        dir = getenv("HOME");
+        suffix = "/.cache/libtree/nodes";
+        if (dir == NULL)
+            return NULL;
+    }
+    struct string_table_t path = {NULL, 0, 0};
+    string_table_store(&path, dir);
+    --path.n;
+    string_table_store(&path, suffix);
+    return path.arr;
+}
+
+// Offsets >= map_size refer to records appended during this run.
+static void const *disk_cache_record_ptr(struct disk_cache_t *d,
+                                         size_t offset) {
+    if (offset < d->map_size)
+        return d->map + offset;
+    return d->appended.arr + (offset - d->map_size);
+}
+
+static size_t *disk_cache_slot(struct disk_cache_t *d, uint64_t dev,
+                               uint64_t ino) {
+    size_t mask = d->slots_capacity - 1;
+    for (size_t i = hash_inode(dev, ino) & mask;; i = (i + 1) & mask) {
+        if (d->slots[i] == SIZE_MAX)
+            return &d->slots[i];
+        struct disk_record_t rec;
+        memcpy(&rec, disk_cache_record_ptr(d, d->slots[i]), sizeof(rec));
+        if (rec.st_dev == dev && rec.st_ino == ino)
+            return &d->slots[i];
+    }
+}
+
+static void disk_cache_index(struct disk_cache_t *d, size_t offset) {
+    // Keep the load factor below 1/2.
+    if (2 * (d->n_records - d->n_superseded + 1) > d->slots_capacity) {
+        size_t *old = d->slots;
+        size_t old_capacity = d->slots_capacity;
+        d->slots_capacity *= 2;
+        d->slots = malloc(d->slots_capacity * sizeof(size_t));
+        if (d->slots == NULL)
+            exit(1);
+        for (size_t i = 0; i < d->slots_capacity; ++i)
+            d->slots[i] = SIZE_MAX;
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old[i] == SIZE_MAX)
+                continue;
+            struct disk_record_t rec;
+            memcpy(&rec, disk_cache_record_ptr(d, old[i]), sizeof(rec));
+            *disk_cache_slot(d, rec.st_dev, rec.st_ino) = old[i];
+        }
+        free(old);
+    }
+
+    struct disk_record_t rec;
+    memcpy(&rec, disk_cache_record_ptr(d, offset), sizeof(rec));
+    size_t *slot = disk_cache_slot(d, rec.st_dev, rec.st_ino);
+    if (*slot != SIZE_MAX)
+        ++d->n_superseded;
+    *slot = offset;
+    ++d->n_records;
+}
+
+// FNV-1a over the record of `size` bytes at `p`, after its checksum.
+static uint32_t disk_record_checksum(unsigned char const *p, size_t size) {
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 8; i < size; ++i)
+        hash = (hash ^ p[i]) * 0x01000193;
+    return hash;
+}
+
+// Check that the record at `offset` lies within the file and that its
+// strings are properly terminated.
+static int disk_record_is_valid(unsigned char const *map, size_t size,
+                                size_t offset) {
+    struct disk_record_t rec;
+    if (size - offset < sizeof(rec))
+        return 0;
+    memcpy(&rec, map + offset, sizeof(rec));
+    if (rec.size % 8 != 0 || rec.size > size - offset ||
+        rec.needed_n > rec.size / 4 || rec.versions_n > rec.size / 12 ||
+        rec.verdef_n > rec.versions_n ||
+        (uint64_t)sizeof(rec) + 4 * (uint64_t)rec.needed_n +
+                12 * (uint64_t)rec.versions_n + rec.strings_size >
+            rec.size)
+        return 0;
+    if (rec.error != 0)
+        return 1;
+
+    unsigned char const *versions = map + offset + sizeof(rec) + 4 * rec.needed_n;
+    char const *strings = (char const *)versions + 12 * rec.versions_n;
+    if (rec.strings_size > 0 && strings[rec.strings_size - 1] != '\0')
+        return 0;
+    uint32_t offsets[3] = {rec.soname, rec.rpath, rec.runpath};
+    for (size_t i = 0; i < 3; ++i)
+        if (offsets[i] != UINT32_MAX && offsets[i] >= rec.strings_size)
+            return 0;
+    for (uint32_t i = 0; i < rec.needed_n; ++i) {
+        uint32_t off;
+        memcpy(&off, map + offset + sizeof(rec) + 4 * i, 4);
+        if (off >= rec.strings_size)
+            return 0;
+    }
+    for (uint32_t i = 0; i < rec.versions_n; ++i) {
+        struct elf_version_t v;
+        memcpy(&v, versions + 12 * i, 12);
+        if (v.name >= rec.strings_size ||
+            (i < rec.verdef_n) != (v.file == UINT32_MAX) ||
+            (v.file != UINT32_MAX && v.file >= rec.strings_size))
+            return 0;
+    }
+    return 1;
+}
+
+static struct disk_cache_t *disk_cache_open(char const *path) {
+    struct disk_cache_t *d = calloc(1, sizeof(struct disk_cache_t));
+    if (d == NULL)
+        exit(1);
+    d->path = string_copy(path);
+    d->slots_capacity = 1024;
+    d->slots = malloc(d->slots_capacity * sizeof(size_t));
+    if (d->slots == NULL)
+        exit(1);
+    for (size_t i = 0; i < d->slots_capacity; ++i)
+        d->slots[i] = SIZE_MAX;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return d;
+
+    struct stat finfo;
+    struct disk_header_t header;
+    if (fstat(fd, &finfo) != 0 || (uint64_t)finfo.st_size > SIZE_MAX ||
+        (size_t)finfo.st_size < sizeof(header)) {
+        close(fd);
+        d->rewrite = 1;
+        return d;
+    }
+
+    void *map = mmap(NULL, finfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        d->rewrite = 1;
+        return d;
+    }
+    d->map = map;
+    d->map_size = finfo.st_size;
+
+    memcpy(&header, d->map, sizeof(header));
+    if (memcmp(header.magic, DISK_CACHE_MAGIC, sizeof(DISK_CACHE_MAGIC)) !=
+            0 ||
+        header.version != DISK_CACHE_VERSION ||
+        header.record_size != sizeof(struct disk_record_t)) {
+        d->rewrite = 1;
+        return d;
+    }
+
+    // A truncated or malformed tail is dropped on the next write, and so are
+    // records that fail their checksum.
+    for (size_t offset = sizeof(header); offset < d->map_size;) {
+        if (!disk_record_is_valid(d->map, d->map_size, offset)) {
+            d->rewrite = 1;
+            break;
+        }
+        struct disk_record_t rec;
+        memcpy(&rec, d->map + offset, sizeof(rec));
+        if (disk_record_checksum(d->map + offset, rec.size) == rec.checksum)
+            disk_cache_index(d, offset);
+        else
+            d->rewrite = 1;
+        offset += rec.size;
+    }
+
+    return d;
+}
+
+static int disk_record_matches(struct disk_record_t *rec, struct stat *finfo) {
+    return rec->st_dev == (uint64_t)finfo->st_dev &&
+           rec->st_ino == (uint64_t)finfo->st_ino &&
+           rec->st_size == (uint64_t)finfo->st_size &&
+           rec->mtime_sec == finfo->st_mtim.tv_sec &&
+           rec->mtime_nsec == finfo->st_mtim.tv_nsec &&
+           rec->ctime_sec == finfo->st_ctim.tv_sec &&
+           rec->ctime_nsec == finfo->st_ctim.tv_nsec;
+}
+
+// Returns the node of a file that is unchanged since it was cached, or NULL.
+static struct elf_node_t *disk_cache_lookup(struct disk_cache_t *d,
+                                            struct stat *finfo) {
+    size_t offset = *disk_cache_slot(d, finfo->st_dev, finfo->st_ino);
+    if (offset == SIZE_MAX)
+        return NULL;
+
+    unsigned char const *p = disk_cache_record_ptr(d, offset);
+    struct disk_record_t rec;
+    memcpy(&rec, p, sizeof(rec));
+    if (!disk_record_matches(&rec, finfo))
+        return NULL;
+
+    struct elf_node_t *node = calloc(1, sizeof(struct elf_node_t));
+    if (node == NULL)
+        exit(1);
+    elf_node_set_stat(node, finfo);
+    node->error = rec.error;
+    if (rec.error != 0)
+        return node;
+
+    node->bits = rec.bits;
+    node->has_dynamic = rec.has_dynamic;
+    node->no_def_lib = rec.no_def_lib;
+    node->cost.relocs = rec.relocs;
+    node->cost.relative = rec.relative;
+    node->cost.plt_relocs = rec.plt_relocs;
+    node->cost.plt_size = rec.plt_size;
+    node->cost.flags = rec.cost_flags;
+    node->needed_n = rec.needed_n;
+    node->verdef_n = rec.verdef_n;
+    node->versions_n = rec.versions_n;
+    node->strings_size = rec.strings_size;
+    node->strings = malloc(rec.strings_size == 0 ? 1 : rec.strings_size);
+    node->needed =
+        malloc((rec.needed_n == 0 ? 1 : rec.needed_n) * sizeof(uint64_t));
+    node->versions = malloc((rec.versions_n == 0 ? 1 : rec.versions_n) *
+                            sizeof(struct elf_version_t));
+    if (node->strings == NULL || node->needed == NULL ||
+        node->versions == NULL)
+        exit(1);
+
+    p += sizeof(rec);
+    for (uint32_t i = 0; i < rec.needed_n; ++i, p += 4) {
+        uint32_t off;
+        memcpy(&off, p, 4);
+        node->needed[i] = off;
+    }
+    for (uint32_t i = 0; i < rec.versions_n; ++i, p += 12)
+        memcpy(&node->versions[i], p, 12);
+    memcpy(node->strings, p, rec.strings_size);
+
+    node->soname = rec.soname == UINT32_MAX ? NULL : node->strings + rec.soname;
+    node->rpath = rec.rpath == UINT32_MAX ? NULL : node->strings + rec.rpath;
+    node->runpath =
+        rec.runpath == UINT32_MAX ? NULL : node->strings + rec.runpath;
+    return node;
+}
+
+static uint32_t disk_string_offset(struct elf_node_t *node, char const *str) {
+    return str == NULL ? UINT32_MAX : (uint32_t)(str - node->strings);
+}
+
+static void disk_cache_append(struct disk_cache_t *d, struct elf_node_t *node,
+                              struct stat *finfo) {
+    struct disk_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    uint64_t size = sizeof(rec);
+    if (node->error == 0)
+        size += 4 * (uint64_t)node->needed_n + 12 * (uint64_t)node->versions_n +
+                node->strings_size;
+    size = (size + 7) & ~(uint64_t)7;
+    if (size > UINT32_MAX || node->strings_size > UINT32_MAX)
+        return;
+
+    rec.size = size;
+    rec.error = node->error;
+    rec.st_dev = finfo->st_dev;
+    rec.st_ino = finfo->st_ino;
+    rec.st_size = finfo->st_size;
+    rec.mtime_sec = finfo->st_mtim.tv_sec;
+    rec.mtime_nsec = finfo->st_mtim.tv_nsec;
+    rec.ctime_sec = finfo->st_ctim.tv_sec;
+    rec.ctime_nsec = finfo->st_ctim.tv_nsec;
+    rec.soname = rec.rpath = rec.runpath = UINT32_MAX;
+    if (node->error == 0) {
+        rec.bits = node->bits;
+        rec.has_dynamic = node->has_dynamic;
+        rec.no_def_lib = node->no_def_lib;
+        rec.relocs = node->cost.relocs;
+        rec.relative = node->cost.relative;
+        rec.plt_relocs = node->cost.plt_relocs;
+        rec.plt_size = node->cost.plt_size;
+        rec.cost_flags = node->cost.flags;
+        rec.soname = disk_string_offset(node, node->soname);
+        rec.rpath = disk_string_offset(node, node->rpath);
+        rec.runpath = disk_string_offset(node, node->runpath);
+        rec.needed_n = node->needed_n;
+        rec.verdef_n = node->verdef_n;
+        rec.versions_n = node->versions_n;
+        rec.strings_size = node->strings_size;
+    }
+
+    struct string_table_t *t = &d->appended;
+    string_table_maybe_grow(t, size);
+    unsigned char *p = (unsigned char *)t->arr + t->n;
+    memset(p, 0, size);
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    for (uint32_t i = 0; i < rec.needed_n; ++i, p += 4) {
+        uint32_t off = node->needed[i];
+        memcpy(p, &off, 4);
+    }
+    for (uint32_t i = 0; i < rec.versions_n; ++i, p += 12)
+        memcpy(p, &node->versions[i], 12);
+    if (rec.strings_size > 0)
+        memcpy(p, node->strings, rec.strings_size);
+    rec.checksum = disk_record_checksum((unsigned char *)t->arr + t->n, size);
+    memcpy(t->arr + t->n, &rec, sizeof(rec));
+
+    size_t offset = d->map_size + t->n;
+    t->n += size;
+    disk_cache_index(d, offset);
+}
+
+static int write_all(int fd, void const *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0)
+            return 1;
+        buf = (char const *)buf + n;
+        size -= n;
+    }
+    return 0;
+}
+
+// Create the parent directories of `path`.
+static void make_parent_dirs(char const *path) {
+    char *dir = string_copy(path);
+    for (char *p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+    free(dir);
+}
+
+static void disk_cache_write_header(int fd) {
+    struct disk_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DISK_CACHE_MAGIC, sizeof(DISK_CACHE_MAGIC));
+    header.version = DISK_CACHE_VERSION;
+    header.record_size = sizeof(struct disk_record_t);
+    write_all(fd, &header, sizeof(header));
+}
+
+// Write the latest record of every inode to a new file, and move it in place.
+static int disk_cache_rewrite(struct disk_cache_t *d) {
+    struct string_table_t tmp = {NULL, 0, 0};
+    string_table_store(&tmp, d->path);
+    --tmp.n;
+    string_table_store(&tmp, ".tmp");
+    char pid[24];
+    utoa(pid, getpid());
+    --tmp.n;
+    string_table_store(&tmp, pid);
+
+    int fd = open(tmp.arr, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp.arr);
+        return 1;
+    }
+
+    disk_cache_write_header(fd);
+    int err = 0;
+    for (size_t i = 0; i < d->slots_capacity && !err; ++i) {
+        if (d->slots[i] == SIZE_MAX)
+            continue;
+        void const *p = disk_cache_record_ptr(d, d->slots[i]);
+        struct disk_record_t rec;
+        memcpy(&rec, p, sizeof(rec));
+        err = write_all(fd, p, rec.size);
+    }
+    err |= close(fd) != 0;
+    if (err || rename(tmp.arr, d->path) != 0) {
+        unlink(tmp.arr);
+        err = 1;
+    }
+    free(tmp.arr);
+    return err;
+}
+
+// Append the records of this run to the cache file, holding a lock so that
+// concurrent runs don't interleave their records.
+static int disk_cache_append_to_file(struct disk_cache_t *d) {
+    int fd = open(d->path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0)
+        return 1;
+
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    int err = fcntl(fd, F_SETLKW, &lock) != 0;
+
+    struct stat finfo;
+    if (!err && fstat(fd, &finfo) == 0 && finfo.st_size == 0)
+        disk_cache_write_header(fd);
+    if (!err)
+        err = write_all(fd, d->appended.arr, d->appended.n);
+
+    close(fd);
+    return err;
+}
+
+static void disk_cache_report(struct disk_cache_t *d) {
+    char num[24];
+    fputs("Cache: ", stderr);
+    utoa(num, d->hits);
+    fputs(num, stderr);
+    fputs(" hits, ", stderr);
+    utoa(num, d->misses);
+    fputs(num, stderr);
+    fputs(" misses\n", stderr);
+}
+
+static void disk_cache_close(struct disk_cache_t *d) {
+    if (d->appended.n > 0 || d->rewrite) {
+        make_parent_dirs(d->path);
+        // Compact when most records are stale.
+        if (d->rewrite || 2 * d->n_superseded > d->n_records)
+            disk_cache_rewrite(d);
+        else
+            disk_cache_append_to_file(d);
+    }
+
+    if (d->map != NULL)
+        munmap(d->map, d->map_size);
+    free(d->appended.arr);
+    free(d->slots);
+    free(d->path);
+    free(d);
+}
+
+/**
+ * end of disk_cache_t
+ */
+
+// Returns the node of the file at `path`, parsing it if we haven't seen its
+// inode before. Returns NULL and sets `code` when the file can't be opened.
+static struct elf_node_t *node_cache_get(struct node_cache_t *c,
+                                         char const *path, int *code) {
+    pthread_mutex_lock(&c->lock);
+    size_t *known;
+    while ((known = str_map_get(&c->paths, path)) != NULL &&
+           *known == CACHE_PENDING)
+        pthread_cond_wait(&c->parsed, &c->lock);
+
+    if (known != NULL) {
+        struct elf_node_t *node = *known == SIZE_MAX ? NULL : c->nodes[*known];
+        pthread_mutex_unlock(&c->lock);
+        if (node == NULL)
+            *code = 1;
+        return node;
+    }
+
+    str_map_put(&c->paths, path, CACHE_PENDING);
+    pthread_mutex_unlock(&c->lock);
+
+    // A single stat tells us whether we've seen the file before, in this run
+    // or in a previous one.
+    size_t i = SIZE_MAX;
+    struct stat finfo;
+    struct elf_node_t *parsed = NULL;
+    struct stat parsed_st = {0};
+    if (stat(path, &finfo) == 0) {
+        pthread_mutex_lock(&c->lock);
+        i = *node_cache_slot(c, finfo.st_dev, finfo.st_ino);
+        if (i != SIZE_MAX && !elf_node_is_current(c->nodes[i], &finfo))
+            i = SIZE_MAX;
+        if (i == SIZE_MAX && c->disk != NULL &&
+            (parsed = disk_cache_lookup(c->disk, &finfo)) != NULL) {
+            ++c->disk->hits;
+            parsed_st = finfo;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    // Otherwise open and parse it without holding the lock.
+    int from_file = 0;
+    int opened = 0;
+    uint64_t bytes_read = 0;
+    if (i == SIZE_MAX && parsed == NULL) {
+        struct elf_file_t file;
+        *code = elf_file_open(&file, path);
+        if (*code == 0) {
+            struct elf_info_t info;
+            int error = elf_parse(&file, &info);
+            parsed = elf_node_create(&file.st, error, &info);
+            parsed_st = file.st;
+            from_file = S_ISREG(file.st.st_mode);
+            opened = 1;
+            bytes_read = file.bytes_read;
+            elf_info_free(&info);
+            elf_file_close(&file);
+        }
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->files_opened += opened;
+    c->bytes_read += bytes_read;
+    if (parsed != NULL) {
+        // Another thread may have parsed it under a different name meanwhile.
+        i = *node_cache_slot(c, parsed->st_dev, parsed->st_ino);
+        if (i != SIZE_MAX && !elf_node_is_current(c->nodes[i], &parsed_st))
+            i = SIZE_MAX;
+        if (i == SIZE_MAX && from_file && c->disk != NULL) {
+            ++c->disk->misses;
+            disk_cache_append(c->disk, parsed, &parsed_st);
+        }
+        if (i == SIZE_MAX && opened)
+            ++c->files_parsed;
+        if (i == SIZE_MAX)
+            i = node_cache_insert(c, parsed);
+        else
+            elf_node_free(parsed);
+    }
+    str_map_put(&c->paths, path, i);
+    struct elf_node_t *node = i == SIZE_MAX ? NULL : c->nodes[i];
+    pthread_cond_broadcast(&c->parsed);
+    pthread_mutex_unlock(&c->lock);
+    return node;
+}
+
+// Forget which files paths refer to, so that they are looked up again. Drop
+// the nodes of files that changed, and of files that weren't visited since
+// generation `oldest`. Indices of nodes change, so nothing may refer to them.
+static void node_cache_reset(struct node_cache_t *c, size_t oldest) {
+    str_map_free(&c->paths);
+    str_map_init(&c->paths, 256);
+
+    // Decide which nodes stay before moving any, as slots refer to indices.
+    char *keep = malloc(c->n + 1);
+    if (keep == NULL)
+        exit(1);
+    for (size_t i = 0; i < c->n; ++i) {
+        struct elf_node_t *node = c->nodes[i];
+        keep[i] = *node_cache_slot(c, node->st_dev, node->st_ino) == i &&
+                  node->visited >= oldest;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < c->n; ++i) {
+        struct elf_node_t *node = c->nodes[i];
+        if (!keep[i]) {
+            elf_node_free(node);
+            continue;
+        }
+        // These refer to nodes by index.
+        free(node->versions_ok);
+        node->versions_ok = NULL;
+        node->index = n;
+        c->nodes[n++] = node;
+    }
+    c->n = n;
+    free(keep);
+
+    for (size_t i = 0; i < c->slots_capacity; ++i)
+        c->slots[i] = SIZE_MAX;
+    for (size_t i = 0; i < c->n; ++i)
+        *node_cache_slot(c, c->nodes[i]->st_dev, c->nodes[i]->st_ino) = i;
+}
+
+/**
+ * end of node_cache_t
+ */
+
+/**
+ * exclude_t
+ */
+
+static void exclude_bit_set(struct exclude_item_t *item, unsigned char c) {
+    item->bytes[c / 32] |= (uint32_t)1 << (c % 32);
+}
+
+static int exclude_bit(struct exclude_item_t const *item, unsigned char c) {
+    return (item->bytes[c / 32] >> (c % 32)) & 1;
+}
+
+static struct exclude_item_t *exclude_push(struct exclude_t *e) {
+    if (e->items_n == e->items_capacity) {
+        e->items_capacity = e->items_capacity == 0 ? 64 : 2 * e->items_capacity;
+        e->items = realloc(e->items,
+                           e->items_capacity * sizeof(struct exclude_item_t));
+        if (e->items == NULL)
+            exit(1);
+    }
+    struct exclude_item_t *item = &e->items[e->items_n++];
+    memset(item, 0, sizeof(*item));
+    return item;
+}
+
+// Add a rule that hides libraries whose soname matches the glob `pattern`, or
+// shows them when it starts with `!`. Globs support `*`, `?`, `[...]` with
+// ranges and `!` or `^` negation, and `\` escapes.
+static void exclude_add_defaults(struct exclude_t *e);
+
+// The `]` that closes the class starting at `p`, or NULL when there is none and
+// the `[` is literal. A leading `]` is part of the class.
+static unsigned char const *exclude_class_end(unsigned char const *p) {
+    ++p;
+    if (*p == '!' || *p == '^')
+        ++p;
+    if (*p == ']')
+        ++p;
+    return (unsigned char const *)strchr((char const *)p, ']');
+}
+
+static void exclude_add(struct exclude_t *e, char const *pattern) {
+    exclude_add_defaults(e);
+    int exclude = *pattern != '!';
+    if (!exclude)
+        ++pattern;
+    e->compiled = 0;
+
+    for (unsigned char const *p = (unsigned char const *)pattern; *p != '\0';
+         ++p) {
+        struct exclude_item_t *item = exclude_push(e);
+        unsigned char const *close;
+        if (*p == '*') {
+            memset(item->bytes, 0xff, sizeof(item->bytes));
+            item->star = 1;
+        } else if (*p == '?') {
+            memset(item->bytes, 0xff, sizeof(item->bytes));
+        } else if (*p == '[' && (close = exclude_class_end(p)) != NULL) {
+            int negate = p[1] == '!' || p[1] == '^';
+            for (unsigned char const *c = p + 1 + negate; c < close; ++c) {
+                unsigned char lo = *c, hi = *c;
+                if (c[1] == '-' && c + 2 < close) {
+                    hi = c[2];
+                    c += 2;
+                }
+                for (unsigned b = lo; b <= hi; ++b)
+                    exclude_bit_set(item, b);
+            }
+            if (negate)
+                for (size_t j = 0; j < 8; ++j)
+                    item->bytes[j] = ~item->bytes[j];
+            p = close;
+        } else {
+            if (*p == '\\' && p[1] != '\0')
+                ++p;
+            exclude_bit_set(item, *p);
+        }
+    }
+    struct exclude_item_t *end = exclude_push(e);
+    end->end = 1;
+    end->exclude = exclude;
+}
+
+// Add the rules in `path`, one per line. Empty lines and lines starting with
+// `#` are skipped. Returns 1 when the file can't be read.
+static int exclude_add_file(struct exclude_t *e, char const *path) {
+    FILE *fptr = fopen(path, "r");
+    if (fptr == NULL)
+        return 1;
+    char line[4096];
+    while (fgets(line, sizeof(line), fptr) != NULL) {
+        size_t len = strcspn(line, "\r\n");
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+            --len;
+        line[len] = '\0';
+        char const *rule = line + strspn(line, " \t");
+        if (*rule != '\0' && *rule != '#')
+            exclude_add(e, rule);
+    }
+    int err = ferror(fptr);
+    fclose(fptr);
+    return err != 0;
+}
+
+static void exclude_add_defaults(struct exclude_t *e) {
+    if (e->has_defaults)
+        return;
+    e->has_defaults = 1;
+    for (size_t j = 0; j < sizeof(exclude_list) / sizeof(char *); ++j) {
+        char pattern[64];
+        memcpy(pattern, exclude_list[j], strlen(exclude_list[j]));
+        memcpy(pattern + strlen(exclude_list[j]), "*", 2);
+        exclude_add(e, pattern);
+    }
+}
+
+static void exclude_free(struct exclude_t *e) {
+    free(e->items);
+    free(e->transitions);
+    free(e->hidden);
+}
+
+// Add `pos` and the positions it reaches without consuming a byte to the set
+// `marks`.
+static void exclude_closure(struct exclude_t *e, unsigned char *marks,
+                            size_t pos) {
+    for (; !marks[pos]; ++pos) {
+        marks[pos] = 1;
+        if (!e->items[pos].star)
+            break;
+    }
+}
+
+// Build the DFA by subset construction. States are sets of positions, which
+// are only ever at most as many as the positions that the rules have. Without
+// rules of the user there is nothing to build, the defaults are plain
+// prefixes.
+static void exclude_compile(struct exclude_t *e) {
+    if (e->compiled || e->items_n == 0)
+        return;
+    free(e->transitions);
+    free(e->hidden);
+    size_t n = e->items_n;
+
+    // Refine the classes of bytes by every position.
+    memset(e->classes, 0, sizeof(e->classes));
+    e->classes_n = 1;
+    for (size_t i = 0; i < n; ++i) {
+        uint16_t split[256][2];
+        memset(split, 0xff, sizeof(split));
+        size_t classes_n = 0;
+        for (unsigned b = 0; b < 256; ++b) {
+            uint16_t *c = &split[e->classes[b]][exclude_bit(&e->items[i], b)];
+            if (*c == 0xffff)
+                *c = classes_n++;
+            e->classes[b] = *c;
+        }
+        e->classes_n = classes_n;
+    }
+    unsigned char representative[256];
+    for (unsigned b = 256; b-- > 0;)
+        representative[e->classes[b]] = b;
+
+    // States are stored as byte masks over the positions, keyed by the mask.
+    struct str_map_t ids;
+    str_map_init(&ids, 64);
+    struct string_table_t sets = {NULL, 0, 0};
+    size_t capacity = 16;
+    e->transitions = malloc(capacity * e->classes_n * sizeof(uint32_t));
+    e->hidden = malloc(capacity);
+    unsigned char *marks = malloc(n + 2);
+    char *key = malloc(n + 2);
+    if (e->transitions == NULL || e->hidden == NULL || marks == NULL ||
+        key == NULL)
+        exit(1);
+
+    // The start state is at the beginning of every rule.
+    memset(marks, 0, n + 1);
+    for (size_t i = 0; i < n; ++i)
+        if (i == 0 || e->items[i - 1].end)
+            exclude_closure(e, marks, i);
+    e->states_n = 0;
+    e->dead = SIZE_MAX;
+
+    for (size_t state = 0;; ++state) {
+        // Add the set in `marks` as a new state when it is not known.
+        for (size_t i = 0; i < n; ++i)
+            key[i] = marks[i] ? 'x' : '.';
+        key[n] = '\0';
+        size_t *known = str_map_get(&ids, key);
+        size_t next = known == NULL ? e->states_n : *known;
+        if (known == NULL) {
+            if (e->states_n == capacity) {
+                capacity *= 2;
+                e->transitions = realloc(e->transitions, capacity *
+                                                             e->classes_n *
+                                                             sizeof(uint32_t));
+                e->hidden = realloc(e->hidden, capacity);
+                if (e->transitions == NULL || e->hidden == NULL)
+                    exit(1);
+            }
+            str_map_put(&ids, key, next);
+            string_table_store(&sets, key);
+            // The last rule that matches decides.
+            e->hidden[next] = 0;
+            for (size_t i = n; i-- > 0;) {
+                if (marks[i] && e->items[i].end) {
+                    e->hidden[next] = e->items[i].exclude;
+                    break;
+                }
+            }
+            if (strchr(key, 'x') == NULL)
+                e->dead = next;
+            ++e->states_n;
+        }
+        // The transition that led here.
+        if (state > 0) {
+            size_t from = (state - 1) / e->classes_n;
+            size_t c = (state - 1) % e->classes_n;
+            e->transitions[from * e->classes_n + c] = next;
+        }
+
+        // Compute the next transition, in order of state and class.
+        size_t from = state / e->classes_n;
+        size_t c = state % e->classes_n;
+        if (from == e->states_n)
+            break;
+        char const *set = sets.arr + from * (n + 1);
+        memset(marks, 0, n + 1);
+        for (size_t i = 0; i < n; ++i) {
+            struct exclude_item_t *item = &e->items[i];
+            if (set[i] != 'x' || item->end ||
+                !exclude_bit(item, representative[c]))
+                continue;
+            exclude_closure(e, marks, item->star ? i : i + 1);
+        }
+    }
+
+    str_map_free(&ids);
+    free(sets.arr);
+    free(marks);
+    free(key);
+    e->compiled = 1;
+}
+
+// Whether the library `soname` is hidden unless verbose.
+static int exclude_match(struct exclude_t const *e, char const *soname) {
+    if (e->items_n == 0) {
+        for (size_t j = 0; j < sizeof(exclude_list) / sizeof(char *); ++j)
+            if (strncmp(soname, exclude_list[j], strlen(exclude_list[j])) == 0)
+                return 1;
+        return 0;
+    }
+    size_t state = 0;
+    for (unsigned char const *p = (unsigned char const *)soname;
+         *p != '\0' && state != e->dead; ++p)
+        state = e->transitions[state * e->classes_n + e->classes[*p]];
+    return e->hidden[state];
+}
+
+/**
+ * end of exclude_t
+ */
+
+/**
+ * output_t
+ */
+
+static void out_init(struct output_t *o, int fd) {
+    o->fd = fd;
+    o->n = 0;
+    o->capacity = 65536;
+    o->buf = malloc(o->capacity);
+    if (o->buf == NULL)
+        exit(1);
+}
+
+static void out_flush(struct libtree_state_t *s) {
+    write_all(s->out.fd, s->out.buf, s->out.n);
+    s->out.n = 0;
+}
+
+static void out_write(struct libtree_state_t *s, char const *str, size_t n) {
+    struct output_t *o = &s->out;
+    if (o->n + n > o->capacity) {
+        out_flush(s);
+        // Don't bother copying large strings.
+        if (n > o->capacity) {
+            write_all(o->fd, str, n);
+            return;
+        }
+    }
+    memcpy(o->buf + o->n, str, n);
+    o->n += n;
+}
+
+static void out_puts(struct libtree_state_t *s, char const *str) {
+    out_write(s, str, strlen(str));
+}
+
+static void out_putc(struct libtree_state_t *s, char c) {
+    if (s->out.n == s->out.capacity)
+        out_flush(s);
+    s->out.buf[s->out.n++] = c;
+}
+
+// Write `str` as a JSON string, or null.
+static void out_json_string(struct libtree_state_t *s, char const *str) {
+    if (str == NULL) {
+        out_puts(s, "null");
+        return;
+    }
+
+    out_putc(s, '"');
+    for (char const *p = str; *p != '\0'; ++p) {
+        unsigned char c = *p;
+        if (c == '"' || c == '\\') {
+            out_putc(s, '\\');
+            out_putc(s, c);
+        } else if (c < 0x20) {
+            char const *hex = "0123456789abcdef";
+            out_puts(s, "\\u00");
+            out_putc(s, hex[c >> 4]);
+            out_putc(s, hex[c & 15]);
+        } else {
+            out_putc(s, c);
+        }
+    }
+    out_putc(s, '"');
+}
+
+static void out_free(struct output_t *o) { free(o->buf); }
+
+/**
+ * end of output_t
+ */
+
+/**
+ * stats_t
+ */
+
+static uint64_t monotonic_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + (uint64_t)t.tv_nsec;
+}
+
+// Returns a monotonic time in nanoseconds, or 0 when stats are disabled, so
+// that timing costs nothing without --stats.
+static uint64_t stats_clock(struct libtree_state_t *s) {
+    return s->stats.enabled ? monotonic_ns() : 0;
+}
+
+static void stats_add_time(struct libtree_state_t *s, uint64_t *ns,
+                           uint64_t start) {
+    if (s->stats.enabled)
+        *ns += stats_clock(s) - start;
+}
+
+static void stats_print_line(char const *label, uint64_t value,
+                             char const *unit) {
+    char num[24];
+    fputs(label, stderr);
+    utoa(num, value);
+    fputs(num, stderr);
+    fputs(unit, stderr);
+}
+
+static void stats_print(struct libtree_state_t *s) {
+    struct stats_t *st = &s->stats;
+    static char const *const categories[] = {
+        [RPATH] = "  rpath:             ",
+        [LD_LIBRARY_PATH] = "  LD_LIBRARY_PATH:   ",
+        [RUNPATH] = "  runpath:           ",
+        [LD_SO_CONF] = "  ld.so.conf:        ",
+        [DEFAULT] = "  default paths:     "};
+
+    fputs("Statistics:\n", stderr);
+    stats_print_line("Files opened:        ", s->node_cache.files_opened,
+                     "\n");
+    stats_print_line("Bytes read:          ", s->node_cache.bytes_read,
+                     "\n");
+    stats_print_line("ELF files parsed:    ", s->node_cache.files_parsed,
+                     "\n");
+    stats_print_line("Already visited:     ", st->visited_skipped, "\n");
+    stats_print_line("Memoized lookups:    ", st->memo_hits, "\n");
+    fputs("Failed probes:\n", stderr);
+    for (how_t how = RPATH; how <= DEFAULT; ++how) {
+        stats_print_line(categories[how], st->failed_probes[how], " of ");
+        stats_print_line("", st->probes[how], "\n");
+    }
+    stats_print_line("Interned strings:    ", s->intern.n, " in ");
+    stats_print_line("", s->intern.arena.bytes, " bytes\n");
+    stats_print_line("Maximum depth:       ", st->max_depth, "\n");
+    stats_print_line("Config parsing:      ", st->config_ns / 1000, " us\n");
+    stats_print_line("Traversal:           ", st->traversal_ns / 1000,
+                     " us\n");
+    stats_print_line("Output:              ", st->output_ns / 1000, " us\n");
+}
+
+/**
+ * end of stats_t
+ */
+
+/**
+ * trace_t
+ */
+
+static void trace_init(struct trace_t *t) {
+    t->events = malloc(TRACE_CAPACITY * sizeof(struct trace_event_t));
+    if (t->events == NULL)
+        exit(1);
+    t->n = 0;
+    t->epoch = monotonic_ns();
+}
+
+static void trace_free(struct trace_t *t) {
+    free(t->events);
+    t->events = NULL;
+}
+
+static void trace_copy_arg(char *dst, char const *src) {
+    if (src == NULL)
+        src = "";
+    size_t len = strlen(src);
+    // Keep the end of long strings, which is the more specific part of a path.
+    if (len >= TRACE_ARG_SIZE)
+        src += len - (TRACE_ARG_SIZE - 1);
+    memcpy(dst, src, strlen(src) + 1);
+}
+
+// Start an event and return its sequence number, which is UINT64_MAX when not
+// tracing. The oldest event is overwritten when the ring is full.
+static uint64_t trace_begin(struct trace_t *t, trace_kind_t kind, size_t depth,
+                            char const *a, char const *b) {
+    if (t->events == NULL)
+        return UINT64_MAX;
+    uint64_t seq = t->n++;
+    struct trace_event_t *e = &t->events[seq % TRACE_CAPACITY];
+    e->seq = seq;
+    e->kind = kind;
+    e->depth = depth;
+    e->code = 0;
+    e->duration = 0;
+    trace_copy_arg(e->arg[0], a);
+    trace_copy_arg(e->arg[1], b);
+    e->start = monotonic_ns();
+    return seq;
+}
+
+static void trace_end(struct trace_t *t, uint64_t seq, int code) {
+    if (seq == UINT64_MAX)
+        return;
+    struct trace_event_t *e = &t->events[seq % TRACE_CAPACITY];
+    // Nested events may have overwritten this one already.
+    if (e->seq != seq)
+        return;
+    e->duration = monotonic_ns() - e->start;
+    e->code = code;
+}
+
+static void trace_put_number(struct libtree_state_t *s, uint64_t v) {
+    char num[24];
+    utoa(num, v);
+    out_puts(s, num);
+}
+
+// Chrome trace timestamps are in microseconds.
+static void trace_put_micros(struct libtree_state_t *s, uint64_t ns) {
+    trace_put_number(s, ns / 1000);
+    char frac[5] = {'.', '0' + ns / 100 % 10, '0' + ns / 10 % 10,
+                    '0' + ns % 10, '\0'};
+    out_puts(s, frac);
+}
+
+static void trace_put_event(struct libtree_state_t *s,
+                            struct trace_event_t const *e, char const *pid) {
+    static char const *const names[] = {[TRACE_RECURSE] = "recurse",
+                                        [TRACE_PROBE] = "probe",
+                                        [TRACE_LD_CACHE] = "ld.so.cache",
+                                        [TRACE_LD_SO_CONF] = "ld.so.conf"};
+    out_puts(s, "{\"name\":\"");
+    out_puts(s, names[e->kind]);
+    out_puts(s, "\",\"cat\":\"libtree\",\"ph\":\"X\",\"pid\":");
+    out_puts(s, pid);
+    out_puts(s, ",\"tid\":1,\"ts\":");
+    trace_put_micros(s, e->start - s->trace.epoch);
+    out_puts(s, ",\"dur\":");
+    trace_put_micros(s, e->duration);
+    out_puts(s, ",\"args\":{");
+    switch (e->kind) {
+    case TRACE_RECURSE:
+        out_puts(s, "\"file\":");
+        out_json_string(s, e->arg[0]);
+        out_puts(s, ",\"depth\":");
+        trace_put_number(s, e->depth);
+        out_puts(s, ",\"result\":");
+        trace_put_number(s, e->code);
+        break;
+    case TRACE_PROBE:
+    case TRACE_LD_CACHE:
+        out_puts(s, "\"dir\":");
+        out_json_string(s, e->arg[0]);
+        out_puts(s, ",\"soname\":");
+        out_json_string(s, e->arg[1]);
+        out_puts(s, e->code == 0 ? ",\"hit\":true" : ",\"hit\":false");
+        break;
+    case TRACE_LD_SO_CONF:
+        out_puts(s, "\"file\":");
+        out_json_string(s, e->arg[0]);
+        out_puts(s, ",\"result\":");
+        trace_put_number(s, e->code);
+        break;
+    }
+    out_puts(s, "}}");
+}
+
+// Write the events in Chrome trace JSON format, which Perfetto and
+// chrome://tracing can open. Must be called after the last out_flush, since
+// the output buffer is reused.
+static int trace_write(struct libtree_state_t *s, char const *file) {
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 1;
+    int stdout_fd = s->out.fd;
+    s->out.fd = fd;
+
+    struct trace_t *t = &s->trace;
+    uint64_t first = t->n > TRACE_CAPACITY ? t->n - TRACE_CAPACITY : 0;
+    char pid[24];
+    utoa(pid, getpid());
+
+    out_puts(s, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":");
+    trace_put_number(s, first);
+    out_puts(s, "},\"traceEvents\":[");
+    for (uint64_t seq = first; seq < t->n; ++seq) {
+        if (seq != first)
+            out_puts(s, ",\n");
+        trace_put_event(s, &t->events[seq % TRACE_CAPACITY], pid);
+    }
+    out_puts(s, "]}\n");
+    out_flush(s);
+
+    s->out.fd = stdout_fd;
+    return close(fd) != 0;
+}
+
+/**
+ * end of trace_t
+ */
+
+static void tree_preamble(struct libtree_state_t *s, size_t depth) {
+    if (depth == 0)
+        return;
+
+    struct frame_t *frames = s->stack.frames;
+    for (size_t i = 0; i < depth - 1; ++i)
+        out_puts(s, frames[i].found_all_needed ? JUST_INDENT
+                                               : LIGHT_VERTICAL_WITH_INDENT);
+
+    out_puts(s, frames[depth - 1].found_all_needed
+              ? LIGHT_UP_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " "
+              : LIGHT_VERTICAL_AND_RIGHT LIGHT_HORIZONTAL LIGHT_HORIZONTAL " ");
+}
+
+static uint64_t *frame_needed(struct libtree_state_t *s, struct frame_t *f) {
+    return s->stack.needed + f->needed_begin;
+}
+
+// The needed library at `i` was located, so swap it to the back, and reduce
+// the number of libraries to be found by one.
+static void frame_found(struct libtree_state_t *s, struct frame_t *f,
+                        size_t i) {
+    uint64_t *needed = frame_needed(s, f);
+    size_t *resolved = s->stack.resolved + f->needed_begin;
+    size_t last = --f->needed_not_found;
+    uint64_t tmp = needed[i];
+    needed[i] = needed[last];
+    needed[last] = tmp;
+    size_t tmp_resolved = resolved[i];
+    resolved[i] = resolved[last];
+    resolved[last] = tmp_resolved;
+}
+
+/**
+ * memo_t
+ */
+
+static void memo_init(struct memo_t *m) {
+    str_map_init(&m->contexts, 64);
+    str_map_init(&m->results, 1024);
+    m->entries = NULL;
+    m->n = 0;
+    m->capacity = 0;
+    m->paths = (struct string_table_t){NULL, 0, 0};
+    m->key = (struct string_table_t){NULL, 0, 0};
+
+    // The empty rpath stack is 0.
+    str_map_put(&m->contexts, "", 0);
+}
+
+static void memo_free(struct memo_t *m) {
+    str_map_free(&m->contexts);
+    str_map_free(&m->results);
+    free(m->entries);
+    free(m->paths.arr);
+    free(m->key.arr);
+}
+
+// Append `str` to the key, followed by a separator.
+static void memo_key_append(struct memo_t *m, char const *str) {
+    string_table_store(&m->key, str);
+    m->key.arr[m->key.n - 1] = '\x01';
+}
+
+static void memo_key_append_number(struct memo_t *m, size_t n) {
+    char num[24];
+    utoa(num, n);
+    memo_key_append(m, num);
+}
+
+// Returns the id of the key, which must be terminated.
+static size_t memo_intern_key(struct memo_t *m) {
+    size_t *id = str_map_get(&m->contexts, m->key.arr);
+    if (id != NULL)
+        return *id;
+    size_t new_id = m->contexts.n;
+    str_map_put(&m->contexts, m->key.arr, new_id);
+    return new_id;
+}
+
+// Returns the id of the rpath stack made of `parent` and the interned rpath at
+// `depth`. Frames without rpath share the stack of their parent, so that
+// most files have the same, empty stack.
+static size_t memo_rpath_chain(struct memo_t *m, size_t parent, size_t depth,
+                               size_t rpath) {
+    m->key.n = 0;
+    memo_key_append_number(m, parent);
+    memo_key_append_number(m, depth);
+    memo_key_append_number(m, rpath);
+    string_table_store(&m->key, "");
+    return memo_intern_key(m);
+}
+
+// Returns the id of the search context of the frame at `depth`.
+// LD_LIBRARY_PATH, ld.so.conf and the default paths are the same for all
+// files, so they are not part of it.
+static size_t memo_context(struct libtree_state_t *s, size_t depth) {
+    struct memo_t *m = &s->memo;
+    struct frame_t *f = &s->stack.frames[depth];
+    m->key.n = 0;
+    if (f->node->runpath == NULL) {
+        memo_key_append_number(m, f->rpath_chain);
+    } else {
+        memo_key_append(m, "runpath");
+        memo_key_append_number(m, f->runpath);
+    }
+    string_table_store(&m->key, f->node->no_def_lib ? "nodeflib" : "");
+    return memo_intern_key(m);
+}
+
+static void memo_result_key(struct memo_t *m, size_t context,
+                            elf_bits_t bits, char const *soname) {
+    m->key.n = 0;
+    memo_key_append_number(m, context);
+    memo_key_append_number(m, bits);
+    string_table_store(&m->key, soname);
+}
+
+// Returns the index of the entry for `soname`, or SIZE_MAX if there is none.
+static size_t memo_get(struct memo_t *m, size_t context, elf_bits_t bits,
+                       char const *soname) {
+    memo_result_key(m, context, bits, soname);
+    size_t *i = str_map_get(&m->results, m->key.arr);
+    return i == NULL ? SIZE_MAX : *i;
+}
+
+static size_t memo_put(struct memo_t *m, size_t context, elf_bits_t bits,
+                       char const *soname, struct memo_entry_t entry,
+                       char const *path) {
+    if (m->n == m->capacity) {
+        m->capacity = m->capacity == 0 ? 256 : 2 * m->capacity;
+        m->entries =
+            realloc(m->entries, m->capacity * sizeof(struct memo_entry_t));
+        if (m->entries == NULL)
+            exit(1);
+    }
+    entry.path = SIZE_MAX;
+    if (path != NULL) {
+        entry.path = m->paths.n;
+        string_table_store(&m->paths, path);
+    }
+    m->entries[m->n] = entry;
+    memo_result_key(m, context, bits, soname);
+    str_map_put(&m->results, m->key.arr, m->n);
+    return m->n++;
+}
+
+/**
+ * end of memo_t
+ */
+
+/**
+ * reverse_index_t
+ */
+
+static void reverse_index_init(struct reverse_index_t *r) {
+    memset(r, 0, sizeof(*r));
+    r->slots_capacity = 1024;
+    r->slots = malloc(r->slots_capacity * sizeof(size_t));
+    if (r->slots == NULL)
+        exit(1);
+    for (size_t i = 0; i < r->slots_capacity; ++i)
+        r->slots[i] = SIZE_MAX;
+}
+
+static void reverse_index_free(struct reverse_index_t *r) {
+    free(r->edges);
+    free(r->slots);
+    free(r->first);
+    free(r->last);
+    free(r->path);
+    free(r->paths.arr);
+    free(r->reached);
+    free(r->missing);
+}
+
+static size_t *reverse_index_slot(struct reverse_index_t *r, size_t parent,
+                                  size_t child) {
+    uint64_t h = (uint64_t)parent * 0x9e3779b97f4a7c15ULL ^ child;
+    h ^= h >> 29;
+    size_t mask = r->slots_capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        size_t e = r->slots[i];
+        if (e == SIZE_MAX ||
+            (r->edges[e].parent == parent && r->edges[e].child == child))
+            return &r->slots[i];
+    }
+}
+
+static void reverse_index_reserve_node(struct reverse_index_t *r,
+                                       size_t index) {
+    if (index < r->nodes_capacity)
+        return;
+    size_t capacity = r->nodes_capacity == 0 ? 1024 : r->nodes_capacity;
+    while (index >= capacity)
+        capacity *= 2;
+    r->first = realloc(r->first, capacity * sizeof(size_t));
+    r->last = realloc(r->last, capacity * sizeof(size_t));
+    r->path = realloc(r->path, capacity * sizeof(size_t));
+    if (r->first == NULL || r->last == NULL || r->path == NULL)
+        exit(1);
+    for (size_t i = r->nodes_capacity; i < capacity; ++i)
+        r->first[i] = r->last[i] = r->path[i] = SIZE_MAX;
+    r->nodes_capacity = capacity;
+}
+
+// Remember the first path by which a file was reached.
+static void reverse_index_add_path(struct reverse_index_t *r,
+                                   struct elf_node_t *node, char const *path) {
+    reverse_index_reserve_node(r, node->index);
+    if (r->path[node->index] != SIZE_MAX)
+        return;
+    r->path[node->index] = r->paths.n;
+    string_table_store(&r->paths, path);
+
+    if (r->reached_n == r->reached_capacity) {
+        r->reached_capacity =
+            r->reached_capacity == 0 ? 1024 : 2 * r->reached_capacity;
+        r->reached = realloc(r->reached, r->reached_capacity * sizeof(size_t));
+        if (r->reached == NULL)
+            exit(1);
+    }
+    r->reached[r->reached_n++] = node->index;
+}
+
+static void reverse_index_add_missing(struct reverse_index_t *r,
+                                      struct elf_node_t *parent,
+                                      char const *name) {
+    if (r->missing_n == r->missing_capacity) {
+        r->missing_capacity =
+            r->missing_capacity == 0 ? 64 : 2 * r->missing_capacity;
+        r->missing = realloc(r->missing, r->missing_capacity *
+                                             sizeof(struct rdep_missing_t));
+        if (r->missing == NULL)
+            exit(1);
+    }
+    r->missing[r->missing_n++] =
+        (struct rdep_missing_t){.parent = parent->index, .name = r->paths.n};
+    string_table_store(&r->paths, name);
+}
+
+static void reverse_index_add_edge(struct reverse_index_t *r,
+                                   struct elf_node_t *parent,
+                                   struct elf_node_t *child,
+                                   struct found_t reason) {
+    size_t *slot = reverse_index_slot(r, parent->index, child->index);
+    if (*slot != SIZE_MAX)
+        return;
+
+    if (r->n == r->capacity) {
+        r->capacity = r->capacity == 0 ? 1024 : 2 * r->capacity;
+        r->edges = realloc(r->edges, r->capacity * sizeof(struct rdep_edge_t));
+        if (r->edges == NULL)
+            exit(1);
+    }
+    size_t e = r->n++;
+    r->edges[e] = (struct rdep_edge_t){.parent = parent->index,
+                                       .child = child->index,
+                                       .how = reason.how,
+                                       .rpath_depth = reason.depth,
+                                       .next = SIZE_MAX};
+    *slot = e;
+
+    // Edges are listed in the order they were found.
+    reverse_index_reserve_node(r, child->index);
+    if (r->last[child->index] == SIZE_MAX)
+        r->first[child->index] = e;
+    else
+        r->edges[r->last[child->index]].next = e;
+    r->last[child->index] = e;
+
+    // Keep the load factor below 1/2.
+    if (2 * r->n > r->slots_capacity) {
+        free(r->slots);
+        r->slots_capacity *= 2;
+        r->slots = malloc(r->slots_capacity * sizeof(size_t));
+        if (r->slots == NULL)
+            exit(1);
+        for (size_t i = 0; i < r->slots_capacity; ++i)
+            r->slots[i] = SIZE_MAX;
+        for (size_t i = 0; i < r->n; ++i)
+            *reverse_index_slot(r, r->edges[i].parent, r->edges[i].child) = i;
+    }
+}
+
+/**
+ * end of reverse_index_t
+ */
+
+/**
+ * snapshot_t
+ */
+
+static void snapshot_init(struct snapshot_t *sn) {
+    str_map_init(&sn->edges, 256);
+    str_map_init(&sn->stacks, 64);
+    sn->values = (struct string_table_t){NULL, 0, 0};
+    sn->key = (struct string_table_t){NULL, 0, 0};
+    // Offset 0 is "not found".
+    string_table_store(&sn->values, "");
+}
+
+static void snapshot_free(struct snapshot_t *sn) {
+    str_map_free(&sn->edges);
+    str_map_free(&sn->stacks);
+    free(sn->values.arr);
+    free(sn->key.arr);
+}
+
+static char const *snapshot_key(struct snapshot_t *sn, char const *file,
+                                char const *needed) {
+    sn->key.n = 0;
+    string_table_store(&sn->key, file);
+    sn->key.arr[sn->key.n - 1] = '\n';
+    string_table_store(&sn->key, needed);
+    return sn->key.arr;
+}
+
+// Append `str` to the last value, or start a new one when `start` is set.
+static void snapshot_append(struct snapshot_t *sn, char const *str,
+                            int start) {
+    if (!start)
+        --sn->values.n;
+    string_table_store(&sn->values, str);
+}
+
+// Record that `file`, at `depth` - 1, needs `needed`, which was located at
+// `path` for `reason`, or not found when `path` is NULL.
+static void snapshot_add_edge(struct snapshot_t *sn, char const *file,
+                              char const *needed, char const *path,
+                              struct found_t reason, size_t depth) {
+    size_t value = 0;
+    if (path != NULL) {
+        value = sn->values.n;
+        snapshot_append(sn, path, 1);
+        switch (reason.how) {
+        case RPATH:
+            if (reason.depth + 1 >= depth) {
+                snapshot_append(sn, " [rpath]", 0);
+            } else {
+                char num[24];
+                utoa(num, reason.depth + 1);
+                snapshot_append(sn, " [rpath of ", 0);
+                snapshot_append(sn, num, 0);
+                snapshot_append(sn, "]", 0);
+            }
+            break;
+        case LD_LIBRARY_PATH:
+            snapshot_append(sn, " [LD_LIBRARY_PATH]", 0);
+            break;
+        case RUNPATH:
+            snapshot_append(sn, " [runpath]", 0);
+            break;
+        case LD_SO_CONF:
+            snapshot_append(
+                sn, sn->ld_cache ? " [ld.so.cache]" : " [ld.so.conf]", 0);
+            break;
+        case DIRECT:
+            snapshot_append(sn, " [direct]", 0);
+            break;
+        case DEFAULT:
+            snapshot_append(sn, " [default path]", 0);
+            break;
+        default:
+            break;
+        }
+    }
+    str_map_put(&sn->edges, snapshot_key(sn, file, needed), value);
+}
+
+// Record the search paths of the frame at `depth`: its runpath, or the rpaths
+// of the frame and its parents.
+static void snapshot_add_stack(struct snapshot_t *sn, struct libtree_state_t *s,
+                               size_t depth) {
+    struct frame_t *frames = s->stack.frames;
+    size_t value = sn->values.n;
+    if (frames[depth].node->runpath != NULL) {
+        snapshot_append(sn, "runpath ", 1);
+        snapshot_append(sn, intern_get(&s->intern, frames[depth].runpath), 0);
+    } else {
+        snapshot_append(sn, "", 1);
+        for (size_t j = depth + 1; j-- > 0;) {
+            if (frames[j].rpath == SIZE_MAX)
+                continue;
+            if (sn->values.n > value + 1)
+                snapshot_append(sn, ":", 0);
+            snapshot_append(sn, intern_get(&s->intern, frames[j].rpath), 0);
+        }
+    }
+    str_map_put(&sn->stacks, frames[depth].file, value);
+}
+
+/**
+ * end of snapshot_t
+ */
+
+/**
+ * dag_t
+ */
+
+static void dag_init(struct dag_t *d) {
+    str_map_init(&d->labels, 64);
+    str_map_init(&d->chains, 64);
+    d->key = (struct string_table_t){NULL, 0, 0};
+    d->label = SIZE_MAX;
+    d->is_ref = 0;
+}
+
+static void dag_free(struct dag_t *d) {
+    str_map_free(&d->labels);
+    str_map_free(&d->chains);
+    free(d->key.arr);
+}
+
+// Make the key of three numbers.
+static char const *dag_key(struct dag_t *d, size_t a, size_t b, size_t c) {
+    size_t nums[3] = {a, b, c};
+    d->key.n = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        char num[24];
+        utoa(num, nums[i]);
+        string_table_store(&d->key, num);
+        d->key.arr[d->key.n - 1] = ',';
+    }
+    d->key.arr[d->key.n - 1] = '\0';
+    return d->key.arr;
+}
+
+// Returns the id of the rpath stack of `parent` with the interned `rpath` on
+// top. Stack 0 is empty.
+static size_t dag_chain(struct dag_t *d, size_t parent, size_t rpath) {
+    if (rpath == SIZE_MAX)
+        return parent;
+    char const *key = dag_key(d, parent, rpath, 0);
+    size_t *id = str_map_get(&d->chains, key);
+    if (id != NULL)
+        return *id;
+    size_t new_id = d->chains.n + 1;
+    str_map_put(&d->chains, key, new_id);
+    return new_id;
+}
+
+/**
+ * end of dag_t
+ */
+
+/**
+ * bundle_t
+ */
+
+static void bundle_init(struct bundle_t *b, char const *dir) {
+    memset(b, 0, sizeof(*b));
+    str_map_init(&b->dests, 64);
+    pthread_mutex_init(&b->lock, NULL);
+    b->dir = dir;
+}
+
+static void bundle_free(struct bundle_t *b) {
+    free(b->files);
+    free(b->copies);
+    free(b->strings.arr);
+    str_map_free(&b->dests);
+    pthread_mutex_destroy(&b->lock);
+}
+
+static char const *base_name(char const *path) {
+    char const *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
+}
+
+// Add `node` at `path`, which its parent needs as `needed`, or which is an
+// input when `needed` is NULL.
+static void bundle_add(struct bundle_t *b, struct elf_node_t *node,
+                       char const *path, char const *needed) {
+    size_t dest = b->strings.n;
+    string_table_store(&b->strings, needed == NULL ? "bin/" : "lib/");
+    --b->strings.n;
+    string_table_store(&b->strings,
+                       base_name(needed == NULL ? path : needed));
+    size_t *known = str_map_get(&b->dests, b->strings.arr + dest);
+    if (known != NULL) {
+        struct bundle_file_t *other = &b->files[*known];
+        if (other->node != node->index) {
+            fputs("Warning: `", stderr);
+            fputs(b->strings.arr + dest, stderr);
+            fputs("` is taken by `", stderr);
+            fputs(b->strings.arr + other->source, stderr);
+            fputs("`, skipping `", stderr);
+            fputs(path, stderr);
+            fputs("`\n", stderr);
+            ++b->conflicts;
+        }
+        b->strings.n = dest;
+        return;
+    }
+
+    if (node->index >= b->copies_n) {
+        size_t n = 2 * node->index + 16;
+        b->copies = realloc(b->copies, n * sizeof(size_t));
+        if (b->copies == NULL)
+            exit(1);
+        for (size_t i = b->copies_n; i < n; ++i)
+            b->copies[i] = SIZE_MAX;
+        b->copies_n = n;
+    }
+    if (b->n == b->capacity) {
+        b->capacity = b->capacity == 0 ? 64 : 2 * b->capacity;
+        b->files = realloc(b->files, b->capacity * sizeof(struct bundle_file_t));
+        if (b->files == NULL)
+            exit(1);
+    }
+    struct bundle_file_t *f = &b->files[b->n];
+    f->dest = dest;
+    f->source = b->strings.n;
+    string_table_store(&b->strings, path);
+    f->node = node->index;
+    f->link = b->copies[node->index];
+    f->error = 0;
+    // Every file is copied once, other names are hard links to the copy.
+    if (f->link == SIZE_MAX)
+        b->copies[node->index] = b->n;
+    str_map_put(&b->dests, b->strings.arr + dest, b->n);
+    ++b->n;
+}
+
+static void bundle_add_missing(struct bundle_t *b, char const *parent,
+                               char const *name) {
+    fputs("Error: `", stderr);
+    fputs(name, stderr);
+    fputs("` needed by `", stderr);
+    fputs(parent, stderr);
+    fputs("` not found\n", stderr);
+    ++b->missing;
+}
+
+/**
+ * end of bundle_t
+ */
+
+/**
+ * cost_t
+ */
+
+static void cost_init(struct cost_t *c) {
+    memset(c, 0, sizeof(*c));
+}
+
+static void cost_free(struct cost_t *c) {
+    free(c->nodes);
+    free(c->path_offsets);
+    free(c->paths.arr);
+    free(c->counted);
+}
+
+// Make `node` at `path` the file of the line being printed, and count it
+// when it is new.
+static void cost_add(struct cost_t *c, struct elf_node_t const *node,
+                     char const *path) {
+    c->node = node;
+    if (node->index >= c->counted_n) {
+        size_t n = 2 * node->index + 16;
+        c->counted = realloc(c->counted, n);
+        if (c->counted == NULL)
+            exit(1);
+        memset(c->counted + c->counted_n, 0, n - c->counted_n);
+        c->counted_n = n;
+    }
+    if (c->counted[node->index])
+        return;
+    c->counted[node->index] = 1;
+    if (c->n == c->capacity) {
+        c->capacity = c->capacity == 0 ? 64 : 2 * c->capacity;
+        c->nodes = realloc(c->nodes, c->capacity * sizeof(size_t));
+        c->path_offsets =
+            realloc(c->path_offsets, c->capacity * sizeof(size_t));
+        if (c->nodes == NULL || c->path_offsets == NULL)
+            exit(1);
+    }
+    c->nodes[c->n] = node->index;
+    c->path_offsets[c->n] = c->paths.n;
+    string_table_store(&c->paths, path);
+    ++c->n;
+}
+
+// Relocations that need a symbol lookup, which dominate the time spent in the
+// dynamic loader.
+static uint64_t cost_lookups(struct elf_cost_t const *cost) {
+    return cost->relocs - cost->relative + cost->plt_relocs;
+}
+
+/**
+ * end of cost_t
+ */
+
+/**
+ * symbol_scope_t
+ */
+
+static void symbol_scope_free(struct symbol_scope_t *sc) {
+    free(sc->nodes);
+    free(sc->paths.arr);
+    free(sc->path_offsets);
+    free(sc->unresolved);
+    free(sc->begin);
+}
+
+static void symbol_scope_add(struct symbol_scope_t *sc,
+                             struct elf_node_t *node, char const *path) {
+    if (sc->n + 1 >= sc->capacity) {
+        sc->capacity = sc->capacity == 0 ? 64 : 2 * sc->capacity;
+        sc->nodes = realloc(sc->nodes, sc->capacity * sizeof(*sc->nodes));
+        sc->path_offsets =
+            realloc(sc->path_offsets, sc->capacity * sizeof(size_t));
+        sc->begin = realloc(sc->begin, sc->capacity * sizeof(size_t));
+        if (sc->nodes == NULL || sc->path_offsets == NULL || sc->begin == NULL)
+            exit(1);
+    }
+    node->checked = sc->generation;
+    node->scope = sc->n;
+    sc->nodes[sc->n] = node;
+    sc->path_offsets[sc->n] = sc->paths.n;
+    string_table_store(&sc->paths, path);
+    ++sc->n;
+}
+
+static void symbol_scope_add_unresolved(struct symbol_scope_t *sc,
+                                        char const *name) {
+    if (sc->unresolved_n == sc->unresolved_capacity) {
+        sc->unresolved_capacity =
+            sc->unresolved_capacity == 0 ? 64 : 2 * sc->unresolved_capacity;
+        sc->unresolved = realloc(sc->unresolved, sc->unresolved_capacity *
+                                                     sizeof(char const *));
+        if (sc->unresolved == NULL)
+            exit(1);
+    }
+    sc->unresolved[sc->unresolved_n++] = name;
+}
+
+// Look up every undefined symbol of every object in all objects of the scope.
+// The order of the objects doesn't matter for whether a symbol is defined.
+static void symbol_scope_resolve(struct symbol_scope_t *sc) {
+    sc->complete = 1;
+    sc->unresolved_n = 0;
+    if (sc->n == 0)
+        return;
+    for (size_t i = 0; i < sc->n; ++i) {
+        struct elf_node_t *node = sc->nodes[i];
+        if (!node->symbols_loaded) {
+            node->symbols =
+                elf_symbols_load(sc->paths.arr + sc->path_offsets[i]);
+            node->symbols_loaded = 1;
+        }
+        if (node->symbols == NULL)
+            sc->complete = 0;
+    }
+
+    for (size_t i = 0; i < sc->n; ++i) {
+        sc->begin[i] = sc->unresolved_n;
+        struct elf_symbols_t const *sym = sc->nodes[i]->symbols;
+        if (!sc->complete)
+            continue;
+        for (uint32_t j = 0; j < sym->undefined_n; ++j) {
+            char const *name = sym->strtab + sym->names[sym->undefined[j]];
+            uint32_t gnu_h = gnu_hash(name);
+            uint32_t sysv_h = sysv_hash(name);
+            int defined = 0;
+            for (size_t k = 0; k < sc->n && !defined; ++k)
+                defined = elf_symbols_defines(sc->nodes[k]->symbols, name,
+                                              gnu_h, sysv_h);
+            if (!defined)
+                symbol_scope_add_unresolved(sc, name);
+        }
+    }
+    sc->begin[sc->n] = sc->unresolved_n;
+}
+
+/**
+ * end of symbol_scope_t
+ */
+
+static int enter_file(struct libtree_state_t *s, char const *current_file,
+                      char const *needed, size_t depth,
+                      elf_bits_t parent_bits, struct found_t reason);
+
+static struct elf_node_t *open_node(struct libtree_state_t *s,
+                                    char const *path, elf_bits_t parent_bits,
+                                    int *code);
+
+// Look for the unresolved needed libraries of the frame at `depth` in the
+// directories of the colon delimited list `buf`. Every directory is a
+// position in the search order.
+static void resolve_in_paths(struct libtree_state_t *s, size_t depth,
+                             struct found_t reason, char const *buf,
+                             size_t context, size_t *position,
+                             size_t *unresolved) {
+    struct frame_t *f = &s->stack.frames[depth];
+    size_t *resolved = s->stack.resolved + f->needed_begin;
+    char *path = f->path;
+    char *path_end = path + 4096;
+    size_t offset = 0;
+
+    while (*unresolved) {
+        if (buf[offset] == '\0')
+            return;
+
+        // First remove trailing colons
+        while (buf[offset] == ':' && buf[offset] != '\0')
+            ++offset;
+
+        // Check if it was only colons
+        if (buf[offset] == '\0')
+            return;
+
+        // Copy the search path until the first \0 or :
+        char *dest = path;
+        while (buf[offset] != '\0' && buf[offset] != ':' && dest != path_end)
+            *dest++ = buf[offset++];
+
+        // Path too long... Can't handle.
+        if (dest + 1 >= path_end)
+            continue;
+
+        // Add a separator if necessary
+        if (*(dest - 1) != '/')
+            *dest++ = '/';
+
+        // Keep track of the end of the current search path.
+        char *search_path_end = dest;
+        *search_path_end = '\0';
+        ++*position;
+
+        // Only open files that are listed in the directory.
+        struct dir_t *dir = dir_index_get(&s->dir_index, path);
+
+        for (size_t i = 0; i < f->needed_not_found; ++i) {
+            if (resolved[i] != SIZE_MAX)
+                continue;
+            char const *soname = f->node->strings + frame_needed(s, f)[i];
+            size_t soname_len = strlen(soname);
+            ++s->stats.probes[reason.how];
+            *search_path_end = '\0';
+            uint64_t probe =
+                trace_begin(&s->trace, TRACE_PROBE, depth + 1, path, soname);
+
+            // Path too long, can't handle, or not in this directory.
+            int code = ERR_NOT_FOUND;
+            if (search_path_end + soname_len + 1 < path_end &&
+                dir_may_contain(dir, soname)) {
+                memcpy(search_path_end, soname, soname_len + 1);
+                open_node(s, path, f->node->bits, &code);
+            }
+            trace_end(&s->trace, probe, code);
+
+            if (code != 0) {
+                ++s->stats.failed_probes[reason.how];
+                continue;
+            }
+
+            struct memo_entry_t entry = {.how = reason.how,
+                                         .rpath_depth = reason.depth,
+                                         .position = *position};
+            resolved[i] = memo_put(&s->memo, context, f->node->bits, soname,
+                                   entry, path);
+            --*unresolved;
+        }
+    }
+}
+
+// Warn once per `key` about the file `path` of ld.so.cache: with `stale` set
+// the cache is out of date, and otherwise the file can't be used. The library
+// collects warnings in the graph instead of printing them.
+static void ld_cache_report(struct libtree_state_t *s, char const *key,
+                            char const *path, char const *problem,
+                            int stale) {
+    struct ld_cache_t *c = &s->ld_cache;
+    if (str_map_get(&c->reported, key) != NULL)
+        return;
+    str_map_put(&c->reported, key, 0);
+    char const *stale_parts[] = {c->path, " is stale, `", path,
+                                 "` ",    problem,        ", run ldconfig"};
+    char const *unusable_parts[] = {"`", path, "` in ", c->path, problem, ""};
+    char const *const *parts = stale ? stale_parts : unusable_parts;
+    size_t parts_n = sizeof(stale_parts) / sizeof(char const *);
+    if (s->warnings != NULL) {
+        string_table_store(s->warnings, parts[0]);
+        for (size_t i = 1; i < parts_n; ++i) {
+            --s->warnings->n;
+            string_table_store(s->warnings, parts[i]);
+        }
+        return;
+    }
+    // Keep the warning next to the output it is about.
+    out_flush(s);
+    fputs("Warning: ", stderr);
+    for (size_t i = 0; i < parts_n; ++i)
+        fputs(parts[i], stderr);
+    fputc('\n', stderr);
+}
+
+// Warn about the file `path` of ld.so.cache, which could not be opened when
+// `node` is NULL, or parsed, saying why.
+static void ld_cache_report_unusable(struct libtree_state_t *s,
+                                     char const *path,
+                                     struct elf_node_t const *node) {
+    struct stat st;
+    if (node != NULL) {
+        ld_cache_report(s, path, path,
+                        node->error == ERR_INVALID_MAGIC
+                            ? " is not an ELF file"
+                            : " is not a valid ELF file",
+                        0);
+    } else if (stat(path, &st) != 0 && (errno == ENOENT || errno == ENOTDIR)) {
+        ld_cache_report(s, path, path, "does not exist", 1);
+    } else if (access(path, R_OK) != 0) {
+        char problem[256] = " can't be opened: ";
+        size_t len = strlen(problem);
+        strncpy(problem + len, strerror(errno), sizeof(problem) - len - 1);
+        ld_cache_report(s, path, path, problem, 0);
+    } else {
+        ld_cache_report(s, path, path, " can't be opened", 0);
+    }
+}
+
+// The loader won't find `soname` in the cache. Report it when it is in one of
+// the ld.so.conf directories nonetheless.
+static void ld_cache_check_stale(struct libtree_state_t *s, char const *soname,
+                                 elf_bits_t bits) {
+    if (str_map_get(&s->ld_cache.reported, soname) != NULL)
+        return;
+
+    char path[4096];
+    char *path_end = path + 4096;
+    size_t soname_len = strlen(soname);
+
+    for (char const *p = s->string_table.arr + s->ld_so_conf_offset;
+         *p != '\0';) {
+        if (*p == ':') {
+            ++p;
+            continue;
+        }
+
+        char *dest = path;
+        while (*p != '\0' && *p != ':' && dest != path_end)
+            *dest++ = *p++;
+
+        if (dest + soname_len + 2 >= path_end)
+            continue;
+
+        if (*(dest - 1) != '/')
+            *dest++ = '/';
+        *dest = '\0';
+
+        struct dir_t *dir = dir_index_get(&s->dir_index, path);
+        if (dir == NULL || !dir->listed ||
+            str_map_get(&dir->entries, soname) == NULL)
+            continue;
+
+        memcpy(dest, soname, soname_len + 1);
+        int code;
+        struct elf_node_t *node = node_cache_get(&s->node_cache, path, &code);
+        if (node != NULL && node->error == 0 &&
+            (bits == EITHER || node->bits == bits)) {
+            ld_cache_report(s, soname, path, "is missing", 1);
+            return;
+        }
+    }
+}
+
+// Look for the unresolved needed libraries of the frame at `depth` in
+// ld.so.cache like the loader does, instead of scanning the ld.so.conf
+// directories. The cache is a single position in the search order.
+static void resolve_in_ld_cache(struct libtree_state_t *s, size_t depth,
+                                struct found_t reason, size_t context,
+                                size_t *position, size_t *unresolved) {
+    struct ld_cache_t *c = &s->ld_cache;
+    struct frame_t *f = &s->stack.frames[depth];
+    size_t *resolved = s->stack.resolved + f->needed_begin;
+    ++*position;
+
+    for (size_t i = 0; i < f->needed_not_found && *unresolved; ++i) {
+        if (resolved[i] != SIZE_MAX)
+            continue;
+        char const *soname = f->node->strings + frame_needed(s, f)[i];
+        uint64_t probe =
+            trace_begin(&s->trace, TRACE_LD_CACHE, depth + 1, c->path, soname);
+        size_t begin, end;
+        ld_cache_find(c, soname, &begin, &end);
+        ++s->stats.probes[reason.how];
+
+        char const *found = NULL;
+        for (size_t j = begin; j < end && found == NULL; ++j) {
+            struct ld_cache_entry_t e;
+            ld_cache_entry(c, j, &e);
+            if (!ld_cache_entry_matches(&e, f->node->bits))
+                continue;
+
+            char const *path = c->data + c->strings + e.value;
+            int code;
+            struct elf_node_t *node =
+                node_cache_get(&s->node_cache, path, &code);
+            if (node == NULL || node->error != 0) {
+                ld_cache_report_unusable(s, path, node);
+                continue;
+            }
+
+            // Paths are copied to a frame's buffer when entered.
+            if (strlen(path) < 4096 &&
+                open_node(s, path, f->node->bits, &code) != NULL)
+                found = path;
+        }
+        trace_end(&s->trace, probe, found != NULL ? 0 : ERR_NOT_FOUND);
+
+        if (found != NULL) {
+            struct memo_entry_t entry = {
+                .how = reason.how, .rpath_depth = 0, .position = *position};
+            resolved[i] = memo_put(&s->memo, context, f->node->bits, soname,
+                                   entry, found);
+            --*unresolved;
+        } else {
+            ++s->stats.failed_probes[reason.how];
+            ld_cache_check_stale(s, soname, f->node->bits);
+        }
+    }
+}
+
+static int interpolate_variables(struct libtree_state_t *s,
+                                 struct string_table_t *st, size_t src,
+                                 char const *ORIGIN) {
+    // We do not write to dst if there is no variables to interpolate.
+    size_t prev_src = src;
+    size_t curr_src = src;
+
+    while (1) {
+        // Find the next potential variable.
+        char *dollar = strchr(st->arr + curr_src, '$');
+        if (dollar == NULL)
+            break;
+        curr_src = dollar - st->arr;
+
+        size_t bytes_to_dollar = curr_src - prev_src;
+
+        // Go past the dollar.
+        ++curr_src;
+
+        // Remember if we have to look for matching curly braces.
+        int curly = 0;
+        if (st->arr[curr_src] == '{') {
+            curly = 1;
+            ++curr_src;
+        }
+
+        // String to interpolate.
+        char const *var_val = NULL;
+        if (strncmp(&st->arr[curr_src], "ORIGIN", 6) == 0) {
+            var_val = ORIGIN;
+            curr_src += 6;
+        } else if (strncmp(&st->arr[curr_src], "LIB", 3) == 0) {
+            var_val = s->LIB;
+            curr_src += 3;
+        } else if (strncmp(&st->arr[curr_src], "PLATFORM", 8) == 0) {
+            var_val = s->PLATFORM;
+            curr_src += 8;
+        } else if (strncmp(&st->arr[curr_src], "OSNAME", 6) == 0) {
+            var_val = s->OSNAME;
+            curr_src += 6;
+        } else if (strncmp(&st->arr[curr_src], "OSREL", 5) == 0) {
+            var_val = s->OSREL;
+            curr_src += 5;
+        } else {
+            continue;
+        }
+
+        // Require matching {...}.
+        if (curly) {
+            if (st->arr[curr_src] != '}') {
+                continue;
+            }
+            ++curr_src;
+        }
+
+        size_t var_len = strlen(var_val);
+
+        // Make sure we have enough space to write to.
+        string_table_maybe_grow(st, bytes_to_dollar + var_len);
+
+        // First copy over the string until the variable.
+        memcpy(&st->arr[st->n], &st->arr[prev_src], bytes_to_dollar);
+        st->n += bytes_to_dollar;
+
+        // Then move prev_src until after the variable.
+        prev_src = curr_src;
+
+        // Then copy the variable value (without null).
+        memcpy(&st->arr[st->n], var_val, var_len);
+        st->n += var_len;
+    }
+
+    // Did we copy anything? That implies a variable was interpolated.
+    // Copy the remainder, including the \0.
+    if (prev_src != src) {
+        // Growing may move the table, so copy by offset.
+        size_t n = strlen(st->arr + prev_src) + 1;
+        string_table_maybe_grow(st, n);
+        memcpy(st->arr + st->n, st->arr + prev_src, n);
+        st->n += n;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void print_colon_delimited_paths(char const *start, char const *indent,
+                                        struct libtree_state_t *s) {
+    while (1) {
+        // Don't print empty string
+        if (*start == '\0')
+            break;
+
+        // Find the next delimiter after start
+        char *next = strchr(start, ':');
+
+        // Don't print empty strings
+        if (start == next) {
+            ++start;
+            continue;
+        }
+
+        out_puts(s, indent);
+        out_puts(s, JUST_INDENT);
+
+        // Print up to but not including : or \0, followed by a newline.
+        if (next == NULL) {
+            out_puts(s, start);
+            out_putc(s, '\n');
+        } else {
+            out_write(s, start, next - start);
+            out_putc(s, '\n');
+        }
+
+        // We done yet?
+        if (next == NULL)
+            break;
+
+        // Otherwise put the : back in place and continue.
+        start = next + 1;
+    }
+}
+
+// Write the colon separated `paths` as JSON array elements.
+static void print_json_paths(char const *paths, int *first,
+                             struct libtree_state_t *s) {
+    while (*paths != '\0') {
+        char const *next = strchr(paths, ':');
+        size_t n = next == NULL ? strlen(paths) : (size_t)(next - paths);
+        if (n > 0) {
+            if (!*first)
+                out_putc(s, ',');
+            *first = 0;
+            // Paths are at most 4096 bytes when searched.
+            char path[4096];
+            if (n >= sizeof(path))
+                n = sizeof(path) - 1;
+            memcpy(path, paths, n);
+            path[n] = '\0';
+            out_json_string(s, path);
+        }
+        if (next == NULL)
+            break;
+        paths = next + 1;
+    }
+}
+
+static void print_json_begin(size_t depth, char const *soname,
+                             char const *path, struct libtree_state_t *s) {
+    char num[24];
+    utoa(num, depth);
+    out_puts(s, "{\"depth\":");
+    out_puts(s, num);
+    out_puts(s, ",\"parent\":");
+    out_json_string(s, depth == 0 ? NULL : s->stack.frames[depth - 1].file);
+    out_puts(s, ",\"soname\":");
+    out_json_string(s, soname);
+    out_puts(s, ",\"path\":");
+    out_json_string(s, path);
+}
+
+static void print_number(struct libtree_state_t *s, uint64_t value) {
+    char num[24];
+    utoa(num, value);
+    out_puts(s, num);
+}
+
+// Append the startup cost of the file being printed, for --cost.
+static void print_cost(struct libtree_state_t *s) {
+    if (s->cost == NULL || s->cost->node == NULL)
+        return;
+    struct elf_cost_t const *cost = &s->cost->node->cost;
+    if (s->json) {
+        out_puts(s, ",\"cost\":{\"relocs\":");
+        print_number(s, cost->relocs);
+        out_puts(s, ",\"relative\":");
+        print_number(s, cost->relative);
+        out_puts(s, ",\"plt_relocs\":");
+        print_number(s, cost->plt_relocs);
+        out_puts(s, ",\"plt_bytes\":");
+        print_number(s, cost->plt_size);
+        out_puts(s, cost->flags & COST_TEXTREL ? ",\"textrel\":true"
+                                               : ",\"textrel\":false");
+        out_puts(s, cost->flags & COST_BIND_NOW ? ",\"bind_now\":true"
+                                                : ",\"bind_now\":false");
+        out_puts(s, cost->flags & COST_GNU_HASH ? ",\"gnu_hash\":true}"
+                                                : ",\"gnu_hash\":false}");
+        return;
+    }
+    out_putc(s, '{');
+    print_number(s, cost->relocs);
+    out_puts(s, " relocs (");
+    print_number(s, cost->relative);
+    out_puts(s, " relative), ");
+    print_number(s, cost->plt_relocs);
+    out_puts(s, " plt");
+    if (cost->flags & COST_TEXTREL)
+        out_puts(s, ", textrel");
+    if (cost->flags & COST_BIND_NOW)
+        out_puts(s, ", bind now");
+    if (s->cost->node->has_dynamic && !(cost->flags & COST_GNU_HASH))
+        out_puts(s, ", no gnu hash");
+    out_putc(s, '}');
+}
+
+static void print_json_how(how_t how, struct libtree_state_t *s) {
+    switch (how) {
+    case INPUT:
+        out_puts(s, "\"input\"");
+        break;
+    case DIRECT:
+        out_puts(s, "\"direct\"");
+        break;
+    case RPATH:
+        out_puts(s, "\"rpath\"");
+        break;
+    case LD_LIBRARY_PATH:
+        out_puts(s, "\"LD_LIBRARY_PATH\"");
+        break;
+    case RUNPATH:
+        out_puts(s, "\"runpath\"");
+        break;
+    case LD_SO_CONF:
+        out_puts(s, s->ld_cache.data != NULL ? "\"ld.so.cache\""
+                                             : "\"ld.so.conf\"");
+        break;
+    case DEFAULT:
+        out_puts(s, "\"default path\"");
+        break;
+    }
+}
+
+// One record per resolved edge from the parent at depth - 1.
+static void print_json_edge(size_t depth, char const *path,
+                            char const *soname, struct found_t reason,
+                            struct libtree_state_t *s) {
+    print_json_begin(depth, soname, path, s);
+    out_puts(s, ",\"how\":");
+    print_json_how(reason.how, s);
+    if (reason.how == RPATH) {
+        char num[24];
+        utoa(num, reason.depth + 1);
+        out_puts(s, ",\"rpath_depth\":");
+        out_puts(s, num);
+    }
+    if (s->dag != NULL && s->dag->label != SIZE_MAX) {
+        char num[24];
+        utoa(num, s->dag->label);
+        out_puts(s, s->dag->is_ref ? ",\"ref\":" : ",\"id\":");
+        out_puts(s, num);
+    }
+    print_cost(s);
+    out_puts(s, "}\n");
+}
+
+// One record per library that was not found, with the paths considered in
+// order when `searched`.
+static void print_json_miss(size_t depth, char const *soname, int searched,
+                            char const *runpath, struct libtree_state_t *s,
+                            int no_def_lib) {
+    print_json_begin(depth, soname, NULL, s);
+    out_puts(s, ",\"how\":null,\"search_paths\":[");
+    int first = 1;
+    if (searched && runpath == NULL)
+        for (size_t j = depth; j-- > 0;)
+            if (s->stack.frames[j].rpath != SIZE_MAX)
+                print_json_paths(
+                    intern_get(&s->intern, s->stack.frames[j].rpath), &first,
+                    s);
+    if (searched && s->ld_library_path_offset != SIZE_MAX)
+        print_json_paths(s->string_table.arr + s->ld_library_path_offset,
+                         &first, s);
+    if (searched && runpath != NULL)
+        print_json_paths(runpath, &first, s);
+    if (searched && !no_def_lib) {
+        print_json_paths(s->ld_cache.data != NULL
+                             ? s->ld_cache.path
+                             : s->string_table.arr + s->ld_so_conf_offset,
+                         &first, s);
+        print_json_paths(s->string_table.arr + s->default_paths_offset, &first,
+                         s);
+    }
+    out_puts(s, "]}\n");
+}
+
+// A needed library with a slash in its name could not be used.
+static void print_direct_error(size_t depth, char const *name,
+                               char const *problem,
+                               struct libtree_state_t *s) {
+    if (s->quiet)
+        return;
+    uint64_t start = stats_clock(s);
+    if (s->json) {
+        print_json_miss(depth, name, 0, NULL, s, 0);
+    } else {
+        tree_preamble(s, depth);
+        if (s->color)
+            out_puts(s, BOLD_RED);
+        out_puts(s, name);
+        out_puts(s, problem);
+        out_puts(s, s->color ? CLEAR "\n" : "\n");
+    }
+    stats_add_time(s, &s->stats.output_ns, start);
+}
+
+static void print_tree_line(size_t depth, char const *path,
+                            char const *soname, char *color_bold,
+                            char *color_regular, int highlight,
+                            struct found_t reason, struct libtree_state_t *s) {
+    char const *name = soname != NULL && !s->path ? soname : path;
+    tree_preamble(s, depth);
+    // Color the filename different than the path name, if we have a path.
+    char *slash = NULL;
+    if (s->color && highlight && (slash = strrchr(name, '/')) != NULL) {
+        out_puts(s, color_regular);
+        out_write(s, name, slash + 1 - name);
+        out_puts(s, color_bold);
+        out_puts(s, slash + 1);
+    } else {
+        if (s->color)
+            out_puts(s, color_bold);
+
+        out_puts(s, name);
+    }
+    if (s->color && highlight)
+        out_puts(s, CLEAR " " BOLD_YELLOW);
+    else
+        out_putc(s, ' ');
+    switch (reason.how) {
+    case RPATH:
+        if (reason.depth + 1 >= depth) {
+            out_puts(s, "[rpath]");
+        } else {
+            char num[8];
+            utoa(num, reason.depth + 1);
+            out_puts(s, "[rpath of ");
+            out_puts(s, num);
+            out_putc(s, ']');
+        }
+        break;
+    case LD_LIBRARY_PATH:
+        out_puts(s, "[LD_LIBRARY_PATH]");
+        break;
+    case RUNPATH:
+        out_puts(s, "[runpath]");
+        break;
+    case LD_SO_CONF:
+        out_puts(s, s->ld_cache.data != NULL ? "[ld.so.cache]"
+                                             : "[ld.so.conf]");
+        break;
+    case DIRECT:
+        out_puts(s, "[direct]");
+        break;
+    case DEFAULT:
+        out_puts(s, "[default path]");
+        break;
+    default:
+        break;
+    }
+    if (s->dag != NULL && s->dag->label != SIZE_MAX) {
+        char num[24];
+        utoa(num, s->dag->label);
+        if (reason.how != INPUT)
+            out_putc(s, ' ');
+        out_puts(s, s->dag->is_ref ? "(see " : "(");
+        out_puts(s, num);
+        out_putc(s, ')');
+    }
+    if (s->cost != NULL && (reason.how != INPUT ||
+                            (s->dag != NULL && s->dag->label != SIZE_MAX)))
+        out_putc(s, ' ');
+    print_cost(s);
+    if (s->color)
+        out_puts(s, CLEAR "\n");
+    else
+        out_putc(s, '\n');
+}
+
+// Print the file at `path` with DT_SONAME `soname`, located for `reason`.
+static void print_line(size_t depth, char const *path, char const *soname,
+                       char *color_bold, char *color_regular, int highlight,
+                       struct found_t reason, struct libtree_state_t *s) {
+    if (s->quiet)
+        return;
+    uint64_t start = stats_clock(s);
+    if (s->json)
+        print_json_edge(depth, path, soname, reason, s);
+    else
+        print_tree_line(depth, path, soname, color_bold, color_regular,
+                        highlight, reason, s);
+    stats_add_time(s, &s->stats.output_ns, start);
+}
+
+// Print a line below a file at `depth`, which has dependencies printed below
+// it when `has_children` is set.
+static void print_note(size_t depth, int has_children, char const *what,
+                       char const *name, struct libtree_state_t *s) {
+    struct frame_t *frames = s->stack.frames;
+    for (size_t j = 0; j < depth; ++j)
+        out_puts(s, frames[j].found_all_needed ? JUST_INDENT
+                                               : LIGHT_VERTICAL_WITH_INDENT);
+    out_puts(s, has_children ? LIGHT_VERTICAL_WITH_INDENT : JUST_INDENT);
+    if (s->color)
+        out_puts(s, REGULAR_RED LIGHT_QUADRUPLE_DASH_VERTICAL " " BRIGHT_BLACK);
+    else
+        out_puts(s, LIGHT_QUADRUPLE_DASH_VERTICAL " ");
+    out_puts(s, what);
+    if (s->color)
+        out_puts(s, BOLD_RED);
+    out_puts(s, name);
+    out_puts(s, s->color ? CLEAR "\n" : "\n");
+}
+
+// Print the symbols that `node` at `depth` needs, but which no object in its
+// load scope defines, right below it.
+static void print_undefined_symbols(struct elf_node_t *node, size_t depth,
+                                    char const *path, int has_children,
+                                    struct libtree_state_t *s) {
+    struct symbol_scope_t *sc = &s->scope;
+    if (!s->check_symbols || s->quiet || node->checked != sc->generation ||
+        !sc->complete)
+        return;
+    size_t begin = sc->begin[node->scope];
+    size_t end = sc->begin[node->scope + 1];
+    if (begin == end)
+        return;
+
+    uint64_t start = stats_clock(s);
+    if (s->json) {
+        print_json_begin(depth, node->soname, path, s);
+        out_puts(s, ",\"undefined_symbols\":[");
+        for (size_t i = begin; i < end; ++i) {
+            if (i != begin)
+                out_putc(s, ',');
+            out_json_string(s, sc->unresolved[i]);
+        }
+        out_puts(s, "]}\n");
+        stats_add_time(s, &s->stats.output_ns, start);
+        return;
+    }
+
+    for (size_t i = begin; i < end; ++i)
+        print_note(depth, has_children, "undefined symbol ", sc->unresolved[i],
+                   s);
+    stats_add_time(s, &s->stats.output_ns, start);
+}
+
+// Whether the file `node` defines the version `v` that `parent` requires.
+static int version_is_defined(struct elf_node_t const *parent,
+                              struct elf_version_t const *v,
+                              struct elf_node_t const *node) {
+    char const *name = parent->strings + v->name;
+    for (size_t i = 0; i < node->verdef_n; ++i) {
+        struct elf_version_t const *def = &node->versions[i];
+        if (def->hash == v->hash && strcmp(node->strings + def->name, name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Print the versions that the parent of `node` at `depth` requires from its
+// needed library `needed`, but which `node` does not define.
+static void print_missing_versions(struct elf_node_t *node, size_t depth,
+                                   char const *path, char const *needed,
+                                   int has_children,
+                                   struct libtree_state_t *s) {
+    if (s->quiet || depth == 0 || needed == NULL)
+        return;
+    struct elf_node_t *parent = s->stack.frames[depth - 1].node;
+    if (parent->versions_n == parent->verdef_n)
+        return;
+
+    // The same libraries are located over and over, so remember the ones that
+    // are fine.
+    uint32_t file = needed - parent->strings;
+    size_t j = 0;
+    while (j < parent->needed_n && parent->needed[j] != file)
+        ++j;
+    if (j == parent->needed_n)
+        return;
+    if (parent->versions_ok == NULL) {
+        parent->versions_ok = malloc(parent->needed_n * sizeof(size_t));
+        if (parent->versions_ok == NULL)
+            exit(1);
+        for (size_t i = 0; i < parent->needed_n; ++i)
+            parent->versions_ok[i] = SIZE_MAX;
+    }
+    if (parent->versions_ok[j] == node->index)
+        return;
+
+    int missing = 0;
+    for (size_t i = parent->verdef_n; i < parent->versions_n; ++i) {
+        struct elf_version_t const *v = &parent->versions[i];
+        if (v->file != file || version_is_defined(parent, v, node))
+            continue;
+
+        uint64_t start = stats_clock(s);
+        if (s->json) {
+            if (missing == 0) {
+                print_json_begin(depth, node->soname, path, s);
+                out_puts(s, ",\"missing_versions\":[");
+            } else {
+                out_putc(s, ',');
+            }
+            out_json_string(s, parent->strings + v->name);
+        } else {
+            print_note(depth, has_children, "version not found ",
+                       parent->strings + v->name, s);
+        }
+        ++missing;
+        stats_add_time(s, &s->stats.output_ns, start);
+    }
+    if (s->json && missing > 0)
+        out_puts(s, "]}\n");
+    if (missing == 0)
+        parent->versions_ok[j] = node->index;
+}
+
+// Print the problems with a file below its line.
+static void print_notes(struct elf_node_t *node, size_t depth,
+                        char const *path, char const *needed,
+                        int has_children, int seen_before,
+                        struct libtree_state_t *s) {
+    print_missing_versions(node, depth, path, needed, has_children, s);
+    if (!seen_before)
+        print_undefined_symbols(node, depth, path, has_children, s);
+}
+
+static void print_error(size_t depth, size_t needed_not_found,
+                        char const *strtab, uint64_t const *needed,
+                        char const *runpath, struct libtree_state_t *s,
+                        int no_def_lib) {
+    if (s->json) {
+        for (size_t i = 0; i < needed_not_found; ++i)
+            print_json_miss(depth + 1, strtab + needed[i], 1, runpath, s,
+                            no_def_lib);
+        return;
+    }
+
+    struct frame_t *frames = s->stack.frames;
+    for (size_t i = 0; i < needed_not_found; ++i) {
+        frames[depth].found_all_needed = i + 1 >= needed_not_found;
+        tree_preamble(s, depth + 1);
+        if (s->color)
+            out_puts(s, BOLD_RED);
+        out_puts(s, strtab + needed[i]);
+        out_puts(s, s->color ? " not found" CLEAR "\n" : " not found\n");
+    }
+
+    // If anything was not found, we print the search paths in order they
+    // are considered.
+    char *box_vertical =
+        s->color ? JUST_INDENT REGULAR_RED LIGHT_QUADRUPLE_DASH_VERTICAL CLEAR
+                 : JUST_INDENT LIGHT_QUADRUPLE_DASH_VERTICAL;
+    char *indent = malloc(sizeof(LIGHT_VERTICAL_WITH_INDENT) * depth +
+                          strlen(box_vertical) + 1);
+    char *p = indent;
+    for (size_t i = 0; i < depth; ++i) {
+        if (frames[i].found_all_needed) {
+            int len = sizeof(JUST_INDENT) - 1;
+            memcpy(p, JUST_INDENT, len);
+            p += len;
+        } else {
+            int len = sizeof(LIGHT_VERTICAL_WITH_INDENT) - 1;
+            memcpy(p, LIGHT_VERTICAL_WITH_INDENT, len);
+            p += len;
+        }
+    }
+    // dotted | in red
+    strcpy(p, box_vertical);
+
+    out_puts(s, indent);
+    if (s->color)
+        out_puts(s, BRIGHT_BLACK);
+    out_puts(s, " Paths considered in this order:\n");
+    if (s->color)
+        out_puts(s, CLEAR);
+
+    // Consider rpaths only when runpath is empty
+    out_puts(s, indent);
+    if (runpath != NULL) {
+        if (s->color)
+            out_puts(s, BRIGHT_BLACK);
+        out_puts(s, " 1. rpath is skipped because runpath was set\n");
+        if (s->color)
+            out_puts(s, CLEAR);
+    } else {
+        out_puts(s, s->color ? BRIGHT_BLACK " 1. rpath:" CLEAR "\n"
+                             : " 1. rpath:\n");
+        for (size_t j = depth + 1; j-- > 0;) {
+            if (frames[j].rpath != SIZE_MAX) {
+                char num[8];
+                utoa(num, j + 1);
+                out_puts(s, indent);
+                if (s->color)
+                    out_puts(s, BRIGHT_BLACK);
+                out_puts(s, "    depth ");
+                out_puts(s, num);
+                if (s->color)
+                    out_puts(s, CLEAR);
+                out_putc(s, '\n');
+                print_colon_delimited_paths(
+                    intern_get(&s->intern, frames[j].rpath), indent, s);
+            }
+        }
+    }
+
+    out_puts(s, indent);
+    if (s->ld_library_path_offset == SIZE_MAX) {
+        out_puts(s, s->color ? BRIGHT_BLACK
+                             " 2. LD_LIBRARY_PATH was not set" CLEAR "\n"
+                             : " 2. LD_LIBRARY_PATH was not set\n");
+    } else {
+        out_puts(s, s->color ? BRIGHT_BLACK " 2. LD_LIBRARY_PATH:" CLEAR "\n"
+                             : " 2. LD_LIBRARY_PATH:\n");
+        print_colon_delimited_paths(
+            s->string_table.arr + s->ld_library_path_offset, indent, s);
+    }
+
+    out_puts(s, indent);
+    if (runpath == NULL) {
+        out_puts(s, s->color ? BRIGHT_BLACK " 3. runpath was not set" CLEAR "\n"
+                             : " 3. runpath was not set\n");
+    } else {
+        out_puts(s, s->color ? BRIGHT_BLACK " 3. runpath:" CLEAR "\n"
+                             : " 3. runpath:\n");
+        print_colon_delimited_paths(runpath, indent, s);
+    }
+
+    out_puts(s, indent);
+    if (s->ld_cache.data != NULL) {
+        if (s->color)
+            out_puts(s, BRIGHT_BLACK);
+        out_puts(s, no_def_lib
+                        ? " 4. ld.so.cache not considered due to NODEFLIB flag"
+                        : " 4. ld.so.cache:");
+        out_puts(s, s->color ? CLEAR "\n" : "\n");
+        print_colon_delimited_paths(s->ld_cache.path, indent, s);
+    } else {
+        if (s->color)
+            out_puts(s, BRIGHT_BLACK);
+        out_puts(s, no_def_lib
+                        ? " 4. ld.so.conf not considered due to NODEFLIB flag"
+                        : " 4. ld.so.conf:");
+        out_puts(s, s->color ? CLEAR "\n" : "\n");
+        print_colon_delimited_paths(s->string_table.arr + s->ld_so_conf_offset,
+                                    indent, s);
+    }
+
+    out_puts(s, indent);
+    if (s->color)
+        out_puts(s, BRIGHT_BLACK);
+    out_puts(s, no_def_lib
+                    ? " 5. Standard paths not considered due to NODEFLIB flag"
+                    : " 5. Standard paths:");
+    out_puts(s, s->color ? CLEAR "\n" : "\n");
+    print_colon_delimited_paths(s->string_table.arr + s->default_paths_offset,
+                                indent, s);
+
+    free(indent);
+}
+
+// Store the ORIGIN string: the directory of `path` including the last /.
+static void get_origin(char *origin, char const *path) {
+    char const *last_slash = strrchr(path, '/');
+    if (last_slash != NULL && last_slash - path + 1 < 4096) {
+        // we're also copying the last /.
+        size_t bytes = last_slash - path + 1;
+        memcpy(origin, path, bytes);
+        origin[bytes] = '\0';
+    } else {
+        // this only happens when the input is relative (e.g. in current dir)
+        memcpy(origin, "./", 3);
+    }
+}
+
+// Returns the id of the colon separated `paths` with variables interpolated.
+static size_t intern_search_paths(struct libtree_state_t *s,
+                                  char const *paths, char const *origin) {
+    struct string_table_t *st = &s->intern.scratch;
+    st->n = 0;
+    string_table_store(st, paths);
+
+    // The interpolated string is stored right after the literal copy.
+    size_t interpolated = st->n;
+    if (!interpolate_variables(s, st, 0, origin))
+        interpolated = 0;
+    return intern_string(&s->intern, st->arr + interpolated);
+}
+
+// Interpolate the rpath and runpath of `node` for the file `path`. Only
+// $ORIGIN differs between the paths of a file, so the result is cached in the
+// node until the file is reached from another directory.
+static void expand_search_paths(struct libtree_state_t *s,
+                                struct elf_node_t *node, char const *path) {
+    if (node->rpath == NULL && node->runpath == NULL) {
+        node->expanded_rpath = node->expanded_runpath = SIZE_MAX;
+        return;
+    }
+
+    char origin[4096];
+    get_origin(origin, path);
+    size_t origin_id = intern_string(&s->intern, origin);
+    if (node->expanded_epoch == s->intern.epoch &&
+        node->expanded_origin == origin_id)
+        return;
+
+    node->expanded_epoch = s->intern.epoch;
+    node->expanded_origin = origin_id;
+    node->expanded_rpath = node->rpath == NULL
+                               ? SIZE_MAX
+                               : intern_search_paths(s, node->rpath, origin);
+    node->expanded_runpath =
+        node->runpath == NULL ? SIZE_MAX
+                              : intern_search_paths(s, node->runpath, origin);
+}
+
+/**
+ * pool_t
+ */
+
+// Appends colon separated `paths` to a colon separated list.
+static void path_list_append(struct string_table_t *list, char const *paths) {
+    if (paths == NULL || *paths == '\0')
+        return;
+    if (list->n > 0)
+        list->arr[list->n - 1] = ':';
+    string_table_store(list, paths);
+}
+
+static void pool_job_free(struct pool_job_t *job) {
+    free(job->name);
+    free(job->search_paths);
+    free(job->rpaths);
+    free(job);
+}
+
+static void pool_push(struct pool_t *pool, struct pool_job_t *job) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail == NULL)
+        pool->head = job;
+    else
+        pool->tail->next = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static struct pool_job_t *pool_job_create(char const *name,
+                                          char const *search_paths,
+                                          int defaults, char const *rpaths,
+                                          elf_bits_t bits, int verbosity) {
+    struct pool_job_t *job = malloc(sizeof(struct pool_job_t));
+    if (job == NULL)
+        exit(1);
+    job->name = string_copy(name);
+    job->search_paths = string_copy(search_paths);
+    job->defaults = defaults;
+    job->rpaths = string_copy(rpaths);
+    job->bits = bits;
+    job->verbosity = verbosity;
+    job->is_elf = NULL;
+    job->pending = NULL;
+    job->next = NULL;
+    return job;
+}
+
+static void pool_submit(struct pool_t *pool, char const *name,
+                        char const *search_paths, int defaults,
+                        char const *rpaths, elf_bits_t bits, int verbosity) {
+    pool_push(pool, pool_job_create(name, search_paths, defaults, rpaths, bits,
+                                    verbosity));
+}
+
+// Check whether the file at `path` is ELF, and if so parse it and prefetch its
+// dependencies. `*pending` counts the files that are not checked yet.
+static void pool_submit_crawl(struct pool_t *pool, char const *path,
+                              char *is_elf, size_t *pending, int verbosity) {
+    struct pool_job_t *job =
+        pool_job_create(path, NULL, 0, "", EITHER, verbosity);
+    job->is_elf = is_elf;
+    job->pending = pending;
+    pthread_mutex_lock(&pool->lock);
+    ++*pending;
+    pthread_mutex_unlock(&pool->lock);
+    pool_push(pool, job);
+}
+
+// Returns 1 exactly once per node: the dependencies of a node are prefetched
+// by whichever thread reaches it first.
+static int pool_claim(struct libtree_state_t *s, struct elf_node_t *node) {
+    pthread_mutex_lock(&s->node_cache.lock);
+    int prefetched = node->prefetched;
+    node->prefetched = 1;
+    pthread_mutex_unlock(&s->node_cache.lock);
+    return !prefetched && node->error == 0 && node->has_dynamic &&
+           node->needed_n > 0;
+}
+
+// Submit jobs to locate the dependencies of `node`, found at `path`, with the
+// same search paths the main thread will use, given the colon separated
+// `rpaths` of its parents (nearest first). Excluded libraries are skipped
+// unless `verbosity` shows them.
+static void pool_prefetch(struct libtree_state_t *s, struct elf_node_t *node,
+                          char const *path, char const *rpaths,
+                          int verbosity) {
+    struct pool_t *pool = s->pool;
+
+    char origin[4096];
+    get_origin(origin, path);
+
+    // Interpolate rpath and runpath into a scratch table.
+    struct string_table_t scratch = {NULL, 0, 0};
+    size_t rpath_offset = SIZE_MAX;
+    size_t runpath_offset = SIZE_MAX;
+    if (node->rpath != NULL) {
+        rpath_offset = scratch.n;
+        string_table_store(&scratch, node->rpath);
+        size_t curr_buf_size = scratch.n;
+        if (interpolate_variables(s, &scratch, rpath_offset, origin))
+            rpath_offset = curr_buf_size;
+    }
+    if (node->runpath != NULL) {
+        runpath_offset = scratch.n;
+        string_table_store(&scratch, node->runpath);
+        size_t curr_buf_size = scratch.n;
+        if (interpolate_variables(s, &scratch, runpath_offset, origin))
+            runpath_offset = curr_buf_size;
+    }
+
+    // Our rpaths come before those of our parents.
+    struct string_table_t child_rpaths = {NULL, 0, 0};
+    if (rpath_offset != SIZE_MAX)
+        path_list_append(&child_rpaths, scratch.arr + rpath_offset);
+    path_list_append(&child_rpaths, rpaths);
+    string_table_store(&child_rpaths, "");
+
+    struct string_table_t search_paths = {NULL, 0, 0};
+    if (runpath_offset == SIZE_MAX)
+        path_list_append(&search_paths, child_rpaths.arr);
+    path_list_append(&search_paths, pool->ld_library_path);
+    if (runpath_offset != SIZE_MAX)
+        path_list_append(&search_paths, scratch.arr + runpath_offset);
+    string_table_store(&search_paths, "");
+
+    for (size_t i = 0; i < node->needed_n; ++i) {
+        char const *name = node->strings + node->needed[i];
+        if (verbosity == 0 && exclude_match(&s->exclude, name))
+            continue;
+        if (strchr(name, '/') == NULL)
+            pool_submit(pool, name, search_paths.arr, !node->no_def_lib,
+                        child_rpaths.arr, node->bits, verbosity);
+        else if (name[0] == '/')
+            pool_submit(pool, name, NULL, 0, child_rpaths.arr, node->bits,
+                        verbosity);
+    }
+
+    free(scratch.arr);
+    free(child_rpaths.arr);
+    free(search_paths.arr);
+}
+
+// Continue with the dependencies of the library `job` was looking for, once
+// it is located at `path`.
+static int pool_found(struct libtree_state_t *s, struct pool_job_t *job,
+                      char const *path) {
+    int code;
+    struct elf_node_t *node = node_cache_get(&s->node_cache, path, &code);
+    if (node == NULL || node->error != 0 ||
+        (job->bits != EITHER && node->bits != job->bits))
+        return 0;
+    if (pool_claim(s, node))
+        pool_prefetch(s, node, path, job->rpaths, job->verbosity);
+    return 1;
+}
+
+// Locate a library in the directories of the colon delimited list
+// `search_paths`, like resolve_in_paths does.
+static int pool_search(struct libtree_state_t *s, struct pool_job_t *job,
+                       char const *search_paths) {
+    char path[4096];
+    char *path_end = path + 4096;
+    size_t name_len = strlen(job->name);
+
+    for (char const *p = search_paths; p != NULL && *p != '\0';) {
+        if (*p == ':') {
+            ++p;
+            continue;
+        }
+
+        char *dest = path;
+        while (*p != '\0' && *p != ':' && dest != path_end)
+            *dest++ = *p++;
+
+        if (dest + name_len + 2 >= path_end)
+            continue;
+
+        if (*(dest - 1) != '/')
+            *dest++ = '/';
+        *dest = '\0';
+
+        if (!dir_may_contain(dir_index_get(&s->dir_index, path), job->name))
+            continue;
+
+        memcpy(dest, job->name, name_len + 1);
+        if (pool_found(s, job, path))
+            return 1;
+    }
+    return 0;
+}
+
+// Locate a library in ld.so.cache, like resolve_in_ld_cache does.
+static int pool_search_ld_cache(struct libtree_state_t *s,
+                                struct pool_job_t *job) {
+    struct ld_cache_t *c = &s->ld_cache;
+    size_t begin, end;
+    ld_cache_find(c, job->name, &begin, &end);
+    for (size_t j = begin; j < end; ++j) {
+        struct ld_cache_entry_t e;
+        ld_cache_entry(c, j, &e);
+        if (ld_cache_entry_matches(&e, job->bits) &&
+            pool_found(s, job, c->data + c->strings + e.value))
+            return 1;
+    }
+    return 0;
+}
+
+// Locate a library and continue with its dependencies.
+static void pool_run(struct libtree_state_t *s, struct pool_job_t *job) {
+    if (job->is_elf != NULL) {
+        int elf = has_elf_magic(job->name);
+        if (elf)
+            pool_found(s, job, job->name);
+        pthread_mutex_lock(&s->pool->lock);
+        *job->is_elf = elf ? 1 : 2;
+        --*job->pending;
+        pthread_cond_broadcast(&s->pool->crawled);
+        pthread_mutex_unlock(&s->pool->lock);
+        return;
+    }
+
+    if (job->search_paths == NULL) {
+        pool_found(s, job, job->name);
+        return;
+    }
+
+    if (pool_search(s, job, job->search_paths) || !job->defaults)
+        return;
+
+    int found = s->ld_cache.data != NULL
+                    ? pool_search_ld_cache(s, job)
+                    : pool_search(s, job, s->pool->ld_so_conf);
+    if (!found)
+        pool_search(s, job, s->pool->default_paths);
+}
+
+static void *pool_worker(void *arg) {
+    struct libtree_state_t *s = arg;
+    struct pool_t *pool = s->pool;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->head == NULL)
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        struct pool_job_t *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool_run(s, job);
+        pool_job_free(job);
+    }
+}
+
+// Start s->jobs - 1 threads next to the main thread.
+static void pool_start(struct libtree_state_t *s) {
+    s->pool = NULL;
+    if (s->jobs <= 1)
+        return;
+
+    struct pool_t *pool = calloc(1, sizeof(struct pool_t));
+    if (pool == NULL)
+        exit(1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->crawled, NULL);
+
+    char const *st = s->string_table.arr;
+    if (s->ld_library_path_offset != SIZE_MAX)
+        pool->ld_library_path = string_copy(st + s->ld_library_path_offset);
+    pool->ld_so_conf = string_copy(st + s->ld_so_conf_offset);
+    pool->default_paths = string_copy(st + s->default_paths_offset);
+
+    s->pool = pool;
+    for (size_t i = 0; i + 1 < s->jobs; ++i) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, s) != 0)
+            break;
+        ++pool->n_threads;
+    }
+}
+
+static void pool_stop(struct libtree_state_t *s) {
+    struct pool_t *pool = s->pool;
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->n_threads; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    while (pool->head != NULL) {
+        struct pool_job_t *job = pool->head;
+        pool->head = job->next;
+        pool_job_free(job);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_cond_destroy(&pool->crawled);
+    free(pool->ld_library_path);
+    free(pool->ld_so_conf);
+    free(pool->default_paths);
+    free(pool);
+    s->pool = NULL;
+}
+
+/**
+ * end of pool_t
+ */
+
+static struct frame_t *work_stack_push(struct work_stack_t *w) {
+    if (w->n == w->capacity) {
+        size_t capacity = w->capacity == 0 ? 16 : 2 * w->capacity;
+        struct frame_t *frames =
+            realloc(w->frames, capacity * sizeof(struct frame_t));
+        if (frames == NULL)
+            exit(1);
+        for (size_t i = w->capacity; i < capacity; ++i)
+            frames[i].path = NULL;
+        w->frames = frames;
+        w->capacity = capacity;
+    }
+    struct frame_t *f = &w->frames[w->n++];
+    if (f->path == NULL && (f->path = malloc(4096)) == NULL)
+        exit(1);
+    return f;
+}
+
+static void work_stack_append_needed(struct work_stack_t *w,
+                                     uint64_t const *needed, size_t n) {
+    // Nodes without needed libraries may have no array at all.
+    if (n == 0)
+        return;
+    if (w->needed_n + n > w->needed_capacity) {
+        size_t capacity = w->needed_capacity == 0 ? 64 : w->needed_capacity;
+        while (w->needed_n + n > capacity)
+            capacity *= 2;
+        uint64_t *p = realloc(w->needed, capacity * sizeof(uint64_t));
+        size_t *r = realloc(w->resolved, capacity * sizeof(size_t));
+        if (p == NULL || r == NULL)
+            exit(1);
+        w->needed = p;
+        w->resolved = r;
+        w->needed_capacity = capacity;
+    }
+    memcpy(w->needed + w->needed_n, needed, n * sizeof(uint64_t));
+    w->needed_n += n;
+}
+
+static void work_stack_free(struct work_stack_t *w) {
+    for (size_t i = 0; i < w->capacity; ++i)
+        free(w->frames[i].path);
+    free(w->frames);
+    free(w->needed);
+    free(w->resolved);
+}
+
+// Returns the parsed file at `path` if it can be used by a file of class
+// `parent_bits`, or NULL with the reason in `code`.
+static struct elf_node_t *open_node(struct libtree_state_t *s,
+                                    char const *path, elf_bits_t parent_bits,
+                                    int *code) {
+    struct elf_node_t *node = node_cache_get(&s->node_cache, path, code);
+    if (node == NULL)
+        return NULL;
+
+    *code = node->error;
+
+    // Make sure that we have matching bits with dependent
+    if (*code == 0 && parent_bits != EITHER && parent_bits != node->bits)
+        *code = ERR_INVALID_BITS;
+
+    return *code == 0 ? node : NULL;
+}
+
+// Print the file and, if its dependencies should be shown, push a frame for
+// it at `depth` on the work stack. `needed` is the entry of the parent that
+// was located as this file, or NULL for inputs. Returns non-zero if the file
+// can't be used.
+static int enter_file(struct libtree_state_t *s, char const *current_file,
+                      char const *needed, size_t depth,
+                      elf_bits_t parent_bits, struct found_t reason) {
+    uint64_t event =
+        trace_begin(&s->trace, TRACE_RECURSE, depth, current_file, NULL);
+    int code;
+    struct elf_node_t *node = open_node(s, current_file, parent_bits, &code);
+    if (node == NULL) {
+        trace_end(&s->trace, event, code);
+        return code;
+    }
+
+    // When crawling, remember who needs this file.
+    if (s->index != NULL) {
+        reverse_index_add_path(s->index, node, current_file);
+        if (depth > 0)
+            reverse_index_add_edge(s->index, s->stack.frames[depth - 1].node,
+                                   node, reason);
+    }
+    if (s->snapshot != NULL && depth > 0)
+        snapshot_add_edge(s->snapshot, s->stack.frames[depth - 1].file, needed,
+                          current_file, reason, depth);
+    if (s->bundle != NULL)
+        bundle_add(s->bundle, node, current_file, needed);
+    if (s->cost != NULL)
+        cost_add(s->cost, node, current_file);
+
+    // At this point we're going to store the file as "success"
+    int seen_before = node->visited == s->generation;
+    node->visited = s->generation;
+    s->stats.visited_skipped += seen_before;
+    if (s->scope.collecting && !seen_before)
+        symbol_scope_add(&s->scope, node, current_file);
+    if (depth > s->stats.max_depth)
+        s->stats.max_depth = depth;
+
+    // No dynamic section?
+    if (!node->has_dynamic) {
+        print_line(depth, current_file, NULL, BOLD_CYAN, REGULAR_CYAN, 1, reason,
+                   s);
+        print_notes(node, depth, current_file, needed, 0, 1, s);
+        trace_end(&s->trace, event, 0);
+        return 0;
+    }
+
+    int in_exclude_list =
+        node->soname != NULL && exclude_match(&s->exclude, node->soname);
+
+    // No need to recurse deeper when we aren't in very verbose mode. Files
+    // that are on the stack are never entered again, which breaks cycles.
+    int should_recurse =
+        !node->on_stack &&
+        ((!seen_before && !in_exclude_list) ||
+         (!seen_before && in_exclude_list && s->verbosity >= 2) ||
+         s->verbosity == 3);
+
+    // With --dag, recurse once per file and search context instead. Excluded
+    // libraries are still only entered from -vv on.
+    size_t chain = 0;
+    if (s->dag != NULL) {
+        struct dag_t *d = s->dag;
+        expand_search_paths(s, node, current_file);
+        chain = dag_chain(d, depth == 0 ? 0 : s->stack.frames[depth - 1].dag_chain,
+                          node->expanded_rpath);
+        char const *key = dag_key(d, node->index, chain,
+                                  node->expanded_runpath == SIZE_MAX
+                                      ? 0
+                                      : node->expanded_runpath + 1);
+        size_t *label = str_map_get(&d->labels, key);
+        should_recurse = !node->on_stack && label == NULL &&
+                         (!in_exclude_list || s->verbosity >= 2);
+        d->is_ref = label != NULL;
+        d->label = label != NULL ? *label : SIZE_MAX;
+        if (should_recurse) {
+            d->label = d->labels.n + 1;
+            str_map_put(&d->labels, key, d->label);
+        }
+    }
+
+    // Just print the library and return
+    if (!should_recurse) {
+        char *bold_color = in_exclude_list ? REGULAR_MAGENTA : REGULAR_BLUE;
+        char *regular_color = in_exclude_list ? REGULAR_MAGENTA : REGULAR_BLUE;
+        print_line(depth, current_file, node->soname, bold_color, regular_color,
+                   0, reason, s);
+        print_notes(node, depth, current_file, needed, 0, seen_before, s);
+        if (s->dag != NULL)
+            s->dag->label = SIZE_MAX;
+        trace_end(&s->trace, event, 0);
+        return 0;
+    }
+
+    // Let other threads locate our dependencies ahead of us.
+    if (s->pool != NULL && pool_claim(s, node)) {
+        struct string_table_t rpaths = {NULL, 0, 0};
+        for (size_t j = depth; j-- > 0;)
+            if (s->stack.frames[j].rpath != SIZE_MAX)
+                path_list_append(&rpaths, intern_get(&s->intern,
+                                                     s->stack.frames[j].rpath));
+        string_table_store(&rpaths, "");
+        pool_prefetch(s, node, current_file, rpaths.arr, s->verbosity);
+        free(rpaths.arr);
+    }
+
+    struct frame_t *f = work_stack_push(&s->stack);
+    f->node = node;
+    f->file = current_file;
+    f->event = event;
+    expand_search_paths(s, node, current_file);
+    f->rpath = node->expanded_rpath;
+    f->runpath = node->expanded_runpath;
+
+    size_t parent_chain = depth == 0 ? 0 : s->stack.frames[depth - 1].rpath_chain;
+    f->rpath_chain =
+        f->rpath == SIZE_MAX
+            ? parent_chain
+            : memo_rpath_chain(&s->memo, parent_chain, depth, f->rpath);
+    f->dag_chain = chain;
+
+    // Copy the offsets of needed libraries, since we reorder them.
+    f->needed_begin = s->stack.needed_n;
+    f->needed_not_found = node->needed_n;
+    work_stack_append_needed(&s->stack, node->needed, node->needed_n);
+
+    char *bold_color = in_exclude_list ? REGULAR_MAGENTA
+                                       : seen_before ? REGULAR_BLUE : BOLD_CYAN;
+    char *regular_color = in_exclude_list
+                              ? REGULAR_MAGENTA
+                              : seen_before ? REGULAR_BLUE : REGULAR_CYAN;
+
+    int highlight = !seen_before && !in_exclude_list;
+    print_line(depth, current_file, node->soname, bold_color, regular_color,
+               highlight, reason, s);
+    if (s->dag != NULL)
+        s->dag->label = SIZE_MAX;
+
+    // Skip common libraries if not verbose
+    if (s->verbosity == 0) {
+        uint64_t *needed = frame_needed(s, f);
+        for (size_t i = 0; i < f->needed_not_found;) {
+            // If in exclude list, swap to the back.
+            if (exclude_match(&s->exclude, node->strings + needed[i]))
+                frame_found(s, f, i);
+            else
+                ++i;
+        }
+    }
+
+    print_notes(node, depth, current_file, needed, f->needed_not_found > 0,
+                seen_before, s);
+
+    // First go over absolute paths in needed libs.
+    f->resolved = 0;
+    f->i = 0;
+    node->on_stack = 1;
+    return 0;
+}
+
+// Try needed libraries with a slash in their name. Returns 0 when a dependency
+// was pushed on the stack.
+static int direct_resume(struct libtree_state_t *s, size_t depth) {
+    struct frame_t *f = &s->stack.frames[depth];
+    struct elf_node_t *node = f->node;
+    while (f->i < f->needed_not_found) {
+        char const *name = node->strings + frame_needed(s, f)[f->i];
+        if (strchr(name, '/') == NULL) {
+            ++f->i;
+            continue;
+        }
+
+        // If it is not an absolute path, we bail, cause it then starts to
+        // depend on the current working directory, which is rather
+        // nonsensical. This is allowed by glibc though.
+        f->found_all_needed = f->needed_not_found <= 1;
+        char const *problem = NULL;
+        if (name[0] != '/')
+            problem = " is not absolute";
+        else if (enter_file(s, name, name, depth + 1, node->bits,
+                            (struct found_t){.how = DIRECT, .depth = 0}) != 0)
+            problem = " not found";
+        if (problem != NULL) {
+            print_direct_error(depth + 1, name, problem, s);
+            if (s->index != NULL)
+                reverse_index_add_missing(s->index, node, name);
+            if (s->snapshot != NULL)
+                snapshot_add_edge(s->snapshot, s->stack.frames[depth].file,
+                                  name, NULL, (struct found_t){0}, depth + 1);
+            if (s->bundle != NULL)
+                bundle_add_missing(s->bundle, s->stack.frames[depth].file,
+                                   name);
+        }
+
+        // Even if not officially found, we mark it as found, cause we
+        // handled the error here
+        f = &s->stack.frames[depth];
+        frame_found(s, f, f->i);
+        if (s->stack.n > depth + 1)
+            return 0;
+    }
+    return 1;
+}
+
+// Locate the needed libraries of the frame at `depth` that are left, in the
+// order of the dynamic loader, using earlier results for the same search
+// context when possible. Then put them in the order the search finds them.
+static void frame_resolve(struct libtree_state_t *s, size_t depth) {
+    struct frame_t *f = &s->stack.frames[depth];
+    struct elf_node_t *node = f->node;
+    size_t *resolved = s->stack.resolved + f->needed_begin;
+    size_t context = memo_context(s, depth);
+
+    size_t unresolved = 0;
+    for (size_t i = 0; i < f->needed_not_found; ++i) {
+        resolved[i] = memo_get(&s->memo, context, node->bits,
+                               node->strings + frame_needed(s, f)[i]);
+        if (resolved[i] == SIZE_MAX)
+            ++unresolved;
+        else
+            ++s->stats.memo_hits;
+    }
+
+    size_t position = 0;
+
+    // Consider rpaths only when runpath is empty. We have a stack of rpaths,
+    // try them all, starting with one set at this lib, then the parents.
+    if (node->runpath == NULL) {
+        for (size_t j = depth + 1; j-- > 0 && unresolved;) {
+            size_t rpath = s->stack.frames[j].rpath;
+            if (rpath == SIZE_MAX)
+                continue;
+            resolve_in_paths(s, depth, (struct found_t){.how = RPATH, .depth = j},
+                             intern_get(&s->intern, rpath), context, &position,
+                             &unresolved);
+        }
+    }
+
+    // Then try LD_LIBRARY_PATH, if we have it.
+    if (unresolved && s->ld_library_path_offset != SIZE_MAX)
+        resolve_in_paths(s, depth,
+                         (struct found_t){.how = LD_LIBRARY_PATH, .depth = 0},
+                         s->string_table.arr + s->ld_library_path_offset,
+                         context, &position, &unresolved);
+
+    // Then consider runpaths
+    if (unresolved && node->runpath != NULL)
+        resolve_in_paths(s, depth, (struct found_t){.how = RUNPATH, .depth = 0},
+                         intern_get(&s->intern, f->runpath), context,
+                         &position, &unresolved);
+
+    // Check ld.so.cache, or ld.so.conf paths when there is no cache
+    if (unresolved && !node->no_def_lib && s->ld_cache.data != NULL)
+        resolve_in_ld_cache(s, depth,
+                            (struct found_t){.how = LD_SO_CONF, .depth = 0},
+                            context, &position, &unresolved);
+    else if (unresolved && !node->no_def_lib)
+        resolve_in_paths(s, depth,
+                         (struct found_t){.how = LD_SO_CONF, .depth = 0},
+                         s->string_table.arr + s->ld_so_conf_offset, context,
+                         &position, &unresolved);
+
+    // Then consider standard paths
+    if (unresolved && !node->no_def_lib)
+        resolve_in_paths(s, depth, (struct found_t){.how = DEFAULT, .depth = 0},
+                         s->string_table.arr + s->default_paths_offset,
+                         context, &position, &unresolved);
+
+    struct memo_entry_t not_found = {.position = SIZE_MAX};
+    for (size_t i = 0; i < f->needed_not_found && unresolved; ++i) {
+        if (resolved[i] != SIZE_MAX)
+            continue;
+        resolved[i] = memo_put(&s->memo, context, node->bits,
+                               node->strings + frame_needed(s, f)[i],
+                               not_found, NULL);
+        --unresolved;
+    }
+
+    // The search goes directory by directory, and within a directory over the
+    // libraries left, which are swapped to the back when found. Do the same
+    // swaps, so that the tree is printed in the same order.
+    f->next = f->needed_not_found;
+    size_t last = 0;
+    while (1) {
+        size_t next = SIZE_MAX;
+        for (size_t i = 0; i < f->needed_not_found; ++i) {
+            size_t p = s->memo.entries[resolved[i]].position;
+            if (p > last && p < next)
+                next = p;
+        }
+        if (next == SIZE_MAX)
+            break;
+        for (size_t i = 0; i < f->needed_not_found;) {
+            if (s->memo.entries[resolved[i]].position == next)
+                frame_found(s, f, i);
+            else
+                ++i;
+        }
+        last = next;
+    }
+    f->resolved = 1;
+}
+
+// Enter the located libraries of the frame at `depth` in the order they were
+// found. Returns 0 when a dependency was pushed on the stack.
+static int replay_resume(struct libtree_state_t *s, size_t depth) {
+    struct frame_t *f = &s->stack.frames[depth];
+    while (f->next > f->needed_not_found) {
+        size_t k = --f->next;
+        struct memo_entry_t *e =
+            &s->memo.entries[s->stack.resolved[f->needed_begin + k]];
+        struct found_t reason = {.how = e->how, .depth = e->rpath_depth};
+
+        // It was found when it was one of k + 1 libraries left.
+        f->found_all_needed = k == 0;
+
+        // Dependencies refer to the path as their parent, so it must stay put.
+        strcpy(f->path, s->memo.paths.arr + e->path);
+        enter_file(s, f->path, f->node->strings + frame_needed(s, f)[k],
+                   depth + 1, f->node->bits, reason);
+        if (s->stack.n > depth + 1)
+            return 0;
+        f = &s->stack.frames[depth];
+    }
+    return 1;
+}
+
+// Summarize the needed libraries that could not be found, and pop the frame.
+static void frame_finish(struct libtree_state_t *s) {
+    size_t depth = s->stack.n - 1;
+    struct frame_t *f = &s->stack.frames[depth];
+    struct elf_node_t *node = f->node;
+
+    if (f->needed_not_found && !s->quiet) {
+        uint64_t start = stats_clock(s);
+        print_error(depth, f->needed_not_found, node->strings,
+                    frame_needed(s, f),
+                    node->runpath == NULL ? NULL
+                                          : intern_get(&s->intern, f->runpath),
+                    s, node->no_def_lib);
+        stats_add_time(s, &s->stats.output_ns, start);
+    }
+    if (s->index != NULL)
+        for (size_t i = 0; i < f->needed_not_found; ++i)
+            reverse_index_add_missing(s->index, node,
+                                      node->strings + frame_needed(s, f)[i]);
+    if (s->snapshot != NULL) {
+        for (size_t i = 0; i < f->needed_not_found; ++i)
+            snapshot_add_edge(s->snapshot, f->file,
+                              node->strings + frame_needed(s, f)[i], NULL,
+                              (struct found_t){0}, depth + 1);
+        snapshot_add_stack(s->snapshot, s, depth);
+    }
+    if (s->bundle != NULL)
+        for (size_t i = 0; i < f->needed_not_found; ++i)
+            bundle_add_missing(s->bundle, f->file,
+                               node->strings + frame_needed(s, f)[i]);
+
+    s->stack.needed_n = f->needed_begin;
+    node->on_stack = 0;
+    trace_end(&s->trace, f->event, 0);
+    --s->stack.n;
+}
+
+// Continue locating the dependencies of the frame on top of the stack, until
+// one is pushed or the frame is done.
+static void frame_resume(struct libtree_state_t *s) {
+    size_t depth = s->stack.n - 1;
+    if (!s->stack.frames[depth].resolved) {
+        if (!direct_resume(s, depth))
+            return;
+        frame_resolve(s, depth);
+    }
+    if (replay_resume(s, depth))
+        frame_finish(s);
+}
+
+// Print the dependency tree of `file`. Instead of recursion, files whose
+// dependencies are being located live on a work stack.
+static int traverse(char const *file, struct libtree_state_t *s) {
+    // Labels refer to subtrees of the same tree.
+    if (s->dag != NULL) {
+        dag_free(s->dag);
+        dag_init(s->dag);
+    }
+    int code = enter_file(s, file, NULL, 0, EITHER,
+                          (struct found_t){.how = INPUT, .depth = 0});
+    while (s->stack.n > 0)
+        frame_resume(s);
+    return code;
+}
+
+/**
+ * crawl
+ */
+
+// Number of files that are checked for ELF magic at once.
+#define CRAWL_CHUNK 1024
+
+// Regular files found while walking, which the pool checks for ELF magic.
+struct crawl_chunk_t {
+    struct string_table_t paths;
+    size_t offsets[CRAWL_CHUNK];
+    // 1 for ELF files, 2 for other files, 0 when not checked yet.
+    char is_elf[CRAWL_CHUNK];
+    size_t n;
+    size_t pending;
+};
+
+struct crawl_t {
+    // Directories that are left to walk, deepest last.
+    struct string_table_t dirs;
+    size_t *dir_offsets;
+    size_t dirs_n;
+    size_t dirs_capacity;
+    // Only directories on the same device as the root are walked.
+    dev_t dev;
+    // While the pool checks one chunk, the other one is filled.
+    struct crawl_chunk_t chunks[2];
+    int filling;
+};
+
+static void crawl_push_dir(struct crawl_t *c, char const *path) {
+    if (c->dirs_n == c->dirs_capacity) {
+        c->dirs_capacity = c->dirs_capacity == 0 ? 64 : 2 * c->dirs_capacity;
+        c->dir_offsets =
+            realloc(c->dir_offsets, c->dirs_capacity * sizeof(size_t));
+        if (c->dir_offsets == NULL)
+            exit(1);
+    }
+    c->dir_offsets[c->dirs_n++] = c->dirs.n;
+    string_table_store(&c->dirs, path);
+}
+
+// Locate the dependencies of the ELF files in a chunk that was submitted to
+// the pool, in the order they were found.
+static void crawl_process(struct libtree_state_t *s, struct crawl_chunk_t *k) {
+    if (s->pool != NULL) {
+        pthread_mutex_lock(&s->pool->lock);
+        while (k->pending > 0)
+            pthread_cond_wait(&s->pool->crawled, &s->pool->lock);
+        pthread_mutex_unlock(&s->pool->lock);
+    }
+    for (size_t i = 0; i < k->n; ++i) {
+        char const *path = k->paths.arr + k->offsets[i];
+        int elf = s->pool != NULL ? k->is_elf[i] == 1 : has_elf_magic(path);
+        if (elf)
+            traverse(path, s);
+    }
+    k->n = 0;
+    k->paths.n = 0;
+}
+
+// Hand the full chunk to the pool, and process the previous one meanwhile.
+static void crawl_flush(struct libtree_state_t *s, struct crawl_t *c) {
+    struct crawl_chunk_t *k = &c->chunks[c->filling];
+    if (s->pool != NULL)
+        for (size_t i = 0; i < k->n; ++i)
+            pool_submit_crawl(s->pool, k->paths.arr + k->offsets[i],
+                              &k->is_elf[i], &k->pending, s->verbosity);
+    c->filling = !c->filling;
+    crawl_process(s, &c->chunks[c->filling]);
+}
+
+static void crawl_add_file(struct libtree_state_t *s, struct crawl_t *c,
+                           char const *path) {
+    struct crawl_chunk_t *k = &c->chunks[c->filling];
+    k->offsets[k->n] = k->paths.n;
+    k->is_elf[k->n] = 0;
+    ++k->n;
+    string_table_store(&k->paths, path);
+    if (k->n == CRAWL_CHUNK)
+        crawl_flush(s, c);
+}
+
+static int compare_names(void const *a, void const *b) {
+    return strcmp(*(char const *const *)a, *(char const *const *)b);
+}
+
+// Add the regular files in `dir` in sorted order, and push its subdirectories
+// such that they are walked in sorted order too. Symlinks are not followed.
+static void crawl_dir(struct libtree_state_t *s, struct crawl_t *c,
+                      char const *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+
+    struct string_table_t names = {NULL, 0, 0};
+    size_t *offsets = NULL;
+    size_t n = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (n == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            offsets = realloc(offsets, capacity * sizeof(size_t));
+            if (offsets == NULL)
+                exit(1);
+        }
+        offsets[n++] = names.n;
+        string_table_store(&names, entry->d_name);
+    }
+
+    char const **sorted = malloc(n * sizeof(char const *) + 1);
+    char *is_dir = malloc(n + 1);
+    if (sorted == NULL || is_dir == NULL)
+        exit(1);
+    for (size_t i = 0; i < n; ++i)
+        sorted[i] = names.arr + offsets[i];
+    qsort(sorted, n, sizeof(char const *), compare_names);
+
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] == '/')
+        --dir_len;
+    char path[4096];
+    for (size_t i = 0; i < n; ++i) {
+        is_dir[i] = 0;
+        struct stat st;
+        size_t len = strlen(sorted[i]);
+        if (dir_len + 1 + len >= sizeof(path) ||
+            fstatat(dirfd(d), sorted[i], &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, sorted[i], len + 1);
+        if (S_ISREG(st.st_mode))
+            crawl_add_file(s, c, path);
+        else if (S_ISDIR(st.st_mode) && st.st_dev == c->dev)
+            is_dir[i] = 1;
+    }
+
+    // Last pushed is walked first.
+    for (size_t i = n; i-- > 0;) {
+        if (!is_dir[i])
+            continue;
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        strcpy(path + dir_len + 1, sorted[i]);
+        crawl_push_dir(c, path);
+    }
+
+    closedir(d);
+    free(is_dir);
+    free(sorted);
+    free(offsets);
+    free(names.arr);
+}
+
+// Walk `root` depth first, and locate the dependencies of all ELF files in it.
+static void crawl(struct libtree_state_t *s, struct crawl_t *c,
+                  char const *root) {
+    struct stat st;
+    if (stat(root, &st) != 0)
+        return;
+    if (!S_ISDIR(st.st_mode)) {
+        crawl_add_file(s, c, root);
+        return;
+    }
+    c->dev = st.st_dev;
+    crawl_push_dir(c, root);
+    char path[4096];
+    while (c->dirs_n > 0) {
+        size_t offset = c->dir_offsets[--c->dirs_n];
+        strcpy(path, c->dirs.arr + offset);
+        c->dirs.n = offset;
+        crawl_dir(s, c, path);
+    }
+}
+
+// Whether the file at `path` is the library `query`: the same file when the
+// query has a slash, and otherwise one with that soname or file name.
+static int dependents_match(struct elf_node_t *node, char const *path,
+                            char const *query, struct stat const *st) {
+    if (strchr(query, '/') != NULL)
+        return st != NULL && node->st_dev == st->st_dev &&
+               node->st_ino == st->st_ino;
+    if (node->soname != NULL && strcmp(node->soname, query) == 0)
+        return 1;
+    char const *slash = strrchr(path, '/');
+    return strcmp(slash == NULL ? path : slash + 1, query) == 0;
+}
+
+// Print the file at `path` in the inverted tree, which needs the file
+// `needed` printed at depth - 1, located for `reason`. The library at the root
+// has no `needed`.
+static void print_dependent(size_t depth, char const *path,
+                            char const *needed, int seen_before,
+                            struct found_t reason, struct libtree_state_t *s) {
+    if (!s->json) {
+        print_tree_line(depth, path, NULL,
+                        seen_before ? REGULAR_BLUE : BOLD_CYAN,
+                        seen_before ? REGULAR_BLUE : REGULAR_CYAN,
+                        !seen_before, reason, s);
+        return;
+    }
+    char num[24];
+    utoa(num, depth);
+    out_puts(s, "{\"depth\":");
+    out_puts(s, num);
+    out_puts(s, ",\"path\":");
+    out_json_string(s, path);
+    out_puts(s, ",\"needs\":");
+    out_json_string(s, needed);
+    out_puts(s, ",\"how\":");
+    if (needed == NULL)
+        out_puts(s, "null");
+    else
+        print_json_how(reason.how, s);
+    out_puts(s, "}\n");
+}
+
+// Print the inverted tree of the files that need the library `root`. Files
+// that were printed before in this tree are not expanded again.
+static void print_dependents(struct libtree_state_t *s,
+                             struct elf_node_t *root) {
+    struct reverse_index_t *r = s->index;
+    struct elf_node_t **nodes = s->node_cache.nodes;
+
+    ++s->generation;
+    root->visited = s->generation;
+    print_dependent(0, r->paths.arr + r->path[root->index], NULL, 0,
+                    (struct found_t){.how = INPUT, .depth = 0}, s);
+
+    // Frames hold the next edge to their file in `i`.
+    struct frame_t *f = work_stack_push(&s->stack);
+    f->node = root;
+    f->i = r->first[root->index];
+    while (s->stack.n > 0) {
+        size_t depth = s->stack.n;
+        f = &s->stack.frames[depth - 1];
+        if (f->i == SIZE_MAX) {
+            --s->stack.n;
+            continue;
+        }
+        struct rdep_edge_t const *e = &r->edges[f->i];
+        f->i = e->next;
+        f->found_all_needed = f->i == SIZE_MAX;
+
+        struct elf_node_t *parent = nodes[e->parent];
+        int seen_before = parent->visited == s->generation;
+        parent->visited = s->generation;
+        print_dependent(depth, r->paths.arr + r->path[e->parent],
+                        r->paths.arr + r->path[f->node->index], seen_before,
+                        (struct found_t){.how = e->how, .depth = depth}, s);
+        if (seen_before || r->first[e->parent] == SIZE_MAX)
+            continue;
+        f = work_stack_push(&s->stack);
+        f->node = parent;
+        f->i = r->first[e->parent];
+    }
+}
+
+// Collect the objects that `file` loads without printing anything, and look up
+// their undefined symbols, so that missing ones are printed in the tree.
+static void check_symbols(char const *file, struct libtree_state_t *s) {
+    struct symbol_scope_t *sc = &s->scope;
+
+    // Libraries skipped by default are loaded all the same.
+    int verbosity = s->verbosity;
+    s->verbosity = 2;
+    s->quiet = 1;
+    sc->collecting = 1;
+    sc->generation = ++s->generation;
+    sc->n = 0;
+    sc->paths.n = 0;
+    traverse(file, s);
+    s->verbosity = verbosity;
+    s->quiet = 0;
+    sc->collecting = 0;
+
+    symbol_scope_resolve(sc);
+    ++s->generation;
+}
+
+// Count every file that is loaded for the inputs in the --cost totals, also
+// the libraries that the tree hides, before the trees are printed.
+static void cost_collect(int pathc, char **pathv, struct libtree_state_t *s) {
+    struct dag_t *dag = s->dag;
+    int verbosity = s->verbosity;
+    s->dag = NULL;
+    s->verbosity = 2;
+    s->quiet = 1;
+    for (int i = 0; i < pathc; ++i) {
+        ++s->generation;
+        traverse(pathv[i], s);
+    }
+    s->dag = dag;
+    s->verbosity = verbosity;
+    s->quiet = 0;
+    ++s->generation;
+}
+
+// Locate the dependencies of all ELF files in `pathv`, and print which of them
+// need the library `s->dependents`, directly or indirectly.
+static int crawl_dependents(int pathc, char **pathv,
+                            struct libtree_state_t *s) {
+    // Nothing is printed while crawling.
+    struct reverse_index_t index;
+    reverse_index_init(&index);
+    s->index = &index;
+    s->quiet = 1;
+
+    // Exclusions don't apply, every edge should be recorded once.
+    int verbosity = s->verbosity;
+    s->verbosity = 2;
+    struct crawl_t c;
+    memset(&c, 0, sizeof(c));
+    for (int i = 0; i < pathc; ++i)
+        crawl(s, &c, pathv[i]);
+    crawl_flush(s, &c);
+    crawl_process(s, &c.chunks[!c.filling]);
+    s->verbosity = verbosity;
+    s->quiet = 0;
+
+    struct stat st;
+    int has_stat = stat(s->dependents, &st) == 0;
+    int found = 0;
+    for (size_t i = 0; i < index.nodes_capacity; ++i) {
+        if (index.path[i] == SIZE_MAX)
+            continue;
+        struct elf_node_t *node = s->node_cache.nodes[i];
+        if (!dependents_match(node, index.paths.arr + index.path[i],
+                              s->dependents, has_stat ? &st : NULL))
+            continue;
+        found = 1;
+        print_dependents(s, node);
+    }
+
+    free(c.dirs.arr);
+    free(c.dir_offsets);
+    free(c.chunks[0].paths.arr);
+    free(c.chunks[1].paths.arr);
+    reverse_index_free(&index);
+    s->index = NULL;
+
+    if (!found) {
+        fputs("No crawled file is `", stderr);
+        fputs(s->dependents, stderr);
+        fputs("`\n", stderr);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * end of crawl
+ */
+
+static int parse_ld_config_file(struct string_table_t *st, char *path);
+
+static int ld_conf_globbing(struct string_table_t *st, char *pattern) {
+    glob_t result;
+    memset(&result, 0, sizeof(result));
+    int status = glob(pattern, 0, NULL, &result);
+
+    // Handle errors (no result is not an error...)
+    switch (status) {
+    case GLOB_NOSPACE:
+    case GLOB_ABORTED:
+        globfree(&result);
+        return 1;
+    case GLOB_NOMATCH:
+        globfree(&result);
+        return 0;
+    }
+
+    // Otherwise parse the files we've found!
+    int code = 0;
+    for (size_t i = 0; i < result.gl_pathc; ++i)
+        code |= parse_ld_config_file(st, result.gl_pathv[i]);
+
+    globfree(&result);
+    return code;
+}
+
+static int parse_ld_config_file(struct string_table_t *st, char *path) {
+    FILE *fptr = fopen(path, "r");
+
+    if (fptr == NULL)
+        return 1;
+
+    char c = '0';
+    char line[4096];
+
+    while (c != EOF) {
+        size_t line_len = 0;
+        while ((c = getc(fptr)) != '\n' && c != EOF) {
+            if (line_len < 4095) {
+                line[line_len++] = c;
+            }
+        }
+
+        line[line_len] = '\0';
+
+        char *begin = line;
+        char *end = line + line_len;
+        // Remove leading whitespace
+        for (; isspace(*begin); ++begin) {
+        }
+
+        // Remove trailing comments
+        char *comment = strchr(begin, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        // Remove trailing whitespace
+        // although, whitespace is technically allowed in paths :think:
+        while (end != begin)
+            if (!isspace(*--end))
+                break;
+
+        // Skip empty lines
+        if (begin == end)
+            continue;
+
+        // Put back the end of the string
+        end[1] = '\0';
+
+        // 'include ': glob whatever follows.
+        if (strncmp(begin, "include", 7) == 0 && isspace(begin[7])) {
+            begin += 8;
+            // Remove more whitespace.
+            for (; isspace(*begin); ++begin) {
+            }
+
+            // String can't be empty as it was trimmed and
+            // still had whitespace next to include.
+
+            // TODO: check if relative globbing to the
+            // current file is supported or not.
+            // We do *not* support it right now.
+            if (*begin != '/')
+                continue;
+
+            ld_conf_globbing(st, begin);
+        } else {
+            // Copy over and replace trailing \0 with :.
+            string_table_store(st, begin);
+            st->arr[st->n - 1] = ':';
+        }
+    }
+
+    fclose(fptr);
+
+    return 0;
+}
+
+static void parse_ld_so_conf(struct libtree_state_t *s) {
+    struct string_table_t *st = &s->string_table;
+    s->ld_so_conf_offset = st->n;
+
+    // Linux / glibc
+    uint64_t event =
+        trace_begin(&s->trace, TRACE_LD_SO_CONF, 0, "/etc/ld.so.conf", NULL);
+    trace_end(&s->trace, event, parse_ld_config_file(st, "/etc/ld.so.conf"));
+
+    // FreeBSD
+    event = trace_begin(&s->trace, TRACE_LD_SO_CONF, 0, "/etc/ld-elf.so.conf",
+                        NULL);
+    trace_end(&s->trace, event,
+              parse_ld_config_file(st, "/etc/ld-elf.so.conf"));
+
+    // Replace the last semicolon with a '\0'
+    // if we have a nonzero number of paths.
+    if (st->n > s->ld_so_conf_offset) {
+        st->arr[st->n - 1] = '\0';
+    } else {
+        string_table_store(st, "");
+    }
+}
+
+static void parse_ld_library_path(struct libtree_state_t *s) {
+    s->ld_library_path_offset = SIZE_MAX;
+    char const *val = s->ld_library_path;
+
+    // not set, so nothing to do.
+    if (val == NULL)
+        return;
+
+    s->ld_library_path_offset = s->string_table.n;
+
+    // otherwise, we just copy it over and replace ; with :
+    string_table_store(&s->string_table, val);
+
+    // replace ; with :
+    char *search = s->string_table.arr + s->ld_library_path_offset;
+    while ((search = strchr(search, ';')) != NULL)
+        *search++ = ':';
+}
+
+static void set_default_paths(struct libtree_state_t *s) {
+    s->default_paths_offset = s->string_table.n;
+    // TODO: how to retrieve this list properly at runtime?
+    string_table_store(&s->string_table, "/lib:/lib64:/usr/lib:/usr/lib64");
 }
 
-static int visited_files_contains(struct visited_file_array_t *files,
-                                  struct stat *needle) {
-    for (size_t i = 0; i < files->n; ++i) {
-        struct visited_file_t *f = &files->arr[i];
-        if (f->st_dev == needle->st_dev && f->st_ino == needle->st_ino)
-            return 1;
-    }
+// Set the options shared by the command line tool and the library to their
+// defaults. Returns non-zero when the system can't be identified.
+static int libtree_state_defaults(struct libtree_state_t *s) {
+    memset(s, 0, sizeof(*s));
+    s->jobs = 1;
+    s->ld_library_path = getenv("LD_LIBRARY_PATH");
+
+    if (uname(&s->uname) != 0)
+        return 1;
+
+    // Technically this should be AT_PLATFORM, but
+    // (a) the feature is rarely used
+    // (b) it's almost always the same
+    s->PLATFORM = s->uname.machine;
+    s->OSNAME = s->uname.sysname;
+    s->OSREL = s->uname.release;
+
+    // TODO: how to find this value at runtime?
+    s->LIB = "lib";
     return 0;
 }
 
-static void visited_files_append(struct visited_file_array_t *files,
-                                 struct stat *new) {
-    if (files->n == files->capacity) {
-        files->capacity *= 2;
-        files->arr = realloc(files->arr, files->capacity);
-        if (files->arr == NULL)
-            exit(1);
-    }
-    files->arr[files->n].st_dev = new->st_dev;
-    files->arr[files->n].st_ino = new->st_ino;
-    ++files->n;
+static void libtree_state_init(struct libtree_state_t *s) {
+    s->string_table.n = 0;
+    s->string_table.capacity = 1024;
+    s->string_table.arr = malloc(s->string_table.capacity);
+    node_cache_init(&s->node_cache);
+    dir_index_init(&s->dir_index);
+    ld_cache_init(&s->ld_cache);
+    out_init(&s->out, STDOUT_FILENO);
+    s->trace.events = NULL;
+    if (s->trace_file != NULL)
+        trace_init(&s->trace);
+    s->stack = (struct work_stack_t){NULL, 0, 0, NULL, NULL, 0, 0};
+    memo_init(&s->memo);
+    intern_init(&s->intern, 1);
+    memset(&s->scope, 0, sizeof(s->scope));
 }
 
-static int recurse(char *current_file, size_t depth, struct libtree_state_t *s,
-                   elf_bits_t parent_bits, struct found_t reason) {
-    FILE *fptr = fopen(current_file, "rb");
-    if (fptr == NULL)
-        return 1;
+static void libtree_state_free(struct libtree_state_t *s) {
+    free(s->string_table.arr);
+    node_cache_free(&s->node_cache);
+    dir_index_free(&s->dir_index);
+    ld_cache_free(&s->ld_cache);
+    out_free(&s->out);
+    trace_free(&s->trace);
+    work_stack_free(&s->stack);
+    memo_free(&s->memo);
+    intern_free(&s->intern);
+    symbol_scope_free(&s->scope);
+}
 
-    // When we're done recursing, we should give back the memory we've claimed.
-    size_t old_buf_size = s->string_table.n;
+// Read the search configuration, and open the caches. The state can then
+// traverse any number of files.
+static void libtree_state_open(struct libtree_state_t *s) {
+    // First collect standard paths
+    libtree_state_init(s);
+    exclude_compile(&s->exclude);
 
-    // Parse the header
-    char e_ident[16];
-    if (fread(&e_ident, 16, 1, fptr) != 1) {
-        fclose(fptr);
-        return ERR_INVALID_MAGIC;
-    }
+    uint64_t start = stats_clock(s);
+    parse_ld_so_conf(s);
+    if (!s->scan_ld_so_conf)
+        ld_cache_open(&s->ld_cache, "/etc/ld.so.cache");
+    parse_ld_library_path(s);
+    set_default_paths(s);
+    stats_add_time(s, &s->stats.config_ns, start);
 
-    // Find magic elfs
-    if (e_ident[0] != 0x7f || e_ident[1] != 'E' || e_ident[2] != 'L' ||
-        e_ident[3] != 'F') {
-        fclose(fptr);
-        return ERR_INVALID_MAGIC;
-    }
+    if (s->cache_file != NULL)
+        s->node_cache.disk = disk_cache_open(s->cache_file);
 
-    // Do at least *some* header validation
-    if (e_ident[4] != '\x01' && e_ident[4] != '\x02') {
-        fclose(fptr);
-        return ERR_INVALID_CLASS;
-    }
+    pool_start(s);
+    s->generation = 1;
+}
 
-    if (e_ident[5] != '\x01' && e_ident[5] != '\x02') {
-        fclose(fptr);
-        return ERR_INVALID_DATA;
-    }
+static void libtree_state_close(struct libtree_state_t *s) {
+    pool_stop(s);
+    if (s->node_cache.disk != NULL)
+        disk_cache_close(s->node_cache.disk);
+    libtree_state_free(s);
+}
 
-    elf_bits_t curr_bits = e_ident[4] == '\x02' ? BITS64 : BITS32;
-    int is_little_endian = e_ident[5] == '\x01';
+#ifdef LIBTREE_LIBRARY
 
-    // Make sure that we have matching bits with dependent
-    if (parent_bits != EITHER && parent_bits != curr_bits) {
-        fclose(fptr);
-        return ERR_INVALID_BITS;
-    }
+/**
+ * library API
+ */
 
-    // Make sure that the elf file has a the host's endianness
-    // Byte swapping is on the TODO list
-    if (is_little_endian ^ host_is_little_endian()) {
-        fclose(fptr);
-        return ERR_UNSUPPORTED_ELF_FILE;
+libtree_context_t *
+libtree_context_create(struct libtree_options_t const *options) {
+    struct libtree_options_t defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (options == NULL)
+        options = &defaults;
+    if (options->jobs > MAX_THREADS)
+        return NULL;
+
+    struct libtree_state_t *s = malloc(sizeof(struct libtree_state_t));
+    if (s == NULL)
+        exit(1);
+    if (libtree_state_defaults(s) != 0) {
+        free(s);
+        return NULL;
     }
+    if (options->platform != NULL)
+        s->PLATFORM = options->platform;
+    if (options->osname != NULL)
+        s->OSNAME = options->osname;
+    if (options->osrel != NULL)
+        s->OSREL = options->osrel;
+    if (options->lib != NULL)
+        s->LIB = options->lib;
+    if (options->ld_library_path != NULL)
+        s->ld_library_path = options->ld_library_path;
+    s->scan_ld_so_conf = options->scan_ld_so_conf;
+    s->jobs = options->jobs == 0 ? 1 : options->jobs;
+    s->cache_file = options->cache_file;
+
+    // Nothing is printed, and every edge is recorded once.
+    s->quiet = 1;
+    s->verbosity = 2;
+    libtree_state_open(s);
+    return s;
+}
 
-    // And get the type
-    union {
-        struct header_64_t h64;
-        struct header_32_t h32;
-    } header;
+void libtree_context_free(libtree_context_t *ctx) {
+    if (ctx == NULL)
+        return;
+    libtree_state_close(ctx);
+    exclude_free(&ctx->exclude);
+    free(ctx);
+}
 
-    // Read the (rest of the) elf header
-    if (curr_bits == BITS64) {
-        if (fread(&header.h64, sizeof(struct header_64_t), 1, fptr) != 1) {
-            fclose(fptr);
-            return ERR_INVALID_HEADER;
-        }
-        if (header.h64.e_type != ET_EXEC && header.h64.e_type != ET_DYN) {
-            fclose(fptr);
-            return ERR_NO_EXEC_OR_DYN;
-        }
-        if (fseek(fptr, header.h64.e_phoff, SEEK_SET) != 0) {
-            fclose(fptr);
-            return ERR_INVALID_PHOFF;
-        }
-    } else {
-        if (fread(&header.h32, sizeof(struct header_32_t), 1, fptr) != 1) {
-            fclose(fptr);
-            return ERR_INVALID_HEADER;
-        }
-        if (header.h32.e_type != ET_EXEC && header.h32.e_type != ET_DYN) {
-            fclose(fptr);
-            return ERR_NO_EXEC_OR_DYN;
-        }
-        if (fseek(fptr, header.h32.e_phoff, SEEK_SET) != 0) {
-            fclose(fptr);
-            return ERR_INVALID_PHOFF;
-        }
+static libtree_how_t libtree_how(struct libtree_state_t *s, how_t how) {
+    switch (how) {
+    case INPUT:
+        return LIBTREE_INPUT;
+    case DIRECT:
+        return LIBTREE_DIRECT;
+    case RPATH:
+        return LIBTREE_RPATH;
+    case LD_LIBRARY_PATH:
+        return LIBTREE_LD_LIBRARY_PATH;
+    case RUNPATH:
+        return LIBTREE_RUNPATH;
+    case LD_SO_CONF:
+        return s->ld_cache.data != NULL ? LIBTREE_LD_SO_CACHE
+                                        : LIBTREE_LD_SO_CONF;
+    default:
+        return LIBTREE_DEFAULT;
     }
+}
 
-    // Make sure it's an executable or library
-    union {
-        struct prog_64_t p64;
-        struct prog_32_t p32;
-    } prog;
-
-    // map vaddr to file offset (we don't mmap the file, but directly seek in
-    // the file which means that we have to translate vaddr to file offset)
-    struct small_vec_u64_t pt_load_offset;
-    struct small_vec_u64_t pt_load_vaddr;
-
-    small_vec_u64_init(&pt_load_offset);
-    small_vec_u64_init(&pt_load_vaddr);
-
-    // Read the program header.
-    uint64_t p_offset = MAX_OFFSET_T;
-    if (curr_bits == BITS64) {
-        for (uint64_t i = 0; i < header.h64.e_phnum; ++i) {
-            if (fread(&prog.p64, sizeof(struct prog_64_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                return ERR_INVALID_PROG_HEADER;
-            }
+// Copy the graph recorded in the reverse index, with indices in the node cache
+// replaced by indices in the graph.
+static struct libtree_graph_t *graph_create(struct libtree_state_t *s,
+                                            struct reverse_index_t *r,
+                                            char const *const *paths,
+                                            size_t n, int const *errors,
+                                            struct string_table_t *warnings) {
+    struct libtree_graph_t *g = calloc(1, sizeof(struct libtree_graph_t));
+    if (g == NULL)
+        exit(1);
+    g->inputs_n = n;
+    g->nodes_n = r->reached_n;
+    g->edges_n = r->n;
+    g->missing_n = r->missing_n;
+    for (size_t i = 0; i < warnings->n; ++i)
+        g->warnings_n += warnings->arr[i] == '\0';
+    g->inputs = malloc((n + 1) * sizeof(struct libtree_input_t));
+    g->nodes = malloc((g->nodes_n + 1) * sizeof(struct libtree_node_t));
+    g->edges = malloc((g->edges_n + 1) * sizeof(struct libtree_edge_t));
+    g->missing = malloc((g->missing_n + 1) * sizeof(struct libtree_missing_t));
+    g->warnings = malloc((g->warnings_n + 1) * sizeof(char const *));
+    size_t *offsets = malloc((g->nodes_n + 1) * 2 * sizeof(size_t));
+    size_t *input_offsets = malloc((n + 1) * sizeof(size_t));
+    if (g->inputs == NULL || g->nodes == NULL || g->edges == NULL ||
+        g->missing == NULL || g->warnings == NULL || offsets == NULL ||
+        input_offsets == NULL)
+        exit(1);
 
-            if (prog.p64.p_type == PT_LOAD) {
-                small_vec_u64_append(&pt_load_offset, prog.p64.p_offset);
-                small_vec_u64_append(&pt_load_vaddr, prog.p64.p_vaddr);
-            } else if (prog.p64.p_type == PT_DYNAMIC) {
-                p_offset = prog.p64.p_offset;
-            }
+    // The strings of the graph are appended to the paths of the index, and
+    // referenced by offset until they stay put.
+    struct string_table_t strings = r->paths;
+    r->paths = (struct string_table_t){NULL, 0, 0};
+    for (size_t i = 0; i < g->nodes_n; ++i) {
+        struct elf_node_t *node = s->node_cache.nodes[r->reached[i]];
+        g->nodes[i].bits = node->bits == BITS32 ? 32 : 64;
+        offsets[2 * i] = r->path[node->index];
+        offsets[2 * i + 1] = SIZE_MAX;
+        if (node->soname != NULL) {
+            offsets[2 * i + 1] = strings.n;
+            string_table_store(&strings, node->soname);
         }
-    } else {
-        for (uint32_t i = 0; i < header.h32.e_phnum; ++i) {
-            if (fread(&prog.p32, sizeof(struct prog_32_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                return ERR_INVALID_PROG_HEADER;
-            }
+        // From now on the path map holds the index in the graph.
+        r->path[node->index] = i;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        input_offsets[i] = strings.n;
+        string_table_store(&strings, paths[i]);
+        g->inputs[i].node = SIZE_MAX;
+        g->inputs[i].error = errors[i];
+        if (errors[i] != 0)
+            continue;
+        int code;
+        struct elf_node_t *node =
+            node_cache_get(&s->node_cache, paths[i], &code);
+        if (node != NULL)
+            g->inputs[i].node = r->path[node->index];
+    }
 
-            if (prog.p32.p_type == PT_LOAD) {
-                small_vec_u64_append(&pt_load_offset, prog.p32.p_offset);
-                small_vec_u64_append(&pt_load_vaddr, prog.p32.p_vaddr);
-            } else if (prog.p32.p_type == PT_DYNAMIC) {
-                p_offset = prog.p32.p_offset;
-            }
-        }
+    size_t warnings_offset = strings.n;
+    for (size_t i = 0; i < warnings->n; i += strlen(warnings->arr + i) + 1)
+        string_table_store(&strings, warnings->arr + i);
+
+    for (size_t i = 0; i < g->edges_n; ++i) {
+        struct rdep_edge_t *e = &r->edges[i];
+        g->edges[i] = (struct libtree_edge_t){
+            .parent = r->path[e->parent],
+            .child = r->path[e->child],
+            .how = libtree_how(s, e->how),
+            .rpath_depth = e->how == RPATH ? e->rpath_depth + 1 : 0};
     }
 
-    // At this point we're going to store the file as "success"
-    struct stat finfo;
-    if (stat(current_file, &finfo) != 0) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return ERR_CANT_STAT;
+    g->strings = strings.arr;
+    for (size_t i = 0; i < g->nodes_n; ++i) {
+        g->nodes[i].path = strings.arr + offsets[2 * i];
+        g->nodes[i].soname = offsets[2 * i + 1] == SIZE_MAX
+                                 ? NULL
+                                 : strings.arr + offsets[2 * i + 1];
+    }
+    for (size_t i = 0; i < n; ++i)
+        g->inputs[i].path = strings.arr + input_offsets[i];
+    for (size_t i = 0; i < g->missing_n; ++i) {
+        g->missing[i].parent = r->path[r->missing[i].parent];
+        g->missing[i].name = strings.arr + r->missing[i].name;
+    }
+    for (size_t i = 0; i < g->warnings_n; ++i) {
+        g->warnings[i] = strings.arr + warnings_offset;
+        warnings_offset += strlen(g->warnings[i]) + 1;
     }
 
-    int seen_before = visited_files_contains(&s->visited, &finfo);
+    free(offsets);
+    free(input_offsets);
+    return g;
+}
 
-    if (!seen_before)
-        visited_files_append(&s->visited, &finfo);
+struct libtree_graph_t *libtree_resolve(libtree_context_t *ctx,
+                                        char const *const *paths, size_t n) {
+    struct libtree_state_t *s = ctx;
+    int *errors = malloc((n + 1) * sizeof(int));
+    if (errors == NULL)
+        exit(1);
 
-    // No dynamic section?
-    if (p_offset == MAX_OFFSET_T) {
-        print_line(depth, current_file, BOLD_CYAN, REGULAR_CYAN, 1, reason, s);
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return 0;
-    }
+    // Inputs are independent of each other, so all can be prefetched.
+    if (s->pool != NULL)
+        for (size_t i = 0; i < n; ++i)
+            pool_submit(s->pool, paths[i], NULL, 0, "", EITHER,
+                        s->verbosity);
+
+    // Files visited by earlier calls are traversed again. Warnings are given
+    // once per context, in the graph of the call that ran into them.
+    struct reverse_index_t index;
+    reverse_index_init(&index);
+    s->index = &index;
+    struct string_table_t warnings = {NULL, 0, 0};
+    s->warnings = &warnings;
+    ++s->generation;
+    for (size_t i = 0; i < n; ++i)
+        errors[i] = traverse(paths[i], s);
+    s->index = NULL;
+    s->warnings = NULL;
+
+    struct libtree_graph_t *g =
+        graph_create(s, &index, paths, n, errors, &warnings);
+    reverse_index_free(&index);
+    free(warnings.arr);
+    free(errors);
+    return g;
+}
 
-    // I guess you always have to load at least a string
-    // table, so if there are not PT_LOAD sections, then
-    // it is an error.
-    if (pt_load_offset.n == 0) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return ERR_NO_PT_LOAD;
-    }
+void libtree_graph_free(struct libtree_graph_t *graph) {
+    if (graph == NULL)
+        return;
+    free(graph->inputs);
+    free(graph->nodes);
+    free(graph->edges);
+    free(graph->missing);
+    free(graph->warnings);
+    free(graph->strings);
+    free(graph);
+}
 
-    // Go to the dynamic section
-    if (fseek(fptr, p_offset, SEEK_SET) != 0) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        return ERR_INVALID_DYNAMIC_SECTION;
+char const *libtree_strerror(int error) {
+    switch (error) {
+    case 0:
+        return "Success";
+    case ERR_INVALID_MAGIC:
+        // Also returned when the file can't be opened.
+        return "Cannot open file, or not an ELF file";
+    case ERR_INVALID_CLASS:
+        return "Invalid ELF class";
+    case ERR_INVALID_DATA:
+        return "Invalid ELF data encoding";
+    case ERR_INVALID_BITS:
+        return "ELF class differs from the file that needs it";
+    case ERR_UNSUPPORTED_ELF_FILE:
+        return "Unsupported ELF file";
+    case ERR_NO_EXEC_OR_DYN:
+        return "Not an executable or shared library";
+    case ERR_CANT_STAT:
+        return "Cannot open file";
+    case ERR_NOT_FOUND:
+        return "Not found";
+    default:
+        return "Invalid ELF file";
     }
+}
 
-    // Shared libraries can disable searching in
-    // "default" search paths, aka ld.so.conf and
-    // /usr/lib etc. At least glibc respects this.
-    int no_def_lib = 0;
+/**
+ * end of library API
+ */
 
-    uint64_t strtab = MAX_OFFSET_T;
-    uint64_t rpath = MAX_OFFSET_T;
-    uint64_t runpath = MAX_OFFSET_T;
-    uint64_t soname = MAX_OFFSET_T;
+#else
 
-    // Offsets in strtab
-    struct small_vec_u64_t needed;
-    small_vec_u64_init(&needed);
-
-    for (int cont = 1; cont;) {
-        uint64_t d_tag;
-        uint64_t d_val;
-
-        if (curr_bits == BITS64) {
-            struct dyn_64_t dyn;
-            if (fread(&dyn, sizeof(struct dyn_64_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                small_vec_u64_free(&needed);
-                return ERR_INVALID_DYNAMIC_ARRAY_ENTRY;
-            }
-            d_tag = dyn.d_tag;
-            d_val = dyn.d_val;
+#define COST_TOP 10
 
-        } else {
-            struct dyn_32_t dyn;
-            if (fread(&dyn, sizeof(struct dyn_32_t), 1, fptr) != 1) {
-                fclose(fptr);
-                small_vec_u64_free(&pt_load_offset);
-                small_vec_u64_free(&pt_load_vaddr);
-                small_vec_u64_free(&needed);
-                return ERR_INVALID_DYNAMIC_ARRAY_ENTRY;
-            }
-            d_tag = dyn.d_tag;
-            d_val = dyn.d_val;
-        }
+static void print_files(struct libtree_state_t *s, char const *label,
+                        size_t n) {
+    out_puts(s, label);
+    print_number(s, n);
+    out_puts(s, n == 1 ? " file\n" : " files\n");
+}
 
-        // Store strtab / rpath / runpath / needed / soname info.
-        switch (d_tag) {
-        case DT_NULL:
-            cont = 0;
-            break;
-        case DT_STRTAB:
-            strtab = d_val;
-            break;
-        case DT_RPATH:
-            rpath = d_val;
-            break;
-        case DT_RUNPATH:
-            runpath = d_val;
-            break;
-        case DT_NEEDED:
-            small_vec_u64_append(&needed, d_val);
-            break;
-        case DT_SONAME:
-            soname = d_val;
-            break;
-        case DT_FLAGS_1:
-            no_def_lib |= (DT_1_NODEFLIB & d_val) == DT_1_NODEFLIB;
-            break;
+// Print the startup cost of all files that are loaded, including those hidden
+// in the trees, and the files that need the most symbol lookups.
+static void print_cost_totals(struct libtree_state_t *s) {
+    struct cost_t *c = s->cost;
+    if (c->n == 0)
+        return;
+    struct elf_cost_t total;
+    memset(&total, 0, sizeof(total));
+    size_t textrel = 0;
+    size_t bind_now = 0;
+    size_t no_gnu_hash = 0;
+    // Positions in c->nodes, by descending number of lookups.
+    size_t top[COST_TOP];
+    size_t top_n = 0;
+    for (size_t i = 0; i < c->n; ++i) {
+        struct elf_node_t const *node = s->node_cache.nodes[c->nodes[i]];
+        struct elf_cost_t const *cost = &node->cost;
+        total.relocs += cost->relocs;
+        total.relative += cost->relative;
+        total.plt_relocs += cost->plt_relocs;
+        total.plt_size += cost->plt_size;
+        textrel += (cost->flags & COST_TEXTREL) != 0;
+        bind_now += (cost->flags & COST_BIND_NOW) != 0;
+        no_gnu_hash += node->has_dynamic && !(cost->flags & COST_GNU_HASH);
+
+        size_t j = top_n < COST_TOP ? top_n++ : COST_TOP;
+        for (; j > 0; --j) {
+            struct elf_node_t const *other =
+                s->node_cache.nodes[c->nodes[top[j - 1]]];
+            if (cost_lookups(&other->cost) >= cost_lookups(cost))
+                break;
+            if (j < COST_TOP)
+                top[j] = top[j - 1];
         }
+        if (j < COST_TOP)
+            top[j] = i;
     }
 
-    if (strtab == MAX_OFFSET_T) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&pt_load_vaddr);
-        small_vec_u64_free(&needed);
-        return ERR_NO_STRTAB;
+    print_files(s, "\nStartup cost of ", c->n);
+    out_puts(s, "  Relocations:       ");
+    print_number(s, total.relocs);
+    out_puts(s, " (");
+    print_number(s, total.relative);
+    out_puts(s, " relative)\n  PLT relocations:   ");
+    print_number(s, total.plt_relocs);
+    out_puts(s, " in ");
+    print_number(s, total.plt_size);
+    out_puts(s, " bytes\n");
+    print_files(s, "  Text relocations:  ", textrel);
+    print_files(s, "  Bind now:          ", bind_now);
+    print_files(s, "  Without GNU hash:  ", no_gnu_hash);
+    out_puts(s, "Most symbol lookups:\n");
+    for (size_t j = 0; j < top_n; ++j) {
+        struct elf_node_t const *node = s->node_cache.nodes[c->nodes[top[j]]];
+        out_puts(s, "  ");
+        print_number(s, cost_lookups(&node->cost));
+        out_putc(s, ' ');
+        out_puts(s, c->paths.arr + c->path_offsets[top[j]]);
+        out_putc(s, '\n');
     }
+}
 
-    // Let's verify just to be sure that the offsets are
-    // ordered.
-    if (!is_ascending_order(pt_load_vaddr.p, pt_load_vaddr.n)) {
-        fclose(fptr);
-        small_vec_u64_free(&pt_load_vaddr);
-        small_vec_u64_free(&pt_load_offset);
-        small_vec_u64_free(&needed);
-        return ERR_VADDRS_NOT_ORDERED;
-    }
+static int print_tree(int pathc, char **pathv, struct libtree_state_t *s) {
+    libtree_state_open(s);
 
-    // Find the file offset corresponding to the strtab virtual address
-    size_t vaddr_idx = 0;
-    while (vaddr_idx + 1 != pt_load_vaddr.n &&
-           strtab >= pt_load_vaddr.p[vaddr_idx + 1]) {
-        ++vaddr_idx;
-    }
+    // Inputs are independent of each other, so all can be prefetched.
+    if (s->pool != NULL && s->dependents == NULL)
+        for (int i = 0; i < pathc; ++i)
+            pool_submit(s->pool, pathv[i], NULL, 0, "", EITHER,
+                        s->verbosity);
 
-    uint64_t strtab_offset =
-        pt_load_offset.p[vaddr_idx] + strtab - pt_load_vaddr.p[vaddr_idx];
+    int libtree_last_err = 0;
 
-    small_vec_u64_free(&pt_load_vaddr);
-    small_vec_u64_free(&pt_load_offset);
+    // Output happens during traversal, and is accounted for separately.
+    uint64_t start = stats_clock(s);
+    uint64_t output_ns = s->stats.output_ns;
+    if (s->dependents != NULL)
+        libtree_last_err = crawl_dependents(pathc, pathv, s);
+    else if (s->cost != NULL && !s->json)
+        cost_collect(pathc, pathv, s);
+    for (int i = 0; i < pathc && s->dependents == NULL; ++i) {
+        // The load scope differs per input, so every tree is shown in full.
+        if (s->check_symbols)
+            check_symbols(pathv[i], s);
+        int result = traverse(pathv[i], s);
+        if (result != 0)
+            libtree_last_err = result;
+        if (s->batch || s->check_symbols)
+            ++s->generation;
+    }
+    stats_add_time(s, &s->stats.traversal_ns, start);
+    s->stats.traversal_ns -= s->stats.output_ns - output_ns;
+
+    start = stats_clock(s);
+    if (s->cost != NULL && !s->json)
+        print_cost_totals(s);
+    out_flush(s);
+    stats_add_time(s, &s->stats.output_ns, start);
+
+    pool_stop(s);
+    if (s->node_cache.disk != NULL)
+        disk_cache_report(s->node_cache.disk);
+    if (s->stats.enabled)
+        stats_print(s);
+    if (s->trace_file != NULL && trace_write(s, s->trace_file) != 0) {
+        fputs("Could not write trace to `", stderr);
+        fputs(s->trace_file, stderr);
+        fputs("`\n", stderr);
+        libtree_last_err = 1;
+    }
+    libtree_state_close(s);
+    return libtree_last_err;
+}
 
-    // From this point on we actually copy strings from the ELF file into our
-    // own string buffer.
+/**
+ * watcher_t
+ */
 
-    // Copy the current soname
-    size_t soname_buf_offset = s->string_table.n;
-    if (soname != MAX_OFFSET_T) {
-        if (fseek(fptr, strtab_offset + soname, SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_SONAME;
-        }
-        string_table_copy_from_file(&s->string_table, fptr);
-    }
+#define WATCHER_MAX_CHANGED 64
+
+// Reports changes to the directories of the files and search paths that were
+// looked up, so that caches can be brought up to date.
+struct watcher_t {
+    int fd;
+    // Changes to ld.so.conf and ld.so.cache are seen through these.
+    int etc_wd;
+    int conf_d_wd;
+    // Maps watched directories to their watch descriptor.
+    struct str_map_t watched;
+    // The keys of the path maps of the caches up to these offsets have their
+    // directories watched.
+    size_t node_keys_n;
+    size_t dir_keys_n;
+    // Set when a directory changed, so caches must be reset, or when the
+    // configuration must be read again.
+    int stale;
+    int reload;
+    // Set when a directory could not be watched, so caches are always reset.
+    int unwatched;
+    // Watch descriptors of the directories whose entries changed, which are
+    // listed again. When there are too many, or directories appeared or went
+    // away, all are.
+    int changed[WATCHER_MAX_CHANGED];
+    size_t changed_n;
+    int relist_all;
+};
 
-    int in_exclude_list =
-        soname != MAX_OFFSET_T &&
-        is_in_exclude_list(s->string_table.arr + soname_buf_offset);
+static void watcher_init(struct watcher_t *w) {
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    w->etc_wd = w->conf_d_wd = -1;
+#ifdef __linux__
+    w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    str_map_init(&w->watched, 64);
+}
 
-    // No need to recurse deeper when we aren't in very verbose mode.
-    int should_recurse =
-        depth < MAX_RECURSION_DEPTH &&
-        ((!seen_before && !in_exclude_list) ||
-         (!seen_before && in_exclude_list && s->verbosity >= 2) ||
-         s->verbosity == 3);
+static void watcher_free(struct watcher_t *w) {
+    if (w->fd >= 0)
+        close(w->fd);
+    str_map_free(&w->watched);
+}
 
-    // Just print the library and return
-    if (!should_recurse) {
-        char *print_name = soname != MAX_OFFSET_T && !s->path
-                               ? s->string_table.arr + soname_buf_offset
-                               : current_file;
-        char *bold_color = in_exclude_list ? REGULAR_MAGENTA : REGULAR_BLUE;
-        char *regular_color = in_exclude_list ? REGULAR_MAGENTA : REGULAR_BLUE;
-        print_line(depth, print_name, bold_color, regular_color, 0, reason, s);
+static void watcher_add(struct watcher_t *w, char const *dir) {
+    if (*dir == '\0' || str_map_get(&w->watched, dir) != NULL)
+        return;
+#ifdef __linux__
+    if (w->fd < 0)
+        return;
+    int wd = inotify_add_watch(w->fd, dir,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB |
+                                   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    // Directories that don't exist can't change the tree, until they do.
+    if (wd < 0 && errno != ENOENT && errno != ENOTDIR && errno != EACCES)
+        w->unwatched = 1;
+    str_map_put(&w->watched, dir, wd < 0 ? SIZE_MAX : (size_t)wd);
+#endif
+}
 
-        s->string_table.n = old_buf_size;
-        fclose(fptr);
-        small_vec_u64_free(&needed);
-        return 0;
+// Watch the directory of the file at `path`.
+static void watcher_add_parent(struct watcher_t *w, char const *path) {
+    char *dir = string_copy(path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL)
+        watcher_add(w, ".");
+    else if (slash == dir)
+        watcher_add(w, "/");
+    else {
+        *slash = '\0';
+        watcher_add(w, dir);
     }
+    free(dir);
+}
 
-    // Store the ORIGIN string.
-    char origin[4096];
-    char *last_slash = strrchr(current_file, '/');
-    if (last_slash != NULL) {
-        // we're also copying the last /.
-        size_t bytes = last_slash - current_file + 1;
-        memcpy(origin, current_file, bytes);
-        origin[bytes + 1] = '\0';
-    } else {
-        // this only happens when the input is relative (e.g. in current dir)
-        memcpy(origin, "./", 3);
+// Watch the directories in a colon separated list.
+static void watcher_add_list(struct watcher_t *w, char const *list) {
+    char *dirs = string_copy(list);
+    char *dir = dirs;
+    for (char *p = dirs;; ++p) {
+        if (*p != ':' && *p != '\0')
+            continue;
+        int end = *p == '\0';
+        *p = '\0';
+        watcher_add(w, dir);
+        if (end)
+            break;
+        dir = p + 1;
     }
+    free(dirs);
+}
 
-    // Copy DT_PRATH
-    if (rpath == MAX_OFFSET_T) {
-        s->rpath_offsets[depth] = SIZE_MAX;
-    } else {
-        s->rpath_offsets[depth] = s->string_table.n;
-        if (fseek(fptr, strtab_offset + rpath, SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_RPATH;
-        }
-
-        string_table_copy_from_file(&s->string_table, fptr);
-
-        // We store the interpolated string right after the literal copy.
-        size_t curr_buf_size = s->string_table.n;
-        if (interpolate_variables(s, s->rpath_offsets[depth], origin))
-            s->rpath_offsets[depth] = curr_buf_size;
+// Watch the configuration files and directories, after the configuration was
+// read.
+static void watcher_configure(struct watcher_t *w, struct libtree_state_t *s) {
+    w->node_keys_n = 0;
+    w->dir_keys_n = 0;
+#ifdef __linux__
+    if (w->fd >= 0) {
+        uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                        IN_CLOSE_WRITE | IN_ATTRIB;
+        w->etc_wd = inotify_add_watch(w->fd, "/etc", mask);
+        w->conf_d_wd = inotify_add_watch(w->fd, "/etc/ld.so.conf.d", mask);
     }
+#endif
+    watcher_add_list(w, s->string_table.arr + s->ld_so_conf_offset);
+    watcher_add_list(w, s->string_table.arr + s->default_paths_offset);
+}
 
-    // Copy DT_RUNPATH
-    size_t runpath_buf_offset = s->string_table.n;
-    if (runpath != MAX_OFFSET_T) {
-        if (fseek(fptr, strtab_offset + runpath, SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_RUNPATH;
-        }
-
-        string_table_copy_from_file(&s->string_table, fptr);
-
-        // We store the interpolated string right after the literal copy.
-        size_t curr_buf_size = s->string_table.n;
-        if (interpolate_variables(s, runpath_buf_offset, origin))
-            runpath_buf_offset = curr_buf_size;
+// Watch the directories of the files and search paths that were looked up
+// since the last call.
+static void watcher_add_new(struct watcher_t *w, struct libtree_state_t *s) {
+    struct string_table_t *keys = &s->node_cache.paths.keys;
+    pthread_mutex_lock(&s->node_cache.lock);
+    while (w->node_keys_n < keys->n) {
+        char const *path = keys->arr + w->node_keys_n;
+        w->node_keys_n += strlen(path) + 1;
+        watcher_add_parent(w, path);
     }
+    pthread_mutex_unlock(&s->node_cache.lock);
+
+    keys = &s->dir_index.paths.keys;
+    pthread_mutex_lock(&s->dir_index.lock);
+    while (w->dir_keys_n < keys->n) {
+        char const *path = keys->arr + w->dir_keys_n;
+        w->dir_keys_n += strlen(path) + 1;
+        watcher_add(w, path);
+    }
+    pthread_mutex_unlock(&s->dir_index.lock);
+}
 
-    // Copy needed libraries.
-    struct small_vec_u64_t needed_buf_offsets;
-    small_vec_u64_init(&needed_buf_offsets);
-
-    for (size_t i = 0; i < needed.n; ++i) {
-        small_vec_u64_append(&needed_buf_offsets, s->string_table.n);
-        if (fseek(fptr, strtab_offset + needed.p[i], SEEK_SET) != 0) {
-            s->string_table.n = old_buf_size;
-            fclose(fptr);
-            small_vec_u64_free(&needed_buf_offsets);
-            small_vec_u64_free(&needed);
-            return ERR_INVALID_NEEDED;
+static void watcher_read_events(struct watcher_t *w) {
+    if (w->fd < 0 || w->unwatched) {
+        w->stale = 1;
+        w->relist_all = 1;
+        return;
+    }
+#ifdef __linux__
+    // Aligned for inotify_event.
+    uint64_t buf[512];
+    ssize_t n;
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = (char *)buf; p < (char *)buf + n;) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + e->len;
+            // Events were lost, so anything may have changed.
+            if (e->mask & IN_Q_OVERFLOW) {
+                w->reload = 1;
+            } else if (e->wd == w->conf_d_wd ||
+                       (e->wd == w->etc_wd && e->len > 0 &&
+                        (strcmp(e->name, "ld.so.conf") == 0 ||
+                         strcmp(e->name, "ld.so.cache") == 0 ||
+                         strcmp(e->name, "ld-elf.so.conf") == 0))) {
+                w->reload = 1;
+            } else if (e->wd != w->etc_wd) {
+                w->stale = 1;
+                // New or removed directories may be search paths.
+                if (e->mask & (IN_ISDIR | IN_DELETE_SELF | IN_MOVE_SELF |
+                               IN_IGNORED) ||
+                    w->changed_n == WATCHER_MAX_CHANGED)
+                    w->relist_all = 1;
+                else
+                    w->changed[w->changed_n++] = e->wd;
+            }
+            // The watch is gone, so watch the directory again when used.
+            if (e->mask & IN_IGNORED) {
+                str_map_free(&w->watched);
+                str_map_init(&w->watched, 64);
+            }
         }
-        string_table_copy_from_file(&s->string_table, fptr);
     }
+#endif
+}
 
-    fclose(fptr);
-
-    char *print_name = soname == MAX_OFFSET_T || s->path
-                           ? current_file
-                           : (s->string_table.arr + soname_buf_offset);
-
-    char *bold_color = in_exclude_list ? REGULAR_MAGENTA
-                                       : seen_before ? REGULAR_BLUE : BOLD_CYAN;
-    char *regular_color = in_exclude_list
-                              ? REGULAR_MAGENTA
-                              : seen_before ? REGULAR_BLUE : REGULAR_CYAN;
-
-    int highlight = !seen_before && !in_exclude_list;
-    print_line(depth, print_name, bold_color, regular_color, highlight, reason,
-               s);
-
-    // Finally start searching.
+// List the directories that changed again, or all of them.
+static void watcher_relist(struct watcher_t *w, struct libtree_state_t *s) {
+    char const *keys = w->watched.keys.arr;
+    for (size_t i = 0; i < w->watched.keys.n && !w->relist_all;
+         i += strlen(keys + i) + 1) {
+        size_t wd = *str_map_get(&w->watched, keys + i);
+        for (size_t j = 0; j < w->changed_n; ++j)
+            if (wd == (size_t)w->changed[j] &&
+                dir_index_relist(&s->dir_index, keys + i))
+                w->relist_all = 1;
+    }
+    if (w->relist_all) {
+        dir_index_free(&s->dir_index);
+        dir_index_init(&s->dir_index);
+        w->dir_keys_n = 0;
+    }
+}
 
-    size_t needed_not_found = needed_buf_offsets.n;
+// Bring the caches up to date with the changes seen since the last call.
+// Only files that changed are parsed again, and only directories that changed
+// are listed again. Returns 1 when the configuration was read again.
+static int watcher_refresh(struct watcher_t *w, struct libtree_state_t *s,
+                           size_t oldest) {
+    int reloaded = w->reload;
+    if (!w->stale && !w->reload)
+        return 0;
 
-    // Skip common libraries if not verbose
-    if (needed_not_found && s->verbosity == 0) {
-        for (size_t i = 0; i < needed_not_found;) {
-            // If in exclude list, swap to the back.
-            if (is_in_exclude_list(s->string_table.arr +
-                                   needed_buf_offsets.p[i])) {
-                size_t tmp = needed_buf_offsets.p[i];
-                needed_buf_offsets.p[i] =
-                    needed_buf_offsets.p[needed_not_found - 1];
-                needed_buf_offsets.p[--needed_not_found] = tmp;
-                continue;
-            } else {
-                ++i;
-            }
-        }
+    // The pool may be reading files into the caches.
+    pool_stop(s);
+    if (w->reload) {
+        libtree_state_close(s);
+        libtree_state_open(s);
+        watcher_configure(w, s);
+    } else {
+        node_cache_reset(&s->node_cache, oldest);
+        watcher_relist(w, s);
+        memo_free(&s->memo);
+        memo_init(&s->memo);
+        pool_start(s);
+        w->node_keys_n = 0;
     }
+    w->stale = 0;
+    w->reload = 0;
+    w->changed_n = 0;
+    w->relist_all = 0;
+    return reloaded;
+}
 
-    // First go over absolute paths in needed libs.
-    for (size_t i = 0; i < needed_not_found;) {
-        char *name = s->string_table.arr + needed_buf_offsets.p[i];
-        if (strchr(name, '/') != NULL) {
-            // If it is not an absolute path, we bail, cause it then starts to
-            // depend on the current working directory, which is rather
-            // nonsensical. This is allowed by glibc though.
-            s->found_all_needed[depth] = needed_not_found <= 1;
-            if (name[0] != '/') {
-                tree_preamble(s, depth + 1);
-                if (s->color)
-                    fputs(BOLD_RED, stdout);
-                fputs(name, stdout);
-                fputs(" is not absolute", stdout);
-                fputs(s->color ? CLEAR "\n" : "\n", stdout);
-            } else if (recurse(name, depth + 1, s, curr_bits,
-                               (struct found_t){.how = DIRECT, .depth = 0}) !=
-                       0) {
-                tree_preamble(s, depth + 1);
-                if (s->color)
-                    fputs(BOLD_RED, stdout);
-                fputs(name, stdout);
-                fputs(" not found", stdout);
-                fputs(s->color ? CLEAR "\n" : "\n", stdout);
-            }
+/**
+ * end of watcher_t
+ */
 
-            // Even if not officially found, we mark it as found, cause we
-            // handled the error here
-            size_t tmp = needed_buf_offsets.p[i];
-            needed_buf_offsets.p[i] =
-                needed_buf_offsets.p[needed_not_found - 1];
-            needed_buf_offsets.p[--needed_not_found] = tmp;
-        } else {
-            ++i;
-        }
-    }
+/**
+ * serve
+ */
 
-    // Consider rpaths only when runpath is empty
-    if (runpath == MAX_OFFSET_T) {
-        // We have a stack of rpaths, try them all, starting with one set at
-        // this lib, then the parents.
-        for (int j = depth; j >= 0 && needed_not_found; --j) {
-            if (s->rpath_offsets[j] == SIZE_MAX)
-                continue;
+// Nodes not visited in this many requests are dropped when caches are reset.
+#define SERVE_KEEP_GENERATIONS 4096
+#define SERVE_MAX_REQUEST 65536
+
+struct serve_t {
+    int listen_fd;
+    struct watcher_t watcher;
+    // Whether the last request had its own search configuration.
+    int had_overrides;
+    // The configuration of the server, which requests may override.
+    char const *PLATFORM;
+    char const *LIB;
+    char const *OSNAME;
+    char const *OSREL;
+    char const *ld_library_path;
+    int json;
+    size_t ld_library_path_offset;
+    size_t config_n;
+};
 
-            check_search_paths((struct found_t){.how = RPATH, .depth = j},
-                               s->rpath_offsets[j], &needed_not_found,
-                               &needed_buf_offsets, depth, s, curr_bits);
+// Returns a listening socket at `path`, or -1. A socket left behind by a
+// server that is no longer running is replaced.
+static int serve_listen(char const *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int other = errno == EADDRINUSE ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        int in_use = other < 0 || connect(other, (struct sockaddr *)&addr,
+                                          sizeof(addr)) == 0;
+        if (other >= 0)
+            close(other);
+        if (in_use || unlink(path) != 0 ||
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
         }
     }
-
-    // Then try LD_LIBRARY_PATH, if we have it.
-    if (needed_not_found && s->ld_library_path_offset != SIZE_MAX) {
-        check_search_paths((struct found_t){.how = LD_LIBRARY_PATH, .depth = 0},
-                           s->ld_library_path_offset, &needed_not_found,
-                           &needed_buf_offsets, depth, s, curr_bits);
-    }
-
-    // Then consider runpaths
-    if (needed_not_found && runpath != MAX_OFFSET_T) {
-        check_search_paths((struct found_t){.how = RUNPATH, .depth = 0},
-                           runpath_buf_offset, &needed_not_found,
-                           &needed_buf_offsets, depth, s, curr_bits);
+    if (listen(fd, 64) != 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    // Check ld.so.conf paths
-    if (!no_def_lib && needed_not_found) {
-        check_search_paths((struct found_t){.how = LD_SO_CONF, .depth = 0},
-                           s->ld_so_conf_offset, &needed_not_found,
-                           &needed_buf_offsets, depth, s, curr_bits);
-    }
+// Remember the configuration that requests may override.
+static void serve_configure(struct serve_t *v, struct libtree_state_t *s) {
+    v->ld_library_path_offset = s->ld_library_path_offset;
+    v->config_n = s->string_table.n;
+}
 
-    // Then consider standard paths
-    if (!no_def_lib && needed_not_found) {
-        check_search_paths((struct found_t){.how = DEFAULT, .depth = 0},
-                           s->default_paths_offset, &needed_not_found,
-                           &needed_buf_offsets, depth, s, curr_bits);
-    }
-
-    // Finally summarize those that could not be found.
-    if (needed_not_found) {
-        print_error(depth, needed_not_found, &needed_buf_offsets,
-                    runpath == MAX_OFFSET_T
-                        ? NULL
-                        : s->string_table.arr + runpath_buf_offset,
-                    s, no_def_lib);
-        s->string_table.n = old_buf_size;
-        small_vec_u64_free(&needed_buf_offsets);
-        small_vec_u64_free(&needed);
-        // return ERR_NOT_FOUND;
-        return 0;
+// Read a request up to an empty line or the end of input into `req`, with
+// lines null terminated. Returns the number of lines, or SIZE_MAX when the
+// request is too large or can't be read.
+static size_t serve_read_request(int fd, struct string_table_t *req) {
+    size_t lines = 0;
+    while (1) {
+        string_table_maybe_grow(req, 4096);
+        ssize_t n = read(fd, req->arr + req->n, req->capacity - req->n);
+        if (n < 0)
+            return SIZE_MAX;
+        if (n == 0)
+            break;
+        size_t end = req->n + n;
+        for (; req->n < end; ++req->n) {
+            if (req->arr[req->n] != '\n')
+                continue;
+            req->arr[req->n] = '\0';
+            if (req->n == 0 || req->arr[req->n - 1] == '\0')
+                return lines;
+            ++lines;
+        }
+        if (req->n > SERVE_MAX_REQUEST)
+            return SIZE_MAX;
     }
-
-    // Free memory in our string table
-    s->string_table.n = old_buf_size;
-    small_vec_u64_free(&needed_buf_offsets);
-    small_vec_u64_free(&needed);
-    return 0;
+    // A last line without a newline.
+    string_table_maybe_grow(req, 1);
+    if (req->n > 0 && req->arr[req->n - 1] != '\0')
+        ++lines;
+    req->arr[req->n++] = '\0';
+    return lines;
 }
 
-static int parse_ld_config_file(struct string_table_t *st, char *path);
+// Answer a request on `fd`: files, one per line, which may be preceded by
+// lines that override the search configuration.
+static void serve_request(struct serve_t *v, struct libtree_state_t *s,
+                          int fd) {
+    struct string_table_t req = {NULL, 0, 0};
+    size_t lines = serve_read_request(fd, &req);
+    if (lines == SIZE_MAX) {
+        char const *err = "error Could not read request\n";
+        write_all(fd, err, strlen(err));
+        free(req.arr);
+        return;
+    }
 
-static int ld_conf_globbing(struct string_table_t *st, char *pattern) {
-    glob_t result;
-    memset(&result, 0, sizeof(result));
-    int status = glob(pattern, 0, NULL, &result);
+    int overrides = 0;
+    char const *line = req.arr;
+    for (size_t i = 0; i < lines; ++i, line += strlen(line) + 1) {
+        char const *val = strchr(line, '=');
+        if (val == NULL)
+            break;
+        size_t len = val++ - line;
+        if (len == 15 && strncmp(line, "LD_LIBRARY_PATH", len) == 0)
+            s->ld_library_path = val;
+        else if (len == 8 && strncmp(line, "PLATFORM", len) == 0)
+            s->PLATFORM = val;
+        else if (len == 3 && strncmp(line, "LIB", len) == 0)
+            s->LIB = val;
+        else if (len == 6 && strncmp(line, "OSNAME", len) == 0)
+            s->OSNAME = val;
+        else if (len == 5 && strncmp(line, "OSREL", len) == 0)
+            s->OSREL = val;
+        else if (len == 6 && strncmp(line, "FORMAT", len) == 0) {
+            s->json = strcmp(val, "json") == 0;
+            continue;
+        } else
+            break;
+        overrides = 1;
+    }
 
-    // Handle errors (no result is not an error...)
-    switch (status) {
-    case GLOB_NOSPACE:
-    case GLOB_ABORTED:
-        globfree(&result);
-        return 1;
-    case GLOB_NOMATCH:
-        globfree(&result);
-        return 0;
+    // Search results and interpolated paths depend on the configuration.
+    if (overrides || v->had_overrides) {
+        memo_free(&s->memo);
+        memo_init(&s->memo);
+        intern_reset(&s->intern);
     }
+    v->had_overrides = overrides;
+    if (s->ld_library_path != v->ld_library_path)
+        parse_ld_library_path(s);
 
-    // Otherwise parse the files we've found!
+    s->out.fd = fd;
     int code = 0;
-    for (size_t i = 0; i < result.gl_pathc; ++i)
-        code |= parse_ld_config_file(st, result.gl_pathv[i]);
+    for (; line < req.arr + req.n && *line != '\0'; line += strlen(line) + 1) {
+        ++s->generation;
+        if (s->check_symbols)
+            check_symbols(line, s);
+        int result = traverse(line, s);
+        if (result != 0)
+            code = result;
+    }
 
-    globfree(&result);
-    return code;
+    char num[24];
+    utoa(num, code);
+    out_puts(s, s->json ? "{\"status\":" : "status ");
+    out_puts(s, num);
+    out_puts(s, s->json ? "}\n" : "\n");
+    out_flush(s);
+    s->out.fd = STDOUT_FILENO;
+
+    s->PLATFORM = v->PLATFORM;
+    s->LIB = v->LIB;
+    s->OSNAME = v->OSNAME;
+    s->OSREL = v->OSREL;
+    s->ld_library_path = v->ld_library_path;
+    s->ld_library_path_offset = v->ld_library_path_offset;
+    s->string_table.n = v->config_n;
+    s->json = v->json;
+    free(req.arr);
 }
 
-static int parse_ld_config_file(struct string_table_t *st, char *path) {
-    FILE *fptr = fopen(path, "r");
-
-    if (fptr == NULL)
+// Answer requests on the Unix socket `path` until killed, keeping the caches
+// warm in between. They are reset when inotify reports changes to any of the
+// directories involved.
+static int serve(struct libtree_state_t *s, char const *path) {
+    struct serve_t v;
+    memset(&v, 0, sizeof(v));
+    v.listen_fd = serve_listen(path);
+    if (v.listen_fd < 0) {
+        fputs("Could not listen on `", stderr);
+        fputs(path, stderr);
+        fputs("`\n", stderr);
         return 1;
+    }
 
-    char c = '0';
-    char line[4096];
+    // Clients that hang up should not take the server down.
+    signal(SIGPIPE, SIG_IGN);
 
-    while (c != EOF) {
-        size_t line_len = 0;
-        while ((c = getc(fptr)) != '\n' && c != EOF) {
-            if (line_len < 4095) {
-                line[line_len++] = c;
-            }
-        }
+    s->color = 0;
+    v.PLATFORM = s->PLATFORM;
+    v.LIB = s->LIB;
+    v.OSNAME = s->OSNAME;
+    v.OSREL = s->OSREL;
+    v.ld_library_path = s->ld_library_path;
+    v.json = s->json;
+    watcher_init(&v.watcher);
 
-        line[line_len] = '\0';
+    libtree_state_open(s);
+    serve_configure(&v, s);
+    watcher_configure(&v.watcher, s);
 
-        char *begin = line;
-        char *end = line + line_len;
-        // Remove leading whitespace
-        for (; isspace(*begin); ++begin) {
+    while (1) {
+        struct pollfd fds[2] = {{v.listen_fd, POLLIN, 0},
+                                {v.watcher.fd, POLLIN, 0}};
+        if (poll(fds, v.watcher.fd < 0 ? 1 : 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            watcher_read_events(&v.watcher);
+            continue;
         }
+        int fd = accept(v.listen_fd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        // Don't wait forever for clients that don't finish their request.
+        struct timeval timeout = {5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        // Changes made just before the request are queued by now.
+        watcher_read_events(&v.watcher);
+        size_t oldest = s->generation > SERVE_KEEP_GENERATIONS
+                            ? s->generation - SERVE_KEEP_GENERATIONS
+                            : 0;
+        if (watcher_refresh(&v.watcher, s, oldest))
+            serve_configure(&v, s);
+        serve_request(&v, s, fd);
+        close(fd);
+        watcher_add_new(&v.watcher, s);
+    }
 
-        // Remove trailing comments
-        char *comment = strchr(begin, '#');
-        if (comment != NULL)
-            *comment = '\0';
+    close(v.listen_fd);
+    watcher_free(&v.watcher);
+    libtree_state_close(s);
+    return 1;
+}
 
-        // Remove trailing whitespace
-        // although, whitespace is technically allowed in paths :think:
-        while (end != begin)
-            if (!isspace(*--end))
-                break;
+/**
+ * end of serve
+ */
 
-        // Skip empty lines
-        if (begin == end)
+/**
+ * watch
+ */
+
+// Changes within this many milliseconds of each other are reported together.
+#define WATCH_SETTLE_MS 100
+
+// Print that `what` of `file` changed from `before` to `after`, where NULL is
+// absent and "" is `empty`. With both NULL, `what` is the change itself.
+static void watch_print_change(struct libtree_state_t *s, char const *file,
+                               char const *what, char const *before,
+                               char const *after, char const *empty) {
+    if (s->json) {
+        out_puts(s, "{\"file\":");
+        out_json_string(s, file);
+        out_puts(s, ",\"what\":");
+        out_json_string(s, what);
+        out_puts(s, ",\"before\":");
+        out_json_string(s, before);
+        out_puts(s, ",\"after\":");
+        out_json_string(s, after);
+        out_puts(s, "}\n");
+        return;
+    }
+    out_puts(s, file);
+    out_puts(s, ": ");
+    out_puts(s, what);
+    if (before == NULL && after == NULL) {
+        out_putc(s, '\n');
+        return;
+    }
+    out_puts(s, ": ");
+    out_puts(s, before == NULL ? "(none)" : *before == '\0' ? empty : before);
+    out_puts(s, " -> ");
+    out_puts(s, after == NULL ? "(none)" : *after == '\0' ? empty : after);
+    out_putc(s, '\n');
+}
+
+// Print the entries of the edges or stacks of `b` that differ from those of
+// `a`, or with `removed` set, the entries of `a` that are not in `b`. Every
+// file in the closure has a stack, so files without one in the other snapshot
+// are reported as added or removed instead.
+static void watch_diff(struct libtree_state_t *s, struct snapshot_t *a,
+                       struct snapshot_t *b, int stacks, int removed) {
+    struct str_map_t *from = stacks ? &a->stacks : &a->edges;
+    struct str_map_t *to = stacks ? &b->stacks : &b->edges;
+    struct string_table_t *keys = removed ? &from->keys : &to->keys;
+    for (size_t i = 0; i < keys->n; i += strlen(keys->arr + i) + 1) {
+        char const *key = keys->arr + i;
+        size_t *was = str_map_get(from, key);
+        size_t *is = str_map_get(to, key);
+        if (removed ? is != NULL
+                    : was != NULL && strcmp(a->values.arr + *was,
+                                            b->values.arr + *is) == 0)
+            continue;
+        if (stacks && (was == NULL || is == NULL)) {
+            watch_print_change(s, key, removed ? "removed" : "added", NULL,
+                               NULL, NULL);
             continue;
+        }
+        // Edges are keyed by the file and the library it needs.
+        char *file = string_copy(key);
+        char const *what = "search paths";
+        char *newline = strchr(file, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+            what = newline + 1;
+        }
+        watch_print_change(s, file, what,
+                           was == NULL ? NULL : a->values.arr + *was,
+                           is == NULL ? NULL : b->values.arr + *is,
+                           stacks ? "none" : "not found");
+        free(file);
+    }
+}
 
-        // Put back the end of the string
-        end[1] = '\0';
+// Record how the libraries of `file` are located, without printing anything.
+static void watch_snapshot(struct libtree_state_t *s, char const *file,
+                           struct snapshot_t *sn) {
+    snapshot_init(sn);
+    sn->ld_cache = s->ld_cache.data != NULL;
+    // Every edge should be recorded, including those of excluded libraries.
+    // Workers that still prefetch for the tree printed before keep the
+    // verbosity of their jobs, only the main thread sees the raised one.
+    int verbosity = s->verbosity;
+    s->verbosity = 2;
+    s->quiet = 1;
+    s->snapshot = sn;
+    ++s->generation;
+    traverse(file, s);
+    s->verbosity = verbosity;
+    s->quiet = 0;
+    s->snapshot = NULL;
+}
 
-        // 'include ': glob whatever follows.
-        if (strncmp(begin, "include", 7) == 0 && isspace(begin[7])) {
-            begin += 8;
-            // Remove more whitespace.
-            for (; isspace(*begin); ++begin) {
-            }
+// Print the tree of `file`, and then what changed whenever inotify reports
+// changes to the files and directories involved, until killed. Only files and
+// directories that changed are read again.
+static int watch(struct libtree_state_t *s, char const *file) {
+    struct watcher_t w;
+    watcher_init(&w);
+    if (w.fd < 0) {
+        fputs("--watch requires inotify\n", stderr);
+        watcher_free(&w);
+        return 1;
+    }
 
-            // String can't be empty as it was trimmed and
-            // still had whitespace next to include.
+    libtree_state_open(s);
+    watcher_configure(&w, s);
+    traverse(file, s);
+    out_flush(s);
 
-            // TODO: check if relative globbing to the
-            // current file is supported or not.
-            // We do *not* support it right now.
-            if (*begin != '/')
-                continue;
+    struct snapshot_t before, after;
+    watch_snapshot(s, file, &before);
+    watcher_add_new(&w, s);
 
-            ld_conf_globbing(st, begin);
-        } else {
-            // Copy over and replace trailing \0 with :.
-            string_table_store(st, begin);
-            st->arr[st->n - 1] = ':';
+    while (1) {
+        struct pollfd fds = {w.fd, POLLIN, 0};
+        if (poll(&fds, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
         }
-    }
+        // Wait for a burst of changes, such as an install, to settle.
+        do
+            watcher_read_events(&w);
+        while (poll(&fds, 1, WATCH_SETTLE_MS) > 0);
+        if (!w.stale && !w.reload)
+            continue;
 
-    fclose(fptr);
+        // Keep the nodes of the last snapshot only.
+        watcher_refresh(&w, s, s->generation);
+        watch_snapshot(s, file, &after);
+        watcher_add_new(&w, s);
+
+        watch_diff(s, &before, &after, 0, 0);
+        watch_diff(s, &before, &after, 0, 1);
+        watch_diff(s, &before, &after, 1, 0);
+        watch_diff(s, &before, &after, 1, 1);
+        out_flush(s);
+        snapshot_free(&before);
+        before = after;
+    }
 
-    return 0;
+    snapshot_free(&before);
+    watcher_free(&w);
+    libtree_state_close(s);
+    return 1;
 }
 
-static void parse_ld_so_conf(struct libtree_state_t *s) {
-    struct string_table_t *st = &s->string_table;
-    s->ld_so_conf_offset = st->n;
+/**
+ * end of watch
+ */
 
-    // Linux / glibc
-    parse_ld_config_file(st, "/etc/ld.so.conf");
+/**
+ * bundle
+ */
 
-    // FreeBSD
-    parse_ld_config_file(st, "/etc/ld-elf.so.conf");
+// Copy the file `src` to `dst`: hard linked when both are on the same file
+// system, cloned when the file system supports it, copied by the kernel
+// otherwise, and read and written as a last resort. Returns 0 on success.
+static int bundle_copy(char const *src, char const *dst) {
+    // Don't write through a hard link of an earlier bundle.
+    unlink(dst);
+    if (linkat(AT_FDCWD, src, AT_FDCWD, dst, AT_SYMLINK_FOLLOW) == 0)
+        return 0;
 
-    // Replace the last semicolon with a '\0'
-    // if we have a nonzero number of paths.
-    if (st->n > s->ld_so_conf_offset) {
-        st->arr[st->n - 1] = '\0';
+    int in = open(src, O_RDONLY);
+    if (in < 0)
+        return 1;
+    struct stat st;
+    int out = fstat(in, &st) != 0
+                  ? -1
+                  : open(dst, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (out < 0) {
+        close(in);
+        return 1;
+    }
+
+    int err = 1;
+#ifdef __linux__
+    if (ioctl(out, FICLONE, in) == 0) {
+        err = 0;
     } else {
-        string_table_store(st, "");
+        off_t copied = 0;
+        ssize_t n;
+        while (copied < st.st_size &&
+               (n = copy_file_range(in, NULL, out, NULL, st.st_size - copied,
+                                    0)) > 0)
+            copied += n;
+        err = copied != st.st_size;
+    }
+#endif
+    if (err != 0 && lseek(in, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0 &&
+        lseek(out, 0, SEEK_SET) == 0) {
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(in, buf, sizeof(buf))) > 0 &&
+               write_all(out, buf, n) == 0)
+            ;
+        err = n != 0;
     }
+    close(in);
+    if (close(out) != 0)
+        err = 1;
+    return err;
 }
 
-static void parse_ld_library_path(struct libtree_state_t *s) {
-    char *LD_LIBRARY_PATH = "LD_LIBRARY_PATH";
-    s->ld_library_path_offset = SIZE_MAX;
-    char *val = getenv(LD_LIBRARY_PATH);
+static void bundle_dest_path(struct bundle_t *b, size_t i, char *path) {
+    char const *dest = b->strings.arr + b->files[i].dest;
+    size_t len = strlen(b->dir);
+    memcpy(path, b->dir, len);
+    path[len] = '/';
+    strcpy(path + len + 1, dest);
+}
 
-    // not set, so nothing to do.
-    if (val == NULL)
-        return;
+static void *bundle_worker(void *arg) {
+    struct bundle_t *b = arg;
+    char *path = malloc(strlen(b->dir) + 4096 + 2);
+    if (path == NULL)
+        exit(1);
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->n)
+            break;
+        struct bundle_file_t *f = &b->files[i];
+        if (f->link != SIZE_MAX)
+            continue;
+        bundle_dest_path(b, i, path);
+        f->error = bundle_copy(b->strings.arr + f->source, path);
+    }
+    free(path);
+    return NULL;
+}
 
-    s->ld_library_path_offset = s->string_table.n;
+// Write the manifest: the destination and source of every file, tab
+// separated, one per line.
+static int bundle_write_manifest(struct bundle_t *b) {
+    struct string_table_t manifest = {NULL, 0, 0};
+    string_table_store(&manifest, b->dir);
+    --manifest.n;
+    string_table_store(&manifest, "/manifest.txt");
+    FILE *fptr = fopen(manifest.arr, "w");
+    free(manifest.arr);
+    if (fptr == NULL)
+        return 1;
+    for (size_t i = 0; i < b->n; ++i) {
+        fputs(b->strings.arr + b->files[i].dest, fptr);
+        fputc('\t', fptr);
+        fputs(b->strings.arr + b->files[i].source, fptr);
+        fputc('\n', fptr);
+    }
+    return fclose(fptr) != 0;
+}
 
-    // otherwise, we just copy it over and replace ; with :
-    string_table_store(&s->string_table, val);
+// Copy the inputs and the libraries they load into `dir`, skipping the
+// libraries that are not shown by default, and write a manifest.
+static int bundle(struct libtree_state_t *s, char const *dir, int pathc,
+                  char **pathv) {
+    struct bundle_t b;
+    bundle_init(&b, dir);
+
+    libtree_state_open(s);
+    s->bundle = &b;
+    s->quiet = 1;
+    // Dependencies of libraries that are shown are collected once.
+    if (s->verbosity > 2)
+        s->verbosity = 2;
+    int code = 0;
+    for (int i = 0; i < pathc; ++i) {
+        int result = traverse(pathv[i], s);
+        if (result != 0) {
+            fputs("Error: could not read `", stderr);
+            fputs(pathv[i], stderr);
+            fputs("`\n", stderr);
+            code = result;
+        }
+        ++s->generation;
+    }
+    s->bundle = NULL;
+    s->quiet = 0;
+    libtree_state_close(s);
 
-    // replace ; with :
-    char *search = s->string_table.arr + s->ld_library_path_offset;
-    while ((search = strchr(search, ';')) != NULL)
-        *search++ = ':';
-}
+    char *path = malloc(strlen(dir) + 4096 + 2);
+    if (path == NULL)
+        exit(1);
+    strcpy(path, dir);
+    strcat(path, "/bin/");
+    make_parent_dirs(path);
+    strcpy(path, dir);
+    strcat(path, "/lib/");
+    make_parent_dirs(path);
+
+    // Copy files in parallel, then link other names to the copies.
+    pthread_t threads[MAX_THREADS];
+    size_t n_threads = 0;
+    for (; n_threads + 1 < s->jobs && n_threads < MAX_THREADS;
+         ++n_threads)
+        if (pthread_create(&threads[n_threads], NULL, bundle_worker, &b) != 0)
+            break;
+    bundle_worker(&b);
+    for (size_t i = 0; i < n_threads; ++i)
+        pthread_join(threads[i], NULL);
 
-static void set_default_paths(struct libtree_state_t *s) {
-    s->default_paths_offset = s->string_table.n;
-    // TODO: how to retrieve this list properly at runtime?
-    string_table_store(&s->string_table, "/lib:/lib64:/usr/lib:/usr/lib64");
-}
+    char *target = malloc(strlen(dir) + 4096 + 2);
+    if (target == NULL)
+        exit(1);
+    for (size_t i = 0; i < b.n; ++i) {
+        struct bundle_file_t *f = &b.files[i];
+        if (f->link == SIZE_MAX)
+            continue;
+        bundle_dest_path(&b, i, path);
+        bundle_dest_path(&b, f->link, target);
+        unlink(path);
+        f->error = b.files[f->link].error || link(target, path) != 0;
+    }
+    free(target);
 
-static void libtree_state_init(struct libtree_state_t *s) {
-    s->string_table.n = 0;
-    s->string_table.capacity = 1024;
-    s->string_table.arr = malloc(s->string_table.capacity);
-    s->visited.n = 0;
-    s->visited.capacity = 256;
-    s->visited.arr = malloc(s->visited.capacity);
-}
+    for (size_t i = 0; i < b.n; ++i) {
+        if (!b.files[i].error)
+            continue;
+        fputs("Error: could not copy `", stderr);
+        fputs(b.strings.arr + b.files[i].source, stderr);
+        fputs("` to `", stderr);
+        bundle_dest_path(&b, i, path);
+        fputs(path, stderr);
+        fputs("`\n", stderr);
+        code = 1;
+    }
+    free(path);
 
-static void libtree_state_free(struct libtree_state_t *s) {
-    free(s->string_table.arr);
-    free(s->visited.arr);
+    if (bundle_write_manifest(&b) != 0) {
+        fputs("Error: could not write the manifest\n", stderr);
+        code = 1;
+    }
+    if (b.missing > 0 || b.conflicts > 0)
+        code = 1;
+    bundle_free(&b);
+    return code;
 }
 
-static int print_tree(int pathc, char **pathv, struct libtree_state_t *s) {
-    // First collect standard paths
-    libtree_state_init(s);
+/**
+ * end of bundle
+ */
 
-    parse_ld_so_conf(s);
-    parse_ld_library_path(s);
-    set_default_paths(s);
+// Read file names separated by newlines or null characters from `file`, or
+// from stdin when `file` is "-", and append them to the array `*pathv`.
+static int read_batch_file(char const *file, int null_separated, int *pathc,
+                           char ***pathv) {
+    FILE *fptr = strcmp(file, "-") == 0 ? stdin : fopen(file, "rb");
+    if (fptr == NULL)
+        return 1;
 
-    int libtree_last_err = 0;
+    struct string_table_t buf = {NULL, 0, 0};
+    while (1) {
+        string_table_maybe_grow(&buf, 65536);
+        size_t n = fread(buf.arr + buf.n, 1, buf.capacity - buf.n, fptr);
+        buf.n += n;
+        if (n == 0)
+            break;
+    }
+    int err = ferror(fptr);
+    if (fptr != stdin)
+        fclose(fptr);
+    if (err) {
+        free(buf.arr);
+        return 1;
+    }
 
-    for (int i = 0; i < pathc; ++i) {
-        int result = recurse(pathv[i], 0, s, EITHER,
-                             (struct found_t){.how = INPUT, .depth = 0});
-        if (result != 0)
-            libtree_last_err = result;
+    // Split into null terminated strings, and count them.
+    string_table_maybe_grow(&buf, 1);
+    buf.arr[buf.n++] = '\0';
+    size_t count = 0;
+    char separator = null_separated ? '\0' : '\n';
+    for (size_t i = 0; i < buf.n; ++i) {
+        if (buf.arr[i] == separator)
+            buf.arr[i] = '\0';
+        if (buf.arr[i] == '\0' && i > 0 && buf.arr[i - 1] != '\0')
+            ++count;
     }
 
-    libtree_state_free(s);
-    return libtree_last_err;
+    // An empty batch adds nothing.
+    if (count == 0) {
+        free(buf.arr);
+        return 0;
+    }
+
+    char **paths = realloc(*pathv, (*pathc + count) * sizeof(char *));
+    if (paths == NULL)
+        exit(1);
+    for (size_t i = 0; i < buf.n; ++i)
+        if (buf.arr[i] != '\0' && (i == 0 || buf.arr[i - 1] == '\0'))
+            paths[(*pathc)++] = buf.arr + i;
+    *pathv = paths;
+
+    // The strings are referenced until exit.
+    return 0;
+}
+
+static int parse_jobs(char const *str, size_t *jobs) {
+    char *end;
+    long val = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || val < 1 || val > MAX_THREADS) {
+        fputs("Expected a number of threads between 1 and 256, got `", stderr);
+        fputs(str, stderr);
+        fputs("`\n", stderr);
+        return 1;
+    }
+    *jobs = val;
+    return 0;
 }
 
 int main(int argc, char **argv) {
     // Enable or disable colors (no-color.com)
     struct libtree_state_t s;
+    if (libtree_state_defaults(&s) != 0)
+        return 1;
     s.color = getenv("NO_COLOR") == NULL && isatty(STDOUT_FILENO);
-    s.verbosity = 0;
-    s.path = 0;
 
     // We want to end up with an array of file names
     // in argv[1] up to argv[positional-1].
     int positional = 1;
 
-    struct utsname uname_val;
-    if (uname(&uname_val) != 0)
-        return 1;
-
-    // Technically this should be AT_PLATFORM, but
-    // (a) the feature is rarely used
-    // (b) it's almost always the same
-    s.PLATFORM = uname_val.machine;
-    s.OSNAME = uname_val.sysname;
-    s.OSREL = uname_val.release;
-
-    // TODO: how to find this value at runtime?
-    s.LIB = "lib";
-
     int opt_help = 0;
     int opt_version = 0;
+    char *opt_batch = NULL;
+    int opt_null = 0;
+    int opt_cache = 0;
+    char *opt_serve = NULL;
+    char *opt_watch = NULL;
+    int opt_dag = 0;
+    int opt_cost = 0;
+    char *opt_bundle = NULL;
 
     // After `--` we treat everything as filenames, not flags.
     int opt_raw = 0;
@@ -1522,6 +8365,68 @@ int main(int argc, char **argv) {
 
             if (strcmp(arg, "version") == 0) {
                 opt_version = 1;
+            } else if (strncmp(arg, "jobs=", 5) == 0) {
+                if (parse_jobs(arg + 5, &s.jobs) != 0)
+                    return 1;
+            } else if (strncmp(arg, "batch=", 6) == 0) {
+                opt_batch = arg + 6;
+            } else if (strcmp(arg, "cache") == 0) {
+                opt_cache = 1;
+            } else if (strncmp(arg, "cache=", 6) == 0) {
+                opt_cache = 1;
+                s.cache_file = arg + 6;
+            } else if (strcmp(arg, "null") == 0) {
+                opt_null = 1;
+            } else if (strcmp(arg, "no-ld-cache") == 0) {
+                s.scan_ld_so_conf = 1;
+            } else if (strcmp(arg, "check-symbols") == 0) {
+                s.check_symbols = 1;
+            } else if (strcmp(arg, "stats") == 0) {
+                s.stats.enabled = 1;
+            } else if (strcmp(arg, "trace") == 0 && i + 1 < argc) {
+                // Either --trace FILE or --trace=FILE
+                s.trace_file = argv[++i];
+            } else if (strncmp(arg, "trace=", 6) == 0) {
+                s.trace_file = arg + 6;
+            } else if (strcmp(arg, "serve") == 0 && i + 1 < argc) {
+                // Either --serve SOCKET or --serve=SOCKET
+                opt_serve = argv[++i];
+            } else if (strncmp(arg, "serve=", 6) == 0) {
+                opt_serve = arg + 6;
+            } else if (strcmp(arg, "watch") == 0 && i + 1 < argc) {
+                // Either --watch FILE or --watch=FILE
+                opt_watch = argv[++i];
+            } else if (strncmp(arg, "watch=", 6) == 0) {
+                opt_watch = arg + 6;
+            } else if (strcmp(arg, "exclude") == 0 && i + 1 < argc) {
+                // Either --exclude PATTERN or --exclude=PATTERN
+                exclude_add(&s.exclude, argv[++i]);
+            } else if (strncmp(arg, "exclude=", 8) == 0) {
+                exclude_add(&s.exclude, arg + 8);
+            } else if ((strcmp(arg, "exclude-from") == 0 && i + 1 < argc) ||
+                       strncmp(arg, "exclude-from=", 13) == 0) {
+                // Either --exclude-from FILE or --exclude-from=FILE
+                char const *file = arg[12] == '=' ? arg + 13 : argv[++i];
+                if (exclude_add_file(&s.exclude, file) != 0) {
+                    fputs("Could not read `", stderr);
+                    fputs(file, stderr);
+                    fputs("`\n", stderr);
+                    return 1;
+                }
+            } else if (strncmp(arg, "dependents=", 11) == 0) {
+                s.dependents = arg + 11;
+            } else if (strcmp(arg, "bundle") == 0 && i + 1 < argc) {
+                // Either --bundle DIR or --bundle=DIR
+                opt_bundle = argv[++i];
+            } else if (strncmp(arg, "bundle=", 7) == 0) {
+                opt_bundle = arg + 7;
+            } else if (strcmp(arg, "dag") == 0) {
+                opt_dag = 1;
+            } else if (strcmp(arg, "cost") == 0) {
+                opt_cost = 1;
+            } else if (strcmp(arg, "json") == 0) {
+                s.json = 1;
+                s.color = 0;
             } else if (strcmp(arg, "path") == 0) {
                 s.path = 1;
             } else if (strcmp(arg, "verbose") == 0) {
@@ -1550,6 +8455,20 @@ int main(int argc, char **argv) {
             case 'v':
                 ++s.verbosity;
                 break;
+            case '0':
+                opt_null = 1;
+                break;
+            case 'j':
+                // Either -jN or -j N
+                if (arg[1] == '\0' && i + 1 < argc)
+                    arg = argv[++i];
+                else
+                    ++arg;
+                if (parse_jobs(arg, &s.jobs) != 0)
+                    return 1;
+                // Point to the null terminator to stop parsing this flag.
+                arg += strlen(arg) - 1;
+                break;
             default:
                 fputs("Unrecognized flag `-", stderr);
                 fputs(arg, stderr);
@@ -1563,7 +8482,8 @@ int main(int argc, char **argv) {
     --positional;
 
     // Print a help message on -h, --help or no positional args.
-    if (opt_help || (!opt_version && positional == 0)) {
+    if (opt_help || (!opt_version && positional == 0 && opt_batch == NULL &&
+                     opt_serve == NULL && opt_watch == NULL)) {
         // clang-format off
         fputs("Show the dynamic dependency tree of ELF files\n"
               "Usage: libtree [OPTION]... [--] FILE [FILES]...\n"
@@ -1574,11 +8494,66 @@ int main(int argc, char **argv) {
               "File names starting with '-', for example '-.so', can be specified as follows:\n"
               "  libtree -- -.so\n"
               "\n"
+              "Batch options:\n"
+              "  --batch=FILE   Read file names from FILE, or from stdin if FILE is -,\n"
+              "                 one per line, and show a separate tree for each file\n"
+              "  -0, --null     File names in FILE are separated by null characters\n"
+              "\n"
+              "Reverse dependency options:\n"
+              "  --dependents=LIB  Crawl the FILEs, which may be directories, and\n"
+              "                 show the files that need LIB, by path or soname.\n"
+              "                 With --json, every file names the file it needs\n"
+              "\n"
+              "Bundling options:\n"
+              "  --bundle DIR   Copy the FILEs to DIR/bin and the libraries they\n"
+              "                 load to DIR/lib, which an rpath of $ORIGIN/../lib\n"
+              "                 locates. Libraries skipped by default are not\n"
+              "                 copied. DIR/manifest.txt lists what was copied.\n"
+              "                 Files on the same file system as DIR are hard\n"
+              "                 linked, so replace rather than edit them\n"
+              "\n"
+              "Long running options:\n"
+              "  --serve SOCKET Answer requests on the Unix socket SOCKET, keeping\n"
+              "                 files cached until their directories change. A request\n"
+              "                 is a list of files, one per line, after optional\n"
+              "                 LD_LIBRARY_PATH=, PLATFORM=, LIB=, OSNAME=, OSREL= or\n"
+              "                 FORMAT=json lines, up to an empty line. The response\n"
+              "                 ends with a status line\n"
+              "  --watch FILE   Print the tree of FILE, and then what changed whenever\n"
+              "                 files or directories involved change: libraries\n"
+              "                 found elsewhere or no longer found, and changed\n"
+              "                 search paths\n"
+              "\n"
               "Locating libs options:\n"
               "  -p, --path     Show the path of libraries instead of the soname\n"
+              "  --json         Print one JSON object per line for every library,\n"
+              "                 with its parent, path and how it was found\n"
               "  -v             Show libraries skipped by default*\n"
               "  -vv            Show dependencies of libraries skipped by default*\n"
               "  -vvv           Show dependencies of already encountered libraries\n"
+              "  --dag          Show the dependencies of every library, but only once\n"
+              "                 per search context: later occurrences refer back to\n"
+              "                 the first by its label. Libraries skipped by\n"
+              "                 default are only expanded with -vv\n"
+              "  --exclude PATTERN  Also skip libraries whose soname matches the glob\n"
+              "                 PATTERN by default, or don't skip them when it\n"
+              "                 starts with '!'. The last matching pattern wins\n"
+              "  --exclude-from FILE  Read --exclude patterns from FILE, one per line\n"
+              "  --no-ld-cache  Scan ld.so.conf directories instead of using\n"
+              "                 /etc/ld.so.cache\n"
+              "  -j N, --jobs=N Read files using N threads (default: 1)\n"
+              "  --check-symbols  Show undefined symbols that no loaded library\n"
+              "                 defines\n"
+              "  --cost         Show the relocations, PLT relocations, text\n"
+              "                 relocations, BIND_NOW and hash style of every\n"
+              "                 library, then the totals over every loaded file,\n"
+              "                 hidden ones too, and the libraries that need the\n"
+              "                 most symbol lookups\n"
+              "  --cache[=FILE] Keep parsed files in FILE across runs (default:\n"
+              "                 $XDG_CACHE_HOME/libtree/nodes)\n"
+              "  --stats        Print counters and timings to stderr at exit\n"
+              "  --trace FILE   Write a timeline of file visits and search path\n"
+              "                 probes to FILE in Chrome trace format\n"
               "\n"
               "* For brevity, the following libraries are not shown by default:\n"
               "  ",
@@ -1622,5 +8597,85 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    return print_tree(positional, argv, &s);
+    char *default_cache_file = NULL;
+    if (opt_cache && s.cache_file == NULL) {
+        s.cache_file = default_cache_file = disk_cache_default_path();
+        if (s.cache_file == NULL) {
+            fputs("Could not determine the cache directory, set "
+                  "XDG_CACHE_HOME or use --cache=FILE\n",
+                  stderr);
+            return 1;
+        }
+    }
+
+    // Subtrees are shown once, which -vvv contradicts.
+    if (opt_dag && s.verbosity > 2) {
+        fputs("--dag shows every subtree once, use -vv at most\n", stderr);
+        return 1;
+    }
+    struct dag_t dag;
+    if (opt_dag) {
+        dag_init(&dag);
+        s.dag = &dag;
+    }
+
+    if (opt_cost && (opt_serve != NULL || opt_watch != NULL ||
+                     opt_bundle != NULL || s.dependents != NULL)) {
+        fputs("--cost only applies to the trees of files\n", stderr);
+        return 1;
+    }
+    struct cost_t cost;
+    if (opt_cost) {
+        cost_init(&cost);
+        s.cost = &cost;
+    }
+
+    int code;
+    if (opt_serve != NULL) {
+        if (positional > 0 || opt_batch != NULL || s.dependents != NULL) {
+            fputs("--serve takes files from requests only\n", stderr);
+            return 1;
+        }
+        code = serve(&s, opt_serve);
+    } else if (opt_watch != NULL) {
+        if (positional > 0 || opt_batch != NULL || s.dependents != NULL) {
+            fputs("--watch takes a single file\n", stderr);
+            return 1;
+        }
+        code = watch(&s, opt_watch);
+    } else if (opt_bundle != NULL) {
+        if (opt_batch != NULL || s.dependents != NULL) {
+            fputs("--bundle takes files as arguments only\n", stderr);
+            return 1;
+        }
+        code = bundle(&s, opt_bundle, positional, argv);
+    } else if (opt_batch == NULL) {
+        code = print_tree(positional, argv, &s);
+    } else {
+        // Batch mode: positional args come first.
+        char **inputs = malloc((positional + 1) * sizeof(char *));
+        if (inputs == NULL)
+            return 1;
+        memcpy(inputs, argv, positional * sizeof(char *));
+        if (read_batch_file(opt_batch, opt_null, &positional, &inputs) != 0) {
+            fputs("Could not read `", stderr);
+            fputs(opt_batch, stderr);
+            fputs("`\n", stderr);
+            return 1;
+        }
+
+        s.batch = 1;
+        code = print_tree(positional, inputs, &s);
+        free(inputs);
+    }
+
+    free(default_cache_file);
+    exclude_free(&s.exclude);
+    if (opt_dag)
+        dag_free(&dag);
+    if (opt_cost)
+        cost_free(&cost);
+    return code;
 }
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef LIBTREE_H
+#define LIBTREE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Locate the shared libraries of ELF files the way the dynamic loader does,
+// without running the libtree executable. Build libtree.a or libtree.so with
+// `make lib`.
+//
+// A context holds the search configuration and caches parsed files, directory
+// listings and search results, so that resolving many files with one context
+// is cheap. Contexts don't share state: different threads can use different
+// contexts at the same time, but a context must only be used by one thread at
+// a time. Cached files are not reread, so create a new context when libraries
+// may have changed on disk. Like the libtree executable, the library exits the
+// process when it runs out of memory.
+
+// How a library was located, in the order the dynamic loader tries.
+typedef enum {
+    LIBTREE_INPUT,
+    LIBTREE_DIRECT,
+    LIBTREE_RPATH,
+    LIBTREE_LD_LIBRARY_PATH,
+    LIBTREE_RUNPATH,
+    // In /etc/ld.so.cache, or in the ld.so.conf directories when
+    // `scan_ld_so_conf` is set.
+    LIBTREE_LD_SO_CACHE,
+    LIBTREE_LD_SO_CONF,
+    LIBTREE_DEFAULT
+} libtree_how_t;
+
+// Search configuration. Zero initialize for the defaults. Strings are not
+// copied, and must outlive the context.
+struct libtree_options_t {
+    // Values of $PLATFORM, $OSNAME and $OSREL in rpaths, or NULL to use
+    // uname(2).
+    char const *platform;
+    char const *osname;
+    char const *osrel;
+    // Value of $LIB in rpaths, or NULL for "lib".
+    char const *lib;
+    // Library search path, or NULL to use the LD_LIBRARY_PATH environment
+    // variable at the time the context is created.
+    char const *ld_library_path;
+    // Scan the ld.so.conf directories instead of using /etc/ld.so.cache.
+    int scan_ld_so_conf;
+    // Number of threads reading files, 0 or 1 to read them on the calling
+    // thread.
+    size_t jobs;
+    // Persistent cache of parsed files, or NULL to disable it.
+    char const *cache_file;
+};
+
+// A file in the graph.
+struct libtree_node_t {
+    // The first path by which the file was reached.
+    char const *path;
+    // DT_SONAME, or NULL.
+    char const *soname;
+    // 32 or 64.
+    int bits;
+};
+
+// A file needs a library, by index in the nodes of the graph.
+struct libtree_edge_t {
+    size_t parent;
+    size_t child;
+    libtree_how_t how;
+    // With LIBTREE_RPATH, the depth of the file whose rpath located the child,
+    // where inputs are 1, as in `[rpath of N]`. Zero otherwise.
+    size_t rpath_depth;
+};
+
+// A needed library that could not be located.
+struct libtree_missing_t {
+    size_t parent;
+    char const *name;
+};
+
+struct libtree_input_t {
+    char const *path;
+    // Index of the input in the nodes of the graph, or SIZE_MAX on error.
+    size_t node;
+    // Zero, or the reason the input can't be used, see libtree_strerror.
+    int error;
+};
+
+// The dependencies of a set of inputs. Nodes are listed in the order they were
+// reached, and every edge is listed once.
+struct libtree_graph_t {
+    struct libtree_input_t *inputs;
+    size_t inputs_n;
+    struct libtree_node_t *nodes;
+    size_t nodes_n;
+    struct libtree_edge_t *edges;
+    size_t edges_n;
+    struct libtree_missing_t *missing;
+    size_t missing_n;
+    // Problems that did not stop resolution, such as a stale ld.so.cache, as
+    // messages. Each is given once per context.
+    char const **warnings;
+    size_t warnings_n;
+    // Storage of all strings in the graph.
+    char *strings;
+};
+
+typedef struct libtree_state_t libtree_context_t;
+
+// Returns NULL when `options` is invalid. `options` may be NULL.
+libtree_context_t *
+libtree_context_create(struct libtree_options_t const *options);
+
+void libtree_context_free(libtree_context_t *ctx);
+
+// Locate the dependencies of `n` files. The graph must be freed with
+// libtree_graph_free.
+struct libtree_graph_t *libtree_resolve(libtree_context_t *ctx,
+                                        char const *const *paths, size_t n);
+
+void libtree_graph_free(struct libtree_graph_t *graph);
+
+// Describes the error code of an input.
+char const *libtree_strerror(int error);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,91 @@
+// Writes a big endian ELF file with a dynamic section, since compilers only
+// produce files in the byte order of the host.
+// Usage: mkelf 32|64 FILE SONAME [NEEDED]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+static unsigned char buf[1024];
+static char strtab[256] = "";
+static size_t strsz = 1;
+
+static void put(size_t offset, size_t size, uint64_t value) {
+    for (size_t i = 0; i < size; ++i)
+        buf[offset + i] = (unsigned char)(value >> (8 * (size - 1 - i)));
+}
+
+static size_t add_string(char const *str) {
+    size_t offset = strsz;
+    memcpy(strtab + strsz, str, strlen(str) + 1);
+    strsz += strlen(str) + 1;
+    return offset;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4 || strlen(argv[3]) > 64 || (argc > 4 && strlen(argv[4]) > 64))
+        return 1;
+    int is64 = strcmp(argv[1], "64") == 0;
+    size_t word = is64 ? 8 : 4;
+    size_t ehsize = is64 ? 64 : 52;
+    size_t phentsize = is64 ? 56 : 32;
+
+    size_t soname = add_string(argv[3]);
+    size_t runpath = add_string("$ORIGIN");
+    size_t needed = argc > 4 ? add_string(argv[4]) : 0;
+
+    // Header, PT_LOAD and PT_DYNAMIC, the dynamic section, the strings. The
+    // file is loaded at address 0.
+    size_t dyn = ehsize + 2 * phentsize;
+    size_t dyn_n = argc > 4 ? 6 : 5;
+    size_t str = dyn + dyn_n * 2 * word;
+    size_t size = str + strsz;
+
+    memcpy(buf, "\177ELF", 4);
+    buf[4] = is64 ? 2 : 1;
+    buf[5] = 2;
+    buf[6] = 1;
+    put(16, 2, 3);              // e_type: ET_DYN
+    put(18, 2, is64 ? 21 : 20); // e_machine: PowerPC
+    put(20, 4, 1);              // e_version
+    put(is64 ? 32 : 28, word, ehsize);
+    put(is64 ? 52 : 40, 2, ehsize);
+    put(is64 ? 54 : 42, 2, phentsize);
+    put(is64 ? 56 : 44, 2, 2);
+
+    uint64_t phdrs[2][3] = {{1, 0, size}, {2, dyn, dyn_n * 2 * word}};
+    for (size_t i = 0; i < 2; ++i) {
+        size_t p = ehsize + i * phentsize;
+        put(p, 4, phdrs[i][0]);
+        if (is64) {
+            put(p + 4, 4, 4);
+            put(p + 8, 8, phdrs[i][1]);
+            put(p + 16, 8, phdrs[i][1]);
+            put(p + 32, 8, phdrs[i][2]);
+            put(p + 40, 8, phdrs[i][2]);
+        } else {
+            put(p + 4, 4, phdrs[i][1]);
+            put(p + 8, 4, phdrs[i][1]);
+            put(p + 16, 4, phdrs[i][2]);
+            put(p + 20, 4, phdrs[i][2]);
+            put(p + 24, 4, 4);
+        }
+    }
+
+    // DT_SONAME, DT_RUNPATH, DT_STRTAB, DT_STRSZ, DT_NEEDED, DT_NULL.
+    uint64_t entries[6][2] = {{14, soname}, {29, runpath}, {5, str},
+                              {10, strsz},  {1, needed},   {0, 0}};
+    for (size_t i = 0, j = 0; i < 6; ++i) {
+        if (entries[i][0] == 1 && argc <= 4)
+            continue;
+        put(dyn + j * 2 * word, word, entries[i][0]);
+        put(dyn + j * 2 * word + word, word, entries[i][1]);
+        ++j;
+    }
+    memcpy(buf + str, strtab, strsz);
+
+    FILE *f = fopen(argv[2], "wb");
+    if (f == NULL || fwrite(buf, 1, size, f) != size || fclose(f) != 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,76 @@
+// Resolve exe with the library API, and check the graph against what the
+// Makefile built: exe needs liba.so and libc.so.6, and liba.so needs libb.so,
+// both found in the rpath of exe.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libtree.h"
+
+static int failures = 0;
+
+static void expect(int ok, char const *what) {
+    if (ok)
+        return;
+    fprintf(stderr, "check_graph: %s\n", what);
+    ++failures;
+}
+
+static struct libtree_edge_t const *edge(struct libtree_graph_t const *g,
+                                         char const *soname) {
+    for (size_t i = 0; i < g->edges_n; ++i) {
+        char const *s = g->nodes[g->edges[i].child].soname;
+        if (s != NULL && strcmp(s, soname) == 0)
+            return &g->edges[i];
+    }
+    return NULL;
+}
+
+static void check(int scan_ld_so_conf) {
+    struct libtree_options_t options;
+    memset(&options, 0, sizeof(options));
+    options.ld_library_path = "";
+    options.scan_ld_so_conf = scan_ld_so_conf;
+    libtree_context_t *ctx = libtree_context_create(&options);
+    char const *paths[] = {"exe", "nonexistent"};
+    struct libtree_graph_t *g = libtree_resolve(ctx, paths, 2);
+
+    expect(g->inputs_n == 2, "two inputs");
+    expect(g->inputs[0].error == 0 && g->inputs[0].node != SIZE_MAX,
+           "exe is read");
+    expect(g->inputs[1].error != 0 && g->inputs[1].node == SIZE_MAX,
+           "nonexistent is an error");
+    expect(g->missing_n == 0, "nothing is missing");
+
+    struct libtree_edge_t const *a = edge(g, "liba.so");
+    expect(a != NULL && a->parent == g->inputs[0].node, "exe needs liba.so");
+    expect(a != NULL && a->how == LIBTREE_RPATH && a->rpath_depth == 1,
+           "liba.so is in the rpath of exe");
+    struct libtree_edge_t const *b = edge(g, "libb.so");
+    expect(b != NULL && b->parent == a->child, "liba.so needs libb.so");
+    expect(b != NULL && b->how == LIBTREE_RPATH && b->rpath_depth == 1,
+           "libb.so is in the rpath of exe");
+    expect(b != NULL && strstr(g->nodes[b->child].path, "/lib/libb.so") != NULL,
+           "libb.so is in lib");
+
+    struct libtree_edge_t const *c = edge(g, "libc.so.6");
+    if (!scan_ld_so_conf && access("/etc/ld.so.cache", R_OK) == 0)
+        expect(c != NULL && c->how == LIBTREE_LD_SO_CACHE,
+               "libc.so.6 is in ld.so.cache");
+    else
+        expect(c != NULL && (c->how == LIBTREE_LD_SO_CONF ||
+                             c->how == LIBTREE_DEFAULT),
+               "libc.so.6 is in the ld.so.conf or default directories");
+    expect(c == NULL || c->rpath_depth == 0, "libc.so.6 has no rpath depth");
+
+    libtree_graph_free(g);
+    libtree_context_free(ctx);
+}
+
+int main(void) {
+    check(0);
+    check(1);
+    return failures != 0;
+}